@@ -2,6 +2,10 @@
 // Use of this source code is governed by an MIT-style
 // license that can be found in the LICENSE file.
 
+// The journal needs fileno and ftruncate, which are POSIX.
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,14 +13,33 @@
 #include <math.h>
 #include <stdbool.h>
 #include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#define RTREE_IMPL
 #include "rtree.h"
 
 ////////////////////////////////
 
+// The coordinate type is set with RTREE_NUMTYPE, which rtree.h defaults to
+// double. It may also be set from the command line.
 #define DATATYPE void *
-#define NUMTYPE double
+#define NUMTYPE RTREE_NUMTYPE
+
+// The number of dimensions and the node size do not change the API and may
+// also be set from the command line, e.g. -DDIMS=3
+#ifndef DIMS
 #define DIMS 2
+#endif
+#ifndef MAX_ENTRIES
 #define MAX_ENTRIES 64
+#endif
+#if MAX_ENTRIES > 64
+#error "MAX_ENTRIES must be at most 64, the bits of the tombstones of a node"
+#endif
 
 ////////////////////////////////
 
@@ -31,6 +54,40 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr)
+#endif
+
+// Integer coordinates, from RTREE_INT32 or RTREE_UINT32, measure rects with
+// exact 64-bit math. In two dimensions the areas are exact too, because the
+// product of two 32-bit lengths always fits in 64 bits.
+#if defined(RTREE_INT32) || defined(RTREE_UINT32)
+#define INTCOORDS
+typedef int64_t length_t;
+#if DIMS <= 2
+typedef uint64_t area_t;
+#define AREA_MAX UINT64_MAX
+#else
+typedef double area_t;
+#define AREA_MAX INFINITY
+#endif
+#else
+typedef double length_t;
+typedef double area_t;
+#define AREA_MAX INFINITY
+#endif
+
+// A two dimensional rect of 32-bit integers fills one SSE2 register, which
+// is compared to another rect four coordinates at a time. Define 
+// RTREE_NOSIMD to use the plain loops instead.
+#if defined(INTCOORDS) && DIMS == 2 && defined(__SSE2__) && \
+    !defined(RTREE_NOSIMD)
+#define SIMDRECTS
+#include <emmintrin.h>
+#endif
+
 enum kind {
     LEAF = 1,
     BRANCH = 2,
@@ -49,6 +106,9 @@ struct node {
     atomic_int rc;      // reference counter for copy-on-write
     enum kind kind;     // LEAF or BRANCH
     int count;          // number of rects
+    int isize;          // size of the inline items of a leaf, or 0
+    size_t dead;        // number of lazily deleted items in the subtree
+    uint64_t tombs;     // bits of the lazily deleted items of a leaf
     struct rect rects[MAX_ENTRIES];
     union {
         struct node *children[MAX_ENTRIES];
@@ -66,24 +126,93 @@ struct rtree {
     void *udata;
     bool (*item_clone)(const DATATYPE item, DATATYPE *into, void *udata);
     void (*item_free)(const DATATYPE item, void *udata);
+    int isize;          // size of inline items, or 0 for DATATYPE items
+    bool lazy;          // deletes leave tombstones for rtree_compact
+    uint64_t (*item_id)(const DATATYPE item, void *udata);
+    struct idmap *ids;  // index of the item rects by ID, or NULL when empty
+    struct node **bufs; // leaves of the write buffer
+    struct rect *brects;// rects of the write buffer leaves
+    int nbufs;          // number of write buffer leaves in use
+    int maxbufs;        // number of write buffer leaves, or 0 for no buffer
+    size_t bcount;      // number of items in the write buffer
+    struct journal *journal;
+    struct trace *trace;
 };
 
 void rtree_set_udata(struct rtree *tr, void *udata) {
     tr->udata = udata;
 }
 
+// Leaves with inline items store the items back to back in place of the 
+// items array, and are allocated with just enough room for them.
+static size_t node_size(enum kind kind, int isize) {
+    if (kind == LEAF && isize) {
+        return offsetof(struct node, items) + (size_t)isize*MAX_ENTRIES;
+    }
+    return sizeof(struct node);
+}
+
+// node_item_size returns the number of bytes of each item in a leaf.
+static size_t node_item_size(const struct node *node) {
+    return node->isize ? (size_t)node->isize : sizeof(struct item);
+}
+
+// node_item returns the address of an item in a leaf.
+static char *node_item(const struct node *node, int index) {
+    return (char *)node->items + node_item_size(node)*(size_t)index;
+}
+
+// node_data returns the data of an item in a leaf, which is the address of
+// the item itself when it's inline.
+static DATATYPE node_data(const struct node *node, int index) {
+    if (node->isize) {
+        return (DATATYPE)node_item(node, index);
+    }
+    return node->items[index].data;
+}
+
+// node_tomb returns true when an item of a leaf was deleted lazily. Its 
+// rect and data stay in place until the leaf is compacted, but the data has
+// been freed.
+static bool node_tomb(const struct node *node, int index) {
+    return (node->tombs >> index) & 1;
+}
+
+static void node_tomb_set(struct node *node, int index, bool tomb) {
+    node->tombs = (node->tombs & ~((uint64_t)1 << index)) | 
+        ((uint64_t)tomb << index);
+}
+
+// node_tombs_open makes room for an item at index, moving the tombstones 
+// from there on up by one.
+static void node_tombs_open(struct node *node, int index) {
+    uint64_t low = ((uint64_t)1 << index) - 1;
+    node->tombs = (node->tombs & low) | ((node->tombs & ~low) << 1);
+}
+
+// node_tombs_close drops the tombstone at index, moving the ones after it 
+// down by one.
+static void node_tombs_close(struct node *node, int index) {
+    uint64_t low = ((uint64_t)1 << index) - 1;
+    uint64_t high = index < 63 ? node->tombs >> (index+1) << index : 0;
+    node->tombs = (node->tombs & low) | high;
+}
+
 static struct node *node_new(struct rtree *tr, enum kind kind) {
-    struct node *node = (struct node *)tr->malloc(sizeof(struct node));
+    size_t size = node_size(kind, tr->isize);
+    struct node *node = (struct node *)tr->malloc(size);
     if (!node) return NULL;
-    memset(node, 0, sizeof(struct node));
+    memset(node, 0, size);
     node->kind = kind;
+    node->isize = kind == LEAF ? tr->isize : 0;
     return node;
 }
 
 static struct node *node_copy(struct rtree *tr, struct node *node) {
-    struct node *node2 = (struct node *)tr->malloc(sizeof(struct node));
+    size_t size = node_size(node->kind, node->isize);
+    struct node *node2 = (struct node *)tr->malloc(size);
     if (!node2) return NULL;
-    memcpy(node2, node, sizeof(struct node));
+    memcpy(node2, node, size);
     node2->rc = 0;
     if (node2->kind == BRANCH) {
         for (int i = 0; i < node2->count; i++) {
@@ -94,6 +223,10 @@ static struct node *node_copy(struct rtree *tr, struct node *node) {
             int n = 0;
             bool oom = false;
             for (int i = 0; i < node2->count; i++) {
+                if (node_tomb(node2, i)) {
+                    n++;
+                    continue;
+                }
                 if (!tr->item_clone(node->items[i].data, &node2->items[i].data,
                     tr->udata))
                 {
@@ -105,7 +238,9 @@ static struct node *node_copy(struct rtree *tr, struct node *node) {
             if (oom) {
                 if (tr->item_free) {
                     for (int i = 0; i < n; i++) {
-                        tr->item_free(node2->items[i].data, tr->udata);
+                        if (!node_tomb(node2, i)) {
+                            tr->item_free(node2->items[i].data, tr->udata);
+                        }
                     }
                 }
                 tr->free(node2);
@@ -125,7 +260,9 @@ static void node_free(struct rtree *tr, struct node *node) {
     } else {
         if (tr->item_free) {
             for (int i = 0; i < node->count; i++) {
-                tr->item_free(node->items[i].data, tr->udata);
+                if (!node_tomb(node, i)) {
+                    tr->item_free(node->items[i].data, tr->udata);
+                }
             }
         }
     }
@@ -141,6 +278,380 @@ static void node_free(struct rtree *tr, struct node *node) {
     } \
 }
 
+////////////////////////////////
+// id index
+////////////////////////////////
+
+// The id index maps the ID of each item to the rect of the item, which turns
+// a delete by ID into a delete with the exact rect. It's a hash table with 
+// linear probing that, like the nodes, is shared by clones until one of them
+// changes it.
+
+struct identry {
+    uint64_t id;
+    bool used;
+    struct rect rect;
+};
+
+struct idmap {
+    atomic_int rc;      // reference counter for copy-on-write
+    size_t cap;         // number of entries, a power of two
+    size_t count;       // number of used entries
+    struct identry entries[];
+};
+
+// id_hash is the finalizer of splitmix64.
+static size_t id_hash(uint64_t id) {
+    id ^= id >> 30;
+    id *= 0xbf58476d1ce4e5b9;
+    id ^= id >> 27;
+    id *= 0x94d049bb133111eb;
+    id ^= id >> 31;
+    return (size_t)id;
+}
+
+static struct idmap *idmap_new(struct rtree *tr, size_t cap) {
+    size_t size = sizeof(struct idmap)+cap*sizeof(struct identry);
+    struct idmap *map = (struct idmap *)tr->malloc(size);
+    if (!map) return NULL;
+    memset(map, 0, size);
+    map->cap = cap;
+    return map;
+}
+
+static void idmap_release(struct rtree *tr, struct idmap *map) {
+    if (map && atomic_fetch_sub(&map->rc, 1) == 0) {
+        tr->free(map);
+    }
+}
+
+static struct identry *idmap_get(struct idmap *map, uint64_t id) {
+    if (!map) return NULL;
+    size_t mask = map->cap-1;
+    for (size_t i = id_hash(id)&mask; map->entries[i].used; i = (i+1)&mask) {
+        if (map->entries[i].id == id) {
+            return &map->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// idmap_set adds or replaces the entry of an ID. There must be room for it.
+static void idmap_set(struct idmap *map, uint64_t id, const struct rect *rect) {
+    size_t mask = map->cap-1;
+    size_t i = id_hash(id)&mask;
+    while (map->entries[i].used && map->entries[i].id != id) {
+        i = (i+1)&mask;
+    }
+    if (!map->entries[i].used) {
+        map->entries[i].used = true;
+        map->entries[i].id = id;
+        map->count++;
+    }
+    map->entries[i].rect = *rect;
+}
+
+// idmap_del removes the entry of an ID, and moves the entries that follow 
+// it back into the hole when that's nearer to their home slot.
+static void idmap_del(struct idmap *map, uint64_t id) {
+    struct identry *entry = idmap_get(map, id);
+    if (!entry) return;
+    size_t mask = map->cap-1;
+    size_t i = (size_t)(entry-map->entries);
+    for (size_t j = (i+1)&mask; map->entries[j].used; j = (j+1)&mask) {
+        size_t home = id_hash(map->entries[j].id)&mask;
+        if (((j-home)&mask) >= ((j-i)&mask)) {
+            map->entries[i] = map->entries[j];
+            i = j;
+        }
+    }
+    map->entries[i].used = false;
+    map->count--;
+}
+
+// ids_reserve makes sure that the index is not shared with a clone and has 
+// room for n more entries. This is called before an operation modifies the 
+// tree, so that running out of memory leaves the tree untouched.
+static bool ids_reserve(struct rtree *tr, size_t n) {
+    if (!tr->item_id || (n == 0 && !tr->ids)) {
+        return true;
+    }
+    struct idmap *map = tr->ids;
+    size_t count = map ? map->count : 0;
+    size_t cap = map ? map->cap : 16;
+    while ((count+n)*4 > cap*3) {
+        cap *= 2;
+    }
+    if (map && cap == map->cap && atomic_load(&map->rc) == 0) {
+        return true;
+    }
+    struct idmap *map2 = idmap_new(tr, cap);
+    if (!map2) return false;
+    if (map && cap == map->cap) {
+        memcpy(map2->entries, map->entries, cap*sizeof(struct identry));
+        map2->count = map->count;
+    } else if (map) {
+        for (size_t i = 0; i < map->cap; i++) {
+            if (map->entries[i].used) {
+                idmap_set(map2, map->entries[i].id, &map->entries[i].rect);
+            }
+        }
+    }
+    idmap_release(tr, map);
+    tr->ids = map2;
+    return true;
+}
+
+////////////////////////////////
+// journal
+////////////////////////////////
+
+#define JOURNAL_INSERT '+'
+#define JOURNAL_DELETE '-'
+
+// A journal record is an op byte, followed by the rect, the data, and a
+// checksum of the preceding bytes. A torn record at the tail of the file,
+// which is what a crash in the middle of a write leaves behind, is detected
+// by a short read or a bad checksum and is ignored during replay.
+#define JOURNAL_RECSIZE (1+sizeof(struct rect)+sizeof(DATATYPE)+4)
+
+struct journal_header {
+    char magic[4];
+    uint32_t recsize;
+    uint64_t gen;       // generation, must match the snapshot generation
+    uint64_t count;     // number of items, only used by snapshots
+};
+
+struct journal {
+    FILE *file;
+    char *path;         // journal path
+    char *snap_path;    // snapshot path
+    char *tmp_path;     // snapshot path + ".tmp"
+    char *dir_path;     // directory of the snapshot
+    uint64_t gen;
+    long end;           // file offset following the last committed record
+    int group;          // number of records per group commit
+    int nrecs;          // number of records waiting in buf
+    bool reset;         // file must be restarted for the new generation
+    unsigned char *buf;
+};
+
+static uint32_t journal_checksum(const unsigned char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void journal_encode(unsigned char *rec, int op, const struct rect *rect,
+    const DATATYPE data)
+{
+    rec[0] = (unsigned char)op;
+    memcpy(rec+1, rect, sizeof(struct rect));
+    memcpy(rec+1+sizeof(struct rect), &data, sizeof(DATATYPE));
+    uint32_t sum = journal_checksum(rec, JOURNAL_RECSIZE-4);
+    memcpy(rec+JOURNAL_RECSIZE-4, &sum, 4);
+}
+
+static bool journal_decode(const unsigned char *rec, int *op,
+    struct rect *rect, DATATYPE *data)
+{
+    uint32_t sum;
+    memcpy(&sum, rec+JOURNAL_RECSIZE-4, 4);
+    if (sum != journal_checksum(rec, JOURNAL_RECSIZE-4)) {
+        return false;
+    }
+    *op = rec[0];
+    memcpy(rect, rec+1, sizeof(struct rect));
+    memcpy(data, rec+1+sizeof(struct rect), sizeof(DATATYPE));
+    return true;
+}
+
+static void journal_header_init(struct journal_header *hdr, const char *magic,
+    size_t recsize, uint64_t gen, uint64_t count)
+{
+    memset(hdr, 0, sizeof(struct journal_header));
+    memcpy(hdr->magic, magic, 4);
+    hdr->recsize = (uint32_t)recsize;
+    hdr->gen = gen;
+    hdr->count = count;
+}
+
+static bool journal_header_valid(const struct journal_header *hdr, 
+    const char *magic, size_t recsize)
+{
+    return memcmp(hdr->magic, magic, 4) == 0 && hdr->recsize == recsize;
+}
+
+static bool file_sync(FILE *file) {
+    return fflush(file) == 0 && fsync(fileno(file)) == 0;
+}
+
+// dir_sync syncs a directory, so that a rename in it reaches stable storage.
+static bool dir_sync(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    return close(fd) == 0 && ok;
+}
+
+// journal_reset truncates the journal file following a checkpoint and starts
+// it over with a header for the new generation.
+static bool journal_reset(struct journal *j) {
+    struct journal_header hdr;
+    journal_header_init(&hdr, "RTJ1", JOURNAL_RECSIZE, j->gen, 0);
+    if (fflush(j->file) != 0 || ftruncate(fileno(j->file), 0) != 0 ||
+        fseek(j->file, 0, SEEK_SET) != 0 ||
+        fwrite(&hdr, sizeof(struct journal_header), 1, j->file) != 1 ||
+        !file_sync(j->file))
+    {
+        return false;
+    }
+    j->end = (long)sizeof(struct journal_header);
+    j->reset = false;
+    return true;
+}
+
+// journal_commit writes all waiting records to the file and syncs them to
+// stable storage.
+static bool journal_commit(struct journal *j) {
+    if (j->reset && (!dir_sync(j->dir_path) || !journal_reset(j))) {
+        return false;
+    }
+    if (j->nrecs == 0) {
+        return true;
+    }
+    // Always write from the end of the last commit, so that a group that
+    // failed halfway is overwritten when retried.
+    size_t n = (size_t)j->nrecs;
+    if (fseek(j->file, j->end, SEEK_SET) != 0 ||
+        fwrite(j->buf, JOURNAL_RECSIZE, n, j->file) != n || 
+        !file_sync(j->file))
+    {
+        return false;
+    }
+    j->end += (long)(n*JOURNAL_RECSIZE);
+    j->nrecs = 0;
+    return true;
+}
+
+// journal_reserve makes sure that there's room in the journal buffer for n
+// more records. This is called before an operation modifies the tree, so that
+// a failed group commit leaves the tree untouched. The buffer has room for 
+// one record past the group, for the two records of an update.
+static bool journal_reserve(struct rtree *tr, int n) {
+    if (tr->journal && tr->journal->nrecs+n > tr->journal->group) {
+        return journal_commit(tr->journal);
+    }
+    return true;
+}
+
+static void journal_append(struct rtree *tr, int op, const struct rect *rect,
+    const DATATYPE data)
+{
+    struct journal *j = tr->journal;
+    journal_encode(j->buf+(size_t)j->nrecs*JOURNAL_RECSIZE, op, rect, data);
+    j->nrecs++;
+}
+
+////////////////////////////////
+// trace
+////////////////////////////////
+
+// Trace records have the same layout as journal records. Searches are
+// recorded with their rect and empty data.
+#define TRACE_GROUP 1024
+
+struct trace {
+    atomic_int rc;      // number of rtrees, besides the first, sharing this
+    atomic_flag lock;   // searches may be traced from many threads
+    bool failed;        // a write failed and recording has stopped
+    FILE *file;
+    int nrecs;
+    unsigned char buf[TRACE_GROUP*JOURNAL_RECSIZE];
+};
+
+static bool trace_flush(struct trace *t) {
+    size_t n = (size_t)t->nrecs;
+    t->nrecs = 0;
+    if (!t->failed && fwrite(t->buf, JOURNAL_RECSIZE, n, t->file) != n) {
+        t->failed = true;
+    }
+    return !t->failed;
+}
+
+static void trace_append(const struct rtree *tr, int op, 
+    const struct rect *rect, const DATATYPE data)
+{
+    struct trace *t = tr->trace;
+    while (atomic_flag_test_and_set_explicit(&t->lock, memory_order_acquire));
+    journal_encode(t->buf+(size_t)t->nrecs*JOURNAL_RECSIZE, op, rect, data);
+    t->nrecs++;
+    if (t->nrecs == TRACE_GROUP) {
+        trace_flush(t);
+    }
+    atomic_flag_clear_explicit(&t->lock, memory_order_release);
+}
+
+// trace_search records a search for the rect, when the rtree is traced.
+static void trace_search(const struct rtree *tr, const struct rect *rect) {
+    if (tr->trace) {
+        DATATYPE none;
+        memset(&none, 0, sizeof(DATATYPE));
+        trace_append(tr, RTREE_TRACE_SEARCH, rect, none);
+    }
+}
+
+// trace_release detaches the trace from an rtree, and closes the file once 
+// no rtrees are left.
+static bool trace_release(struct rtree *tr, struct trace *t) {
+    if (atomic_fetch_sub(&t->rc, 1) > 0) {
+        return !t->failed;
+    }
+    bool ok = trace_flush(t);
+    ok = fclose(t->file) == 0 && ok;
+    tr->free(t);
+    return ok;
+}
+
+////////////////////////////////
+// query instrumentation
+////////////////////////////////
+
+#ifdef RTREE_INSTRUMENT
+static _Thread_local struct rtree_query_stats qstats;
+static _Thread_local int qlevel;
+#define qstats_reset() { memset(&qstats, 0, sizeof(qstats)); qlevel = 0; }
+#define qstats_enter() { \
+    if (qlevel < RTREE_MAX_LEVELS) qstats.nodes[qlevel]++; \
+    qlevel++; \
+}
+#define qstats_leave() { qlevel--; }
+#define qstats_node(depth) { \
+    if ((depth) < RTREE_MAX_LEVELS) qstats.nodes[depth]++; \
+}
+#define qstats_add(field, n) { qstats.field += (n); }
+#else
+#define qstats_reset() 
+#define qstats_enter()
+#define qstats_leave()
+#define qstats_node(depth)
+#define qstats_add(field, n)
+#endif
+
+bool rtree_query_stats(struct rtree_query_stats *stats) {
+#ifdef RTREE_INSTRUMENT
+    *stats = qstats;
+    return true;
+#else
+    memset(stats, 0, sizeof(struct rtree_query_stats));
+    return false;
+#endif
+}
+
 static void rect_expand(struct rect *rect, const struct rect *other) {
     for (int i = 0; i < DIMS; i++) {
         if (other->min[i] < rect->min[i]) rect->min[i] = other->min[i];
@@ -148,30 +659,68 @@ static void rect_expand(struct rect *rect, const struct rect *other) {
     }
 }
 
-static double rect_area(const struct rect *rect) {
-    double area = (double)(rect->max[0]) - (double)(rect->min[0]);
+static area_t rect_area(const struct rect *rect) {
+    area_t area = (area_t)((length_t)rect->max[0] - (length_t)rect->min[0]);
     for (int i = 1; i < DIMS; i++) {
-        area *= (double)(rect->max[i]) - (double)(rect->min[i]);
+        area *= (area_t)((length_t)rect->max[i] - (length_t)rect->min[i]);
     }
     return area;
 }
 
+#ifdef SIMDRECTS
+// rect_load loads the rect as [min0 min1 max0 max1]. Unsigned coordinates 
+// have their sign bits flipped so that the signed compares order them.
+static __m128i rect_load(const struct rect *rect) {
+    __m128i v = _mm_loadu_si128((const __m128i *)rect);
+#ifdef RTREE_UINT32
+    v = _mm_xor_si128(v, _mm_set1_epi32(INT32_MIN));
+#endif
+    return v;
+}
+
+// rect_simd_le returns true when every lane of a is less than or equal to
+// the same lane of b.
+static bool rect_simd_le(__m128i a, __m128i b) {
+    return _mm_movemask_epi8(_mm_cmpgt_epi32(a, b)) == 0;
+}
+
+// rect_simd_halves joins the low half of a with the high half of b.
+static __m128i rect_simd_halves(__m128i a, __m128i b) {
+    return _mm_castpd_si128(_mm_move_sd(_mm_castsi128_pd(b), 
+        _mm_castsi128_pd(a)));
+}
+#endif
+
 static bool rect_contains(const struct rect *rect, const struct rect *other) {
+#ifdef SIMDRECTS
+    // [rect.min other.max] <= [other.min rect.max]
+    __m128i a = rect_load(rect);
+    __m128i b = rect_load(other);
+    return rect_simd_le(rect_simd_halves(a, b), rect_simd_halves(b, a));
+#else
     for (int i = 0; i < DIMS; i++) {
         if (other->min[i] < rect->min[i] || other->max[i] > rect->max[i]) {
             return false;
         }
     }
     return true;
+#endif
 }
 
 static bool rect_intersects(const struct rect *rect, const struct rect *other) {
+#ifdef SIMDRECTS
+    // [rect.min other.min] <= [other.max rect.max]
+    __m128i a = rect_load(rect);
+    __m128i b = rect_load(other);
+    return rect_simd_le(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(b, a));
+#else
     for (int i = 0; i < DIMS; i++) {
         if (other->min[i] > rect->max[i] || other->max[i] < rect->min[i]) {
             return false;
         }
     }
     return true;
+#endif
 }
 
 static bool nums_equal(NUMTYPE a, NUMTYPE b) {
@@ -208,6 +757,16 @@ static void node_swap(struct node *node, int i, int j) {
     node->rects[i] = node->rects[j];
     node->rects[j] = tmp;
     if (node->kind == LEAF) {
+        bool tomb = node_tomb(node, i);
+        node_tomb_set(node, i, node_tomb(node, j));
+        node_tomb_set(node, j, tomb);
+    }
+    if (node->kind == LEAF && node->isize) {
+        char tmp[RTREE_MAX_ITEM_SIZE];
+        memcpy(tmp, node_item(node, i), (size_t)node->isize);
+        memcpy(node_item(node, i), node_item(node, j), (size_t)node->isize);
+        memcpy(node_item(node, j), tmp, (size_t)node->isize);
+    } else if (node->kind == LEAF) {
         struct item tmp = node->items[i];
         node->items[i] = node->items[j];
         node->items[j] = tmp;
@@ -282,9 +841,9 @@ static void node_sort_by_axis(struct node *node, int axis, bool rev, bool max) {
 
 static int rect_largest_axis(const struct rect *rect) {
     int axis = 0;
-    double nlength = (double)rect->max[0] - (double)rect->min[0];
+    length_t nlength = (length_t)rect->max[0] - (length_t)rect->min[0];
     for (int i = 1; i < DIMS; i++) {
-        double length = (double)rect->max[i] - (double)rect->min[i];
+        length_t length = (length_t)rect->max[i] - (length_t)rect->min[i];
         if (length > nlength) {
             nlength = length;
             axis = i;
@@ -299,8 +858,12 @@ static void node_move_rect_at_index_into(struct node *from, int index,
     into->rects[into->count] = from->rects[index];
     from->rects[index] = from->rects[from->count-1];
     if (from->kind == LEAF) {
-        into->items[into->count] = from->items[index];
-        from->items[index] = from->items[from->count-1];
+        node_tomb_set(into, into->count, node_tomb(from, index));
+        node_tomb_set(from, index, node_tomb(from, from->count-1));
+        node_tomb_set(from, from->count-1, false);
+        size_t isize = node_item_size(from);
+        memcpy(node_item(into, into->count), node_item(from, index), isize);
+        memcpy(node_item(from, index), node_item(from, from->count-1), isize);
     } else {
         into->children[into->count] = from->children[index];
         from->children[index] = from->children[from->count-1];
@@ -316,10 +879,10 @@ static struct node *node_split_largest_axis_edge_snap(struct rtree *tr,
     struct node *right = node_new(tr, left->kind);
     if (!right) return NULL;
     for (int i = 0; i < left->count; i++) {
-        double min_dist = (double)left->rects[i].min[axis] - 
-                          (double)rect->min[axis];
-        double max_dist = (double)rect->max[axis] - 
-                          (double)left->rects[i].max[axis];
+        length_t min_dist = (length_t)left->rects[i].min[axis] - 
+                            (length_t)rect->min[axis];
+        length_t max_dist = (length_t)rect->max[axis] - 
+                            (length_t)left->rects[i].max[axis];
         if (min_dist < max_dist) {
             // stay left
         } else {
@@ -348,10 +911,25 @@ static struct node *node_split_largest_axis_edge_snap(struct rtree *tr,
     return right;
 }
 
+// node_count_dead counts the lazily deleted items of the node again, after
+// its entries have changed.
+static void node_count_dead(struct node *node) {
+    node->dead = 0;
+    for (int i = 0; i < node->count; i++) {
+        node->dead += node->kind == LEAF ? node_tomb(node, i) : 
+            node->children[i]->dead;
+    }
+}
+
 static struct node *node_split(struct rtree *tr, struct rect *r,
     struct node *left)
 {
-    return node_split_largest_axis_edge_snap(tr, r, left);
+    struct node *right = node_split_largest_axis_edge_snap(tr, r, left);
+    if (right && left->dead) {
+        node_count_dead(left);
+        node_count_dead(right);
+    }
+    return right;
 }
 
 static int node_rsearch(const struct node *node, NUMTYPE key) {
@@ -364,14 +942,14 @@ static int node_rsearch(const struct node *node, NUMTYPE key) {
 }
 
 // unionedArea returns the area of two rects expanded
-static double rect_unioned_area(const struct rect *rect, 
+static area_t rect_unioned_area(const struct rect *rect, 
     const struct rect *other)
 {
-    double area = (double)MAX(rect->max[0], other->max[0]) - 
-                  (double)MIN(rect->min[0], other->min[0]);
+    area_t area = (area_t)((length_t)MAX(rect->max[0], other->max[0]) - 
+                           (length_t)MIN(rect->min[0], other->min[0]));
     for (int i = 1; i < DIMS; i++) {
-        area *= (double)MAX(rect->max[i], other->max[i]) - 
-                (double)MIN(rect->min[i], other->min[i]);
+        area *= (area_t)((length_t)MAX(rect->max[i], other->max[i]) - 
+                         (length_t)MIN(rect->min[i], other->min[i]));
     }
     return area;
 }
@@ -380,15 +958,15 @@ static int node_choose_least_enlargement(const struct node *node,
     const struct rect *ir)
 {
     int j = 0;
-    double jenlarge = INFINITY;
-    double jarea = 0;
+    area_t jenlarge = AREA_MAX;
+    area_t jarea = 0;
     (void)jarea;
 
     for (int i = 0; i < node->count; i++) {
-        // calculate the enlarged area
-        double uarea = rect_unioned_area(&node->rects[i], ir);
-        double area = rect_area(&node->rects[i]);
-        double enlarge = uarea - area;
+        // calculate the enlarged area, which is never negative
+        area_t uarea = rect_unioned_area(&node->rects[i], ir);
+        area_t area = rect_area(&node->rects[i]);
+        area_t enlarge = uarea - area;
         if ((enlarge < jenlarge)
 #ifndef IGNORE_AREA_EQUALITY_CHECK
             || (!(enlarge > jenlarge) && area < jarea)
@@ -408,10 +986,10 @@ static int node_choose_subtree(const struct node *node,
     // Take a quick look for the first node that contain the rect.
 #if FAST_CHOOSER == 1
         int index = -1;
-        double narea;
+        area_t narea;
         for (int i = 0; i < node->count; i++) {
             if (rect_contains(&node->rects[i], ir)) {
-                double area = rect_area(&node->rects[i]);
+                area_t area = rect_area(&node->rects[i]);
                 if (index == -1 || area < narea) {
                     narea = area;
                     index = i;
@@ -461,9 +1039,49 @@ static int node_order_to_left(struct node *node, int index) {
     return index;
 }
 
+// leaf_insert copies an item into its place in a leaf that isn't full.
+static void leaf_insert(struct node *node, const struct rect *ir, 
+    const void *item)
+{
+    int index = node_rsearch(node, ir->min[0]);
+    memmove(&node->rects[index+1], &node->rects[index], 
+        (node->count-index)*sizeof(struct rect));
+    size_t isize = node_item_size(node);
+    memmove(node_item(node, index+1), node_item(node, index), 
+        (node->count-index)*isize);
+    node_tombs_open(node, index);
+    node->rects[index] = *ir;
+    memcpy(node_item(node, index), item, isize);
+    node->count++;
+}
+
+// node_split_child splits the full child at index into two children of the 
+// node, which must have room. Returns false if out of memory.
+static bool node_split_child(struct rtree *tr, struct node *node, int index) {
+    struct node *left = node->children[index];
+    struct node *right = node_split(tr, &node->rects[index], left);
+    if (!right) {
+        return false;
+    }
+    node->rects[index] = node_rect_calc(left);
+    memmove(&node->rects[index+2], &node->rects[index+1], 
+        (node->count-(index+1))*sizeof(struct rect));
+    memmove(&node->children[index+2], &node->children[index+1], 
+        (node->count-(index+1))*sizeof(struct node*));
+    node->rects[index+1] = node_rect_calc(right);
+    node->children[index+1] = right;
+    node->count++;
+    if (node->rects[index].min[0] > node->rects[index+1].min[0]) {
+        node_swap(node, index+1, index);
+    }
+    index++;
+    node_order_to_right(node, index);
+    return true;
+}
+
 // node_insert returns false if out of memory
 static bool node_insert(struct rtree *tr, struct rect *nr, struct node *node, 
-    struct rect *ir, struct item item, bool *split, bool *grown)
+    struct rect *ir, const void *item, bool *split, bool *grown)
 {
     *split = false;
     *grown = false;
@@ -472,14 +1090,7 @@ static bool node_insert(struct rtree *tr, struct rect *nr, struct node *node,
             *split = true;
             return true;
         }
-        int index = node_rsearch(node, ir->min[0]);
-        memmove(&node->rects[index+1], &node->rects[index], 
-            (node->count-index)*sizeof(struct rect));
-        memmove(&node->items[index+1], &node->items[index], 
-            (node->count-index)*sizeof(struct item));
-        node->rects[index] = *ir;
-        node->items[index] = item;
-        node->count++;
+        leaf_insert(node, ir, item);
         *grown = !rect_contains(nr, ir);
         return true;
     }
@@ -496,25 +1107,9 @@ static bool node_insert(struct rtree *tr, struct rect *nr, struct node *node,
         if (node->count == MAX_ENTRIES) {
             return true;
         }
-        // split the child node
-        struct node *left = node->children[index];
-        struct node *right = node_split(tr, &node->rects[index], left);
-        if (!right) {
+        if (!node_split_child(tr, node, index)) {
             return false;
         }
-        node->rects[index] = node_rect_calc(left);
-        memmove(&node->rects[index+2], &node->rects[index+1], 
-            (node->count-(index+1))*sizeof(struct rect));
-        memmove(&node->children[index+2], &node->children[index+1], 
-            (node->count-(index+1))*sizeof(struct node*));
-        node->rects[index+1] = node_rect_calc(right);
-        node->children[index+1] = right;
-        node->count++;
-        if (node->rects[index].min[0] > node->rects[index+1].min[0]) {
-            node_swap(node, index+1, index);
-        }
-        index++;
-        node_order_to_right(node, index);
         return node_insert(tr, nr, node, ir, item, split, grown);
     }
     if (*grown) {
@@ -543,51 +1138,73 @@ struct rtree *rtree_new(void) {
     return rtree_new_with_allocator(NULL, NULL);
 }
 
+struct rtree *rtree_new_with_item_size(size_t item_size, 
+    void *(*malloc)(size_t), void (*free)(void*))
+{
+    if (item_size == 0 || item_size > RTREE_MAX_ITEM_SIZE) {
+        return NULL;
+    }
+    struct rtree *tr = rtree_new_with_allocator(malloc, free);
+    if (!tr) return NULL;
+    tr->isize = (int)item_size;
+    return tr;
+}
+
 void rtree_set_item_callbacks(struct rtree *tr,
     bool (*clone)(const DATATYPE item, DATATYPE *into, void *udata),
     void (*free)(const DATATYPE item, void *udata))
 {
+    if (tr->isize) {
+        // inline items are copied and freed with their leaves
+        return;
+    }
     tr->item_clone = clone;
     tr->item_free = free;
 }
 
-bool rtree_insert(struct rtree *tr, const NUMTYPE *min, 
-    const NUMTYPE *max, const DATATYPE data) 
+// item_make prepares the item of the data for copying into a leaf from src.
+// An inline item is copied straight from the data.
+static bool item_make(struct rtree *tr, const DATATYPE data, struct item *item,
+    const void **src)
 {
-    // prepare the inputs
-    struct rect rect;
-    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
-    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
-    struct item item;
-    if (tr->item_clone) {
-        if (!tr->item_clone(data, &item.data, tr->udata)) {
+    *src = item;
+    if (tr->isize) {
+        *src = data;
+    } else if (tr->item_clone) {
+        if (!tr->item_clone(data, &item->data, tr->udata)) {
             return false;
         }
     } else {
-        memcpy(&item.data, &data, sizeof(DATATYPE));
+        memcpy(&item->data, &data, sizeof(DATATYPE));
     }
+    return true;
+}
+
+// tree_insert copies a prepared item from src into the main tree. Returns
+// false if out of memory, leaving the item to the caller.
+static bool tree_insert(struct rtree *tr, struct rect rect, const void *src) {
 insert:
     if (!tr->root) {
         struct node *new_root = node_new(tr, LEAF);
-        if (!new_root) goto oom;
+        if (!new_root) return false;
         tr->root = new_root;
         tr->rect = rect;
         tr->height = 1;
     }
     bool split = false;
     bool grown = false;
-    cow_node_or(tr->root, goto oom);
-    if (!node_insert(tr, &tr->rect, tr->root, &rect, item, &split, &grown)) {
-        goto oom;
+    cow_node_or(tr->root, return false);
+    if (!node_insert(tr, &tr->rect, tr->root, &rect, src, &split, &grown)) {
+        return false;
     }
     if (split) {
         struct node *new_root = node_new(tr, BRANCH);
-        if (!new_root) goto oom;
+        if (!new_root) return false;
         struct node *left = tr->root;
         struct node *right = node_split(tr, &tr->rect, left);
         if (!right) {
             tr->free(new_root);
-            goto oom;
+            return false;
         }
         tr->root = new_root;
         tr->root->rects[0] = node_rect_calc(left);
@@ -595,6 +1212,7 @@ insert:
         tr->root->children[0] = left;
         tr->root->children[1] = right;
         tr->root->count = 2;
+        tr->root->dead = left->dead + right->dead;
         tr->height++;
         node_sort(tr->root);
         goto insert;
@@ -605,44 +1223,122 @@ insert:
     }
     tr->count++;
     return true;
-oom:
+}
+
+static bool buf_insert(struct rtree *tr, struct rect rect, const void *src);
+
+// insert0 inserts an item without touching the journal, trace, or index.
+// Returns false if out of memory.
+static bool insert0(struct rtree *tr, struct rect rect, const DATATYPE data) {
+    struct item item;
+    const void *src;
+    if (!item_make(tr, data, &item, &src)) {
+        return false;
+    }
+    if (tr->maxbufs ? buf_insert(tr, rect, src) : tree_insert(tr, rect, src)) {
+        return true;
+    }
     if (tr->item_free) {
         tr->item_free(item.data, tr->udata);
     }
     return false;
 }
 
+bool rtree_insert(struct rtree *tr, const NUMTYPE *min, 
+    const NUMTYPE *max, const DATATYPE data) 
+{
+    // prepare the inputs
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    if (!journal_reserve(tr, 1) || !ids_reserve(tr, 1)) {
+        return false;
+    }
+    if (!insert0(tr, rect, data)) {
+        return false;
+    }
+    if (tr->item_id) {
+        idmap_set(tr->ids, tr->item_id(data, tr->udata), &rect);
+    }
+    if (tr->journal) {
+        journal_append(tr, JOURNAL_INSERT, &rect, data);
+    }
+    if (tr->trace) {
+        trace_append(tr, RTREE_TRACE_INSERT, &rect, data);
+    }
+    return true;
+}
+
+static void journal_free(struct rtree *tr, struct journal *j);
+
 void rtree_free(struct rtree *tr) {
+    if (tr->journal) {
+        journal_commit(tr->journal);
+        journal_free(tr, tr->journal);
+    }
+    if (tr->trace) {
+        trace_release(tr, tr->trace);
+    }
     if (tr->root) {
         node_free(tr, tr->root);
     }
+    for (int b = 0; b < tr->nbufs; b++) {
+        node_free(tr, tr->bufs[b]);
+    }
+    if (tr->brects) {
+        tr->free(tr->brects);
+    }
+    idmap_release(tr, tr->ids);
     tr->free(tr);
 }
 
+// tree_root returns the root of the main tree for i == 0, which may be NULL,
+// or else leaf i-1 of the write buffer, along with its rect and height.
+static struct node *tree_root(const struct rtree *tr, int i, 
+    const struct rect **rect, size_t *height)
+{
+    if (i == 0) {
+        *rect = &tr->rect;
+        *height = tr->height;
+        return tr->root;
+    }
+    *rect = &tr->brects[i-1];
+    *height = 1;
+    return tr->bufs[i-1];
+}
+
 static bool node_search(struct node *node, struct rect *rect,
     bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
         void *udata), 
     void *udata) 
 {
+    qstats_enter();
+    qstats_add(rect_tests, node->count);
     if (node->kind == LEAF) {
+        qstats_add(items_examined, node->count);
         for (int i = 0; i < node->count; i++) {
-            if (rect_intersects(&node->rects[i], rect)) {
+            if (rect_intersects(&node->rects[i], rect) && !node_tomb(node, i)) {
+                qstats_add(rect_hits, 1);
+                qstats_add(items_returned, 1);
                 if (!iter(node->rects[i].min, node->rects[i].max, 
-                    node->items[i].data, udata))
+                    node_data(node, i), udata))
                 {
                     return false;
                 }
             }
         }
+        qstats_leave();
         return true;
     }
     for (int i = 0; i < node->count; i++) {
         if (rect_intersects(&node->rects[i], rect)) {
+            qstats_add(rect_hits, 1);
             if (!node_search(node->children[i], rect, iter, udata)) {
                 return false;
             }
         }
     }
+    qstats_leave();
     return true;
 }
 
@@ -652,189 +1348,3496 @@ void rtree_search(const struct rtree *tr,
         void *udata), 
     void *udata)
 {
+    qstats_reset();
     struct rect rect;
     memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
     memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
-    if (tr->root && rect_intersects(&tr->rect, &rect)) {
-        node_search(tr->root, &rect, iter, udata);
+    trace_search(tr, &rect);
+    for (int i = 0; i <= tr->nbufs; i++) {
+        const struct rect *nr;
+        size_t height;
+        struct node *root = tree_root(tr, i, &nr, &height);
+        if (root && rect_intersects(nr, &rect) && 
+            !node_search(root, &rect, iter, udata))
+        {
+            return;
+        }
     }
 }
 
 static bool node_scan(struct node *node,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata);
+
+static bool node_search_contained(struct node *node, struct rect *rect,
     bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
         void *udata), 
     void *udata) 
 {
-    if (node->kind == LEAF) {
-        for (int i = 0; i < node->count; i++) {
-            if (!iter(node->rects[i].min, node->rects[i].max, 
-                node->items[i].data, udata))
+    qstats_enter();
+    for (int i = 0; i < node->count && 
+        !(node->rects[i].min[0] > rect->max[0]); i++)
+    {
+        qstats_add(rect_tests, 1);
+        if (node->kind == LEAF) {
+            qstats_add(items_examined, 1);
+            if (rect_contains(rect, &node->rects[i]) && !node_tomb(node, i)) {
+                qstats_add(rect_hits, 1);
+                qstats_add(items_returned, 1);
+                if (!iter(node->rects[i].min, node->rects[i].max, 
+                    node_data(node, i), udata))
+                {
+                    return false;
+                }
+            }
+        } else if (rect_contains(rect, &node->rects[i])) {
+            // Every item of the subtree is inside.
+            qstats_add(rect_hits, 1);
+            if (!node_scan(node->children[i], iter, udata)) {
+                return false;
+            }
+        } else if (rect_intersects(&node->rects[i], rect)) {
+            qstats_add(rect_hits, 1);
+            if (!node_search_contained(node->children[i], rect, iter, udata)) 
+            {
+                return false;
+            }
+        }
+    }
+    qstats_leave();
+    return true;
+}
+
+void rtree_search_contained(const struct rtree *tr, 
+    const NUMTYPE min[], const NUMTYPE max[],
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata)
+{
+    qstats_reset();
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    for (int i = 0; i <= tr->nbufs; i++) {
+        const struct rect *nr;
+        size_t height;
+        struct node *root = tree_root(tr, i, &nr, &height);
+        if (!root) {
+            continue;
+        }
+        if (rect_contains(&rect, nr)) {
+            if (!node_scan(root, iter, udata)) {
+                return;
+            }
+        } else if (rect_intersects(nr, &rect)) {
+            if (!node_search_contained(root, &rect, iter, udata)) {
+                return;
+            }
+        }
+    }
+}
+
+static bool node_search_containing(struct node *node, struct rect *rect,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata) 
+{
+    qstats_enter();
+    // Only entries that start at or before the search rect can contain it.
+    for (int i = 0; i < node->count && 
+        !(node->rects[i].min[0] > rect->min[0]); i++)
+    {
+        qstats_add(rect_tests, 1);
+        if (!rect_contains(&node->rects[i], rect)) {
+            continue;
+        }
+        qstats_add(rect_hits, 1);
+        if (node->kind == LEAF) {
+            if (node_tomb(node, i)) {
+                continue;
+            }
+            qstats_add(items_returned, 1);
+            if (!iter(node->rects[i].min, node->rects[i].max, 
+                node_data(node, i), udata))
             {
                 return false;
             }
+        } else if (!node_search_containing(node->children[i], rect, iter, 
+            udata))
+        {
+            return false;
+        }
+    }
+    if (node->kind == LEAF) {
+        qstats_add(items_examined, node->count);
+    }
+    qstats_leave();
+    return true;
+}
+
+void rtree_search_containing(const struct rtree *tr, 
+    const NUMTYPE min[], const NUMTYPE max[],
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata)
+{
+    qstats_reset();
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    for (int i = 0; i <= tr->nbufs; i++) {
+        const struct rect *nr;
+        size_t height;
+        struct node *root = tree_root(tr, i, &nr, &height);
+        if (root && rect_contains(nr, &rect) && 
+            !node_search_containing(root, &rect, iter, udata))
+        {
+            return;
+        }
+    }
+}
+
+struct search_custom {
+    int (*relate)(const NUMTYPE *min, const NUMTYPE *max, void *udata);
+    bool (*match)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        void *udata);
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        void *udata);
+    void *udata;
+};
+
+static bool node_search_custom(struct search_custom *sc, struct node *node) {
+    qstats_enter();
+    qstats_add(rect_tests, node->count);
+    if (node->kind == LEAF) {
+        qstats_add(items_examined, node->count);
+    }
+    for (int i = 0; i < node->count; i++) {
+        const struct rect *rect = &node->rects[i];
+        if (node->kind == LEAF) {
+            if (node_tomb(node, i)) {
+                continue;
+            }
+            bool ok = sc->match ? 
+                sc->match(rect->min, rect->max, node_data(node, i), 
+                    sc->udata) :
+                sc->relate(rect->min, rect->max, sc->udata) != RTREE_DISJOINT;
+            if (ok) {
+                qstats_add(rect_hits, 1);
+                qstats_add(items_returned, 1);
+                if (!sc->iter(rect->min, rect->max, node_data(node, i), 
+                    sc->udata))
+                {
+                    return false;
+                }
+            }
+            continue;
+        }
+        switch (sc->relate(rect->min, rect->max, sc->udata)) {
+        case RTREE_DISJOINT:
+            break;
+        case RTREE_INSIDE:
+            qstats_add(rect_hits, 1);
+            if (!node_scan(node->children[i], sc->iter, sc->udata)) {
+                return false;
+            }
+            break;
+        default:
+            qstats_add(rect_hits, 1);
+            if (!node_search_custom(sc, node->children[i])) {
+                return false;
+            }
+        }
+    }
+    qstats_leave();
+    return true;
+}
+
+void rtree_search_custom(const struct rtree *tr, 
+    int (*relate)(const NUMTYPE *min, const NUMTYPE *max, void *udata),
+    bool (*match)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        void *udata),
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata)
+{
+    qstats_reset();
+    struct search_custom sc = { relate, match, iter, udata };
+    for (int i = 0; i <= tr->nbufs; i++) {
+        const struct rect *nr;
+        size_t height;
+        struct node *root = tree_root(tr, i, &nr, &height);
+        if (!root) {
+            continue;
+        }
+        bool ok = true;
+        switch (relate(nr->min, nr->max, udata)) {
+        case RTREE_DISJOINT:
+            break;
+        case RTREE_INSIDE:
+            ok = node_scan(root, iter, udata);
+            break;
+        default:
+            ok = node_search_custom(&sc, root);
+        }
+        if (!ok) {
+            return;
+        }
+    }
+}
+
+struct search_radius {
+    NUMTYPE center[DIMS];
+    double radius2;
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        void *udata);
+    void *udata;
+};
+
+// radius_relate returns the relation of a rect to the ball using the 
+// squared distances from the center to its nearest and farthest points.
+static int radius_relate(const NUMTYPE *min, const NUMTYPE *max, 
+    void *udata)
+{
+    struct search_radius *sr = udata;
+    double near = 0;
+    double far = 0;
+    for (int i = 0; i < DIMS; i++) {
+        double c = (double)sr->center[i];
+        double lo = c-(double)min[i];   // negative when left of the rect
+        double hi = (double)max[i]-c;   // negative when right of the rect
+        double d = lo < 0 ? -lo : hi < 0 ? -hi : 0;
+        double f = MAX(lo, hi);
+        near += d*d;
+        far += f*f;
+    }
+    if (near > sr->radius2) {
+        return RTREE_DISJOINT;
+    }
+    if (far <= sr->radius2) {
+        return RTREE_INSIDE;
+    }
+    return RTREE_INTERSECTS;
+}
+
+static bool radius_iter(const NUMTYPE *min, const NUMTYPE *max, 
+    const DATATYPE data, void *udata)
+{
+    struct search_radius *sr = udata;
+    return sr->iter(min, max, data, sr->udata);
+}
+
+void rtree_search_radius(const struct rtree *tr, const NUMTYPE center[], 
+    NUMTYPE radius,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata)
+{
+    struct search_radius sr = { 
+        .radius2 = (double)radius*(double)radius,
+        .iter = iter,
+        .udata = udata,
+    };
+    memcpy(sr.center, center, sizeof(NUMTYPE)*DIMS);
+    rtree_search_custom(tr, radius_relate, NULL, radius_iter, &sr);
+}
+
+////////////////////////////////
+// priority queue
+////////////////////////////////
+
+// The queue holds nodes and items ordered by a key, such as a distance, for
+// searches that visit the tree front to back. An entry is the node to visit
+// when index is -1, or else the item at index of the leaf node.
+struct pq_entry {
+    double key;
+    struct node *node;
+    int index;
+    int depth;          // level of the node, for the query stats
+};
+
+struct pq {
+    struct pq_entry *entries;
+    size_t len;
+    size_t cap;
+};
+
+// pq_reserve makes room for n more entries. Returns false if out of memory.
+static bool pq_reserve(const struct rtree *tr, struct pq *pq, size_t n) {
+    if (pq->len+n <= pq->cap) {
+        return true;
+    }
+    size_t cap = pq->cap == 0 ? 64 : pq->cap;
+    while (cap < pq->len+n) {
+        cap *= 2;
+    }
+    struct pq_entry *entries = (struct pq_entry *)tr->malloc(
+        sizeof(struct pq_entry)*cap);
+    if (!entries) {
+        return false;
+    }
+    if (pq->entries) {
+        memcpy(entries, pq->entries, sizeof(struct pq_entry)*pq->len);
+        tr->free(pq->entries);
+    }
+    pq->entries = entries;
+    pq->cap = cap;
+    return true;
+}
+
+// pq_push adds an entry, which must have been reserved.
+static void pq_push(struct pq *pq, struct pq_entry entry) {
+    size_t i = pq->len++;
+    while (i > 0) {
+        size_t parent = (i-1)/2;
+        if (!(entry.key < pq->entries[parent].key)) {
+            break;
+        }
+        pq->entries[i] = pq->entries[parent];
+        i = parent;
+    }
+    pq->entries[i] = entry;
+}
+
+static struct pq_entry pq_pop(struct pq *pq) {
+    struct pq_entry top = pq->entries[0];
+    struct pq_entry last = pq->entries[--pq->len];
+    size_t i = 0;
+    while (1) {
+        size_t child = i*2+1;
+        if (child >= pq->len) {
+            break;
+        }
+        if (child+1 < pq->len && 
+            pq->entries[child+1].key < pq->entries[child].key)
+        {
+            child++;
+        }
+        if (!(pq->entries[child].key < last.key)) {
+            break;
+        }
+        pq->entries[i] = pq->entries[child];
+        i = child;
+    }
+    if (pq->len > 0) {
+        pq->entries[i] = last;
+    }
+    return top;
+}
+
+////////////////////////////////
+// raycast
+////////////////////////////////
+
+struct ray {
+    NUMTYPE origin[DIMS];
+    NUMTYPE dir[DIMS];
+    double tmax;
+};
+
+// ray_hit returns the distance along the ray, as a multiple of the 
+// direction, where it enters the rect, or -1 if it misses the rect before
+// tmax. The distance is zero when the origin is inside.
+static double ray_hit(const struct ray *ray, const struct rect *rect) {
+    double tnear = 0;
+    double tfar = ray->tmax;
+    for (int i = 0; i < DIMS; i++) {
+        double o = (double)ray->origin[i];
+        double d = (double)ray->dir[i];
+        double lo = (double)rect->min[i];
+        double hi = (double)rect->max[i];
+        if (d == 0) {
+            if (o < lo || o > hi) {
+                return -1;
+            }
+            continue;
+        }
+        double t1 = (lo-o)/d;
+        double t2 = (hi-o)/d;
+        if (t1 > t2) {
+            double t = t1;
+            t1 = t2;
+            t2 = t;
+        }
+        tnear = MAX(tnear, t1);
+        tfar = MIN(tfar, t2);
+        if (tnear > tfar) {
+            return -1;
+        }
+    }
+    return tnear;
+}
+
+bool rtree_raycast(const struct rtree *tr, const NUMTYPE origin[], 
+    const NUMTYPE dir[], double tmax,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        double t, void *udata),
+    void *udata)
+{
+    qstats_reset();
+    struct ray ray = { .tmax = tmax };
+    memcpy(ray.origin, origin, sizeof(NUMTYPE)*DIMS);
+    memcpy(ray.dir, dir, sizeof(NUMTYPE)*DIMS);
+    struct pq pq = { 0 };
+    double t;
+    for (int i = 0; i <= tr->nbufs; i++) {
+        const struct rect *nr;
+        size_t height;
+        struct node *root = tree_root(tr, i, &nr, &height);
+        if (!root || (t = ray_hit(&ray, nr)) < 0) {
+            continue;
+        }
+        if (!pq_reserve(tr, &pq, 1)) {
+            if (pq.entries) tr->free(pq.entries);
+            return false;
+        }
+        pq_push(&pq, (struct pq_entry){ .key = t, .node = root, .index = -1 });
+    }
+    if (pq.len == 0) {
+        if (pq.entries) tr->free(pq.entries);
+        return true;
+    }
+    bool ok = true;
+    while (pq.len > 0) {
+        struct pq_entry entry = pq_pop(&pq);
+        struct node *node = entry.node;
+        if (entry.index >= 0) {
+            qstats_add(items_returned, 1);
+            if (!iter(node->rects[entry.index].min, 
+                node->rects[entry.index].max, node_data(node, entry.index),
+                entry.key, udata))
+            {
+                break;
+            }
+            continue;
+        }
+        if (!pq_reserve(tr, &pq, (size_t)node->count)) {
+            ok = false;
+            break;
+        }
+        // The nodes come off the queue in key order rather than depth 
+        // first, so each entry carries its own level.
+        qstats_node(entry.depth);
+        qstats_add(rect_tests, node->count);
+        for (int i = 0; i < node->count; i++) {
+            t = ray_hit(&ray, &node->rects[i]);
+            if (t >= 0) {
+                qstats_add(rect_hits, 1);
+                if (node->kind == LEAF) {
+                    if (node_tomb(node, i)) {
+                        continue;
+                    }
+                    pq_push(&pq, (struct pq_entry){ t, node, i, entry.depth });
+                } else {
+                    pq_push(&pq, (struct pq_entry){ t, node->children[i], -1,
+                        entry.depth+1 });
+                }
+            }
+        }
+    }
+    tr->free(pq.entries);
+    return ok;
+}
+
+////////////////////////////////
+// nearest
+////////////////////////////////
+
+struct rtree_nearest {
+    const struct rtree *tr;
+    NUMTYPE point[DIMS];
+    double maxdist2;
+    struct pq pq;
+};
+
+// rect_dist2 returns the squared distance from a point to the nearest point
+// of a rect.
+static double rect_dist2(const NUMTYPE *point, const struct rect *rect) {
+    double dist2 = 0;
+    for (int i = 0; i < DIMS; i++) {
+        double p = (double)point[i];
+        double d = p < (double)rect->min[i] ? (double)rect->min[i]-p :
+                   p > (double)rect->max[i] ? p-(double)rect->max[i] : 0;
+        dist2 += d*d;
+    }
+    return dist2;
+}
+
+struct rtree_nearest *rtree_nearest_new(const struct rtree *tr, 
+    const NUMTYPE point[], double maxdist)
+{
+    struct rtree_nearest *it = (struct rtree_nearest *)tr->malloc(
+        sizeof(struct rtree_nearest));
+    if (!it) {
+        return NULL;
+    }
+    memset(it, 0, sizeof(struct rtree_nearest));
+    it->tr = tr;
+    memcpy(it->point, point, sizeof(NUMTYPE)*DIMS);
+    it->maxdist2 = maxdist*maxdist;
+    for (int i = 0; i <= tr->nbufs; i++) {
+        const struct rect *nr;
+        size_t height;
+        struct node *root = tree_root(tr, i, &nr, &height);
+        if (!root) {
+            continue;
+        }
+        double dist2 = rect_dist2(it->point, nr);
+        if (dist2 <= it->maxdist2) {
+            if (!pq_reserve(tr, &it->pq, 1)) {
+                rtree_nearest_free(it);
+                return NULL;
+            }
+            pq_push(&it->pq, 
+                (struct pq_entry){ .key = dist2, .node = root, .index = -1 });
+        }
+    }
+    return it;
+}
+
+bool rtree_nearest_next(struct rtree_nearest *it, const NUMTYPE **min,
+    const NUMTYPE **max, DATATYPE *data, double *dist2)
+{
+    while (it->pq.len > 0) {
+        struct pq_entry *top = &it->pq.entries[0];
+        if (top->index >= 0) {
+            struct pq_entry entry = pq_pop(&it->pq);
+            struct node *node = entry.node;
+            if (min) *min = node->rects[entry.index].min;
+            if (max) *max = node->rects[entry.index].max;
+            if (data) *data = node_data(node, entry.index);
+            if (dist2) *dist2 = entry.key;
+            return true;
+        }
+        // Make room for the entries of the node before taking it off the 
+        // queue, so that running out of memory leaves the queue as it was.
+        if (!pq_reserve(it->tr, &it->pq, (size_t)top->node->count)) {
+            return false;
+        }
+        struct node *node = pq_pop(&it->pq).node;
+        for (int i = 0; i < node->count; i++) {
+            double d2 = rect_dist2(it->point, &node->rects[i]);
+            if (d2 <= it->maxdist2) {
+                if (node->kind == LEAF) {
+                    if (node_tomb(node, i)) {
+                        continue;
+                    }
+                    pq_push(&it->pq, (struct pq_entry){ .key = d2, 
+                        .node = node, .index = i });
+                } else {
+                    pq_push(&it->pq, (struct pq_entry){ .key = d2, 
+                        .node = node->children[i], .index = -1 });
+                }
+            }
+        }
+    }
+    return false;
+}
+
+bool rtree_nearest_done(const struct rtree_nearest *it) {
+    return it->pq.len == 0;
+}
+
+void rtree_nearest_free(struct rtree_nearest *it) {
+    if (it->pq.entries) {
+        it->tr->free(it->pq.entries);
+    }
+    it->tr->free(it);
+}
+
+size_t rtree_search_collect(const struct rtree *tr, 
+    const NUMTYPE min[], const NUMTYPE max[], DATATYPE *items, NUMTYPE *rects,
+    size_t cap, struct rtree_cursor *cursor)
+{
+    if (cursor->done) {
+        return 0;
+    }
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    int depth = cursor->depth;
+    if (depth == 0 && cursor->root == 0) {
+        trace_search(tr, &rect);
+    }
+    size_t n = 0;
+    for (; cursor->root <= tr->nbufs; cursor->root++, depth = 0) {
+        const struct rect *nr;
+        size_t height;
+        struct node *root = tree_root(tr, cursor->root, &nr, &height);
+        if (depth == 0) {
+            if (!root || !rect_intersects(nr, &rect)) {
+                continue;
+            }
+            cursor->idxs[0] = 0;
+            depth = 1;
+        }
+        // Walk back down the path of the previous call. Each index is one 
+        // past the child that was descended into.
+        struct node *nodes[RTREE_MAX_LEVELS];
+        nodes[0] = root;
+        for (int d = 1; d < depth; d++) {
+            nodes[d] = nodes[d-1]->children[cursor->idxs[d-1]-1];
+        }
+        while (depth > 0) {
+            struct node *node = nodes[depth-1];
+            int i = cursor->idxs[depth-1];
+            if (node->kind == LEAF) {
+                // Leaves entirely inside the search rect are copied in bulk,
+                // unless they have tombstones.
+                const struct rect *lr = depth == 1 ? nr : 
+                    &nodes[depth-2]->rects[cursor->idxs[depth-2]-1];
+                if (!node->dead && rect_contains(&rect, lr)) {
+                    int m = (int)MIN((size_t)(node->count-i), cap-n);
+                    for (int j = 0; j < m; j++) {
+                        items[n+j] = node_data(node, i+j);
+                    }
+                    if (rects) {
+                        memcpy(&rects[n*DIMS*2], &node->rects[i], 
+                            sizeof(struct rect)*m);
+                    }
+                    n += m;
+                    i += m;
+                }
+                for (; i < node->count; i++) {
+                    if (!rect_intersects(&node->rects[i], &rect) || 
+                        node_tomb(node, i)) 
+                    {
+                        continue;
+                    }
+                    if (n == cap) {
+                        cursor->idxs[depth-1] = i;
+                        cursor->depth = depth;
+                        return n;
+                    }
+                    items[n] = node_data(node, i);
+                    if (rects) {
+                        memcpy(&rects[n*DIMS*2], &node->rects[i], 
+                            sizeof(struct rect));
+                    }
+                    n++;
+                }
+                depth--;
+                continue;
+            }
+            while (i < node->count && 
+                !rect_intersects(&node->rects[i], &rect)) 
+            {
+                i++;
+            }
+            if (i == node->count) {
+                depth--;
+                continue;
+            }
+            cursor->idxs[depth-1] = i+1;
+            nodes[depth] = node->children[i];
+            cursor->idxs[depth] = 0;
+            depth++;
+        }
+    }
+    cursor->depth = 0;
+    cursor->done = true;
+    return n;
+}
+
+// search_many is the state of a batch of searches that walk the tree
+// together. Each level of the walk has its own list of the queries still
+// intersecting the current node, carved out of the lists buffer.
+struct search_many {
+    struct rect *rects;     // the queries
+    bool *stopped;          // queries whose iter returned false
+    int nstopped;
+    int n;
+    bool (*iter)(int q, const NUMTYPE *min, const NUMTYPE *max, 
+        const DATATYPE data, void *udata);
+    void *udata;
+};
+
+// search_one adapts the iter of a batch to node_search, for a query that
+// goes on alone.
+struct search_one {
+    struct search_many *sm;
+    int q;
+};
+
+static bool search_one_iter(const NUMTYPE *min, const NUMTYPE *max, 
+    const DATATYPE data, void *udata)
+{
+    struct search_one *one = (struct search_one *)udata;
+    struct search_many *sm = one->sm;
+    if (!sm->iter(one->q, min, max, data, sm->udata)) {
+        sm->stopped[one->q] = true;
+        sm->nstopped++;
+        return false;
+    }
+    return true;
+}
+
+// node_search_many searches a node for the nqs queries in qs, whose rects
+// all fall within the bounds rect. Entries outside of the bounds are skipped
+// with a single test instead of one per query. A lone query is handed to 
+// node_search, which doesn't pay for the lists.
+static bool node_search_many(struct search_many *sm, struct node *node,
+    const struct rect *bounds, int *qs, int nqs)
+{
+    if (nqs == 1) {
+        struct search_one one = { .sm = sm, .q = qs[0] };
+        node_search(node, &sm->rects[one.q], search_one_iter, &one);
+        return sm->nstopped < sm->n;
+    }
+    qstats_enter();
+    qstats_add(rect_tests, node->count);
+    if (node->kind == LEAF) {
+        qstats_add(items_examined, node->count);
+        for (int i = 0; i < node->count; i++) {
+            if (!rect_intersects(&node->rects[i], bounds) || 
+                node_tomb(node, i))
+            {
+                continue;
+            }
+            qstats_add(rect_tests, nqs);
+            for (int j = 0; j < nqs; j++) {
+                int q = qs[j];
+                if (sm->stopped[q] || 
+                    !rect_intersects(&node->rects[i], &sm->rects[q]))
+                {
+                    continue;
+                }
+                qstats_add(rect_hits, 1);
+                qstats_add(items_returned, 1);
+                if (!sm->iter(q, node->rects[i].min, node->rects[i].max,
+                    node_data(node, i), sm->udata))
+                {
+                    sm->stopped[q] = true;
+                    sm->nstopped++;
+                    if (sm->nstopped == sm->n) {
+                        return false;
+                    }
+                }
+            }
+        }
+        qstats_leave();
+        return true;
+    }
+    // The queries for the children go into the next level's list.
+    int *next = qs+sm->n;
+    for (int i = 0; i < node->count; i++) {
+        if (!rect_intersects(&node->rects[i], bounds)) {
+            continue;
+        }
+        qstats_add(rect_tests, nqs);
+        struct rect nbounds;
+        int m = 0;
+        for (int j = 0; j < nqs; j++) {
+            int q = qs[j];
+            if (!sm->stopped[q] && 
+                rect_intersects(&node->rects[i], &sm->rects[q]))
+            {
+                if (m == 0) {
+                    nbounds = sm->rects[q];
+                } else {
+                    rect_expand(&nbounds, &sm->rects[q]);
+                }
+                next[m++] = q;
+            }
+        }
+        if (m > 0) {
+            qstats_add(rect_hits, 1);
+            if (!node_search_many(sm, node->children[i], &nbounds, next, m)) {
+                return false;
+            }
+        }
+    }
+    qstats_leave();
+    return true;
+}
+
+// search_many_roots searches the main tree and the write buffer for the 
+// queries from q0 up to q1, together. Returns false once every query of the
+// batch has stopped.
+static bool search_many_roots(const struct rtree *tr, struct search_many *sm,
+    int q0, int q1, int *qs)
+{
+    for (int i = 0; i <= tr->nbufs; i++) {
+        const struct rect *nr;
+        size_t rheight;
+        struct node *root = tree_root(tr, i, &nr, &rheight);
+        if (!root) {
+            continue;
+        }
+        int nqs = 0;
+        struct rect bounds;
+        for (int q = q0; q < q1; q++) {
+            if (!sm->stopped[q] && rect_intersects(nr, &sm->rects[q])) {
+                if (nqs == 0) {
+                    bounds = sm->rects[q];
+                } else {
+                    rect_expand(&bounds, &sm->rects[q]);
+                }
+                qs[nqs++] = q;
+            }
+        }
+        if (nqs > 0 && !node_search_many(sm, root, &bounds, qs, nqs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A batch only gains from walking the tree together when its queries share
+// leaves, which is when they overlap, or when a few of them fall on the 
+// area of an average leaf. This many, at least.
+#define SEARCH_MANY_SHARE 8
+
+bool rtree_search_many(const struct rtree *tr, const NUMTYPE *rects, int n,
+    bool (*iter)(int q, const NUMTYPE *min, const NUMTYPE *max, 
+        const DATATYPE data, void *udata),
+    void *udata)
+{
+    qstats_reset();
+    if ((!tr->root && tr->nbufs == 0) || n <= 0) {
+        return true;
+    }
+    size_t height = MAX(tr->height, 1);
+    size_t size = sizeof(struct rect)*n + sizeof(int)*n*height + 
+        sizeof(bool)*n;
+    char *mem = (char *)tr->malloc(size);
+    if (!mem) {
+        return false;
+    }
+    struct search_many sm = {
+        .rects = (struct rect *)mem,
+        .stopped = (bool *)(mem+sizeof(struct rect)*n+sizeof(int)*n*height),
+        .n = n,
+        .iter = iter,
+        .udata = udata,
+    };
+    int *qs = (int *)(mem+sizeof(struct rect)*n);
+    struct rect all;
+    double sum = 0;
+    for (int q = 0; q < n; q++) {
+        memcpy(&sm.rects[q], &rects[q*DIMS*2], sizeof(struct rect));
+        sm.stopped[q] = false;
+        if (q == 0) {
+            all = sm.rects[q];
+        } else {
+            rect_expand(&all, &sm.rects[q]);
+        }
+        sum += (double)rect_area(&sm.rects[q]);
+        trace_search(tr, &sm.rects[q]);
+    }
+    double area = (double)rect_area(&all);
+    bool together = area <= sum*2;
+    if (!together && tr->count > 0) {
+        double leaf = (double)rect_area(&tr->rect)*MAX_ENTRIES/
+            (double)tr->count;
+        together = leaf*n >= area*SEARCH_MANY_SHARE;
+    }
+    if (together) {
+        search_many_roots(tr, &sm, 0, n, qs);
+    } else {
+        // The union would cover far more of the tree than the queries, so 
+        // each one is searched on its own.
+        for (int q = 0; q < n; q++) {
+            if (!search_many_roots(tr, &sm, q, q+1, qs)) {
+                break;
+            }
+        }
+    }
+    tr->free(mem);
+    return true;
+}
+
+// The pipelined search keeps this many queries in flight. Each one stops
+// after descending into a child, prefetches the child, and yields to the
+// next, so the cache misses of the different queries overlap.
+#define PIPELINE_LANES 16
+
+// The number of cache lines of a child node to prefetch: its header and 
+// first rects.
+#define PIPELINE_PREFETCH_LINES 8
+
+struct pipeline_lane {
+    int q;
+    int root;           // the next root to search, see tree_root
+    bool stopped;       // the iter returned false
+    int depth;
+    struct rect rect;
+    struct node *nodes[RTREE_MAX_LEVELS];
+    int idxs[RTREE_MAX_LEVELS];
+};
+
+static void pipeline_push(struct pipeline_lane *lane, struct node *node) {
+    for (int i = 0; i < PIPELINE_PREFETCH_LINES; i++) {
+        PREFETCH((char *)node+i*64);
+    }
+    lane->nodes[lane->depth] = node;
+    lane->idxs[lane->depth] = 0;
+    lane->depth++;
+}
+
+// pipeline_step advances a query until it descends into a new node, or 
+// finishes. Returns false when the query is finished.
+static bool pipeline_step(struct pipeline_lane *lane,
+    bool (*iter)(int q, const NUMTYPE *min, const NUMTYPE *max, 
+        const DATATYPE data, void *udata),
+    void *udata)
+{
+    while (lane->depth > 0) {
+        struct node *node = lane->nodes[lane->depth-1];
+        int i = lane->idxs[lane->depth-1];
+        if (node->kind == LEAF) {
+            qstats_add(rect_tests, node->count);
+            qstats_add(items_examined, node->count);
+            for (; i < node->count; i++) {
+                if (rect_intersects(&node->rects[i], &lane->rect) &&
+                    !node_tomb(node, i))
+                {
+                    qstats_add(rect_hits, 1);
+                    qstats_add(items_returned, 1);
+                    if (!iter(lane->q, node->rects[i].min, 
+                        node->rects[i].max, node_data(node, i), udata))
+                    {
+                        lane->depth = 0;
+                        lane->stopped = true;
+                        return false;
+                    }
+                }
+            }
+            lane->depth--;
+            continue;
+        }
+        for (; i < node->count; i++) {
+            qstats_add(rect_tests, 1);
+            if (rect_intersects(&node->rects[i], &lane->rect)) {
+                break;
+            }
+        }
+        if (i == node->count) {
+            lane->depth--;
+            continue;
+        }
+        qstats_add(rect_hits, 1);
+        lane->idxs[lane->depth-1] = i+1;
+        pipeline_push(lane, node->children[i]);
+        return true;
+    }
+    return false;
+}
+
+// pipeline_next starts a lane on the next root that its rect intersects.
+// Returns false when there are none left.
+static bool pipeline_next(const struct rtree *tr, struct pipeline_lane *lane) {
+    while (!lane->stopped && lane->root <= tr->nbufs) {
+        const struct rect *nr;
+        size_t height;
+        struct node *root = tree_root(tr, lane->root++, &nr, &height);
+        if (root && rect_intersects(nr, &lane->rect)) {
+            pipeline_push(lane, root);
+            return true;
+        }
+    }
+    return false;
+}
+
+void rtree_search_pipelined(const struct rtree *tr, const NUMTYPE *rects, 
+    int n,
+    bool (*iter)(int q, const NUMTYPE *min, const NUMTYPE *max, 
+        const DATATYPE data, void *udata),
+    void *udata)
+{
+    qstats_reset();
+    struct pipeline_lane lanes[PIPELINE_LANES];
+    int nlanes = 0;
+    int q = 0;
+    while (q < n || nlanes > 0) {
+        // Fill the free lanes with the next queries.
+        while (nlanes < PIPELINE_LANES && q < n) {
+            struct pipeline_lane *lane = &lanes[nlanes];
+            lane->q = q;
+            lane->root = 0;
+            lane->stopped = false;
+            lane->depth = 0;
+            memcpy(&lane->rect, &rects[q*DIMS*2], sizeof(struct rect));
+            q++;
+            trace_search(tr, &lane->rect);
+            if (pipeline_next(tr, lane)) {
+                nlanes++;
+            }
+        }
+        // Step every lane once, moving on to the next root of the finished
+        // ones, or dropping them.
+        for (int i = 0; i < nlanes; i++) {
+            if (!pipeline_step(&lanes[i], iter, udata) && 
+                !pipeline_next(tr, &lanes[i]))
+            {
+                lanes[i--] = lanes[--nlanes];
+            }
+        }
+    }
+}
+
+static bool node_scan(struct node *node,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata) 
+{
+    qstats_enter();
+    if (node->kind == LEAF) {
+        qstats_add(items_examined, node->count);
+        for (int i = 0; i < node->count; i++) {
+            if (node_tomb(node, i)) {
+                continue;
+            }
+            qstats_add(items_returned, 1);
+            if (!iter(node->rects[i].min, node->rects[i].max, 
+                node_data(node, i), udata))
+            {
+                return false;
+            }
+        }
+        qstats_leave();
+        return true;
+    }
+    for (int i = 0; i < node->count; i++) {
+        if (!node_scan(node->children[i], iter, udata)) {
+            return false;
+        }
+    }
+    qstats_leave();
+    return true;
+}
+
+void rtree_scan(const struct rtree *tr, 
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata)
+{
+    qstats_reset();
+    if (tr->root && !node_scan(tr->root, iter, udata)) {
+        return;
+    }
+    for (int b = 0; b < tr->nbufs; b++) {
+        if (!node_scan(tr->bufs[b], iter, udata)) {
+            return;
+        }
+    }
+}
+
+struct join_task;
+
+struct join {
+    bool (*iter)(const NUMTYPE *amin, const NUMTYPE *amax, 
+        const DATATYPE adata, const NUMTYPE *bmin, const NUMTYPE *bmax, 
+        const DATATYPE bdata, void *udata);
+    void *udata;
+    // When splitting a join into tasks, node pairs at or below the split 
+    // height are added to the tasks instead of being joined.
+    struct rtree *tr;   // allocator for the tasks
+    struct join_task *tasks;
+    size_t ntasks;
+    size_t cap;
+    size_t split;
+    bool oom;
+};
+
+static bool node_join(struct join *j, struct node *a, size_t ha, 
+    const struct rect *ra, struct node *b, size_t hb, const struct rect *rb);
+static bool join_task_add(struct join *j, struct node *a, size_t ha, 
+    const struct rect *ra, struct node *b, size_t hb, const struct rect *rb);
+
+// join_pair joins the entries i of a and k of b, which intersect.
+static bool join_pair(struct join *j, struct node *a, int i, size_t ha,
+    struct node *b, int k, size_t hb)
+{
+    if (ha == 1) {
+        if (node_tomb(a, i) || node_tomb(b, k)) {
+            return true;
+        }
+        return j->iter(a->rects[i].min, a->rects[i].max, node_data(a, i),
+            b->rects[k].min, b->rects[k].max, node_data(b, k), j->udata);
+    }
+    return node_join(j, a->children[i], ha-1, &a->rects[i], 
+        b->children[k], hb-1, &b->rects[k]);
+}
+
+// node_join joins two nodes with intersecting rects, ra and rb, that are
+// ha and hb levels above their leaves.
+static bool node_join(struct join *j, struct node *a, size_t ha, 
+    const struct rect *ra, struct node *b, size_t hb, const struct rect *rb)
+{
+    if (j->tasks && ha <= j->split && hb <= j->split) {
+        return join_task_add(j, a, ha, ra, b, hb, rb);
+    }
+    // Descend the taller side until both are on the same level.
+    if (ha > hb) {
+        for (int i = 0; i < a->count && !(a->rects[i].min[0] > rb->max[0]);
+            i++) 
+        {
+            if (rect_intersects(&a->rects[i], rb)) {
+                if (!node_join(j, a->children[i], ha-1, &a->rects[i], 
+                    b, hb, rb))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    if (hb > ha) {
+        for (int k = 0; k < b->count && !(b->rects[k].min[0] > ra->max[0]);
+            k++) 
+        {
+            if (rect_intersects(&b->rects[k], ra)) {
+                if (!node_join(j, a, ha, ra, b->children[k], hb-1, 
+                    &b->rects[k]))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    // Plane sweep over the entries of both nodes, which are sorted by 
+    // min[0]. The entry with the lowest min[0] is paired with the entries of
+    // the other node that start before it ends.
+    int i = 0;
+    int k = 0;
+    while (i < a->count && k < b->count) {
+        if (!(a->rects[i].min[0] > b->rects[k].min[0])) {
+            for (int m = k; m < b->count && 
+                !(b->rects[m].min[0] > a->rects[i].max[0]); m++)
+            {
+                if (rect_intersects(&a->rects[i], &b->rects[m])) {
+                    if (!join_pair(j, a, i, ha, b, m, hb)) {
+                        return false;
+                    }
+                }
+            }
+            i++;
+        } else {
+            for (int m = i; m < a->count && 
+                !(a->rects[m].min[0] > b->rects[k].max[0]); m++)
+            {
+                if (rect_intersects(&a->rects[m], &b->rects[k])) {
+                    if (!join_pair(j, a, m, ha, b, k, hb)) {
+                        return false;
+                    }
+                }
+            }
+            k++;
+        }
+    }
+    return true;
+}
+
+static bool node_self_join(struct join *j, struct node *node, size_t h);
+
+// tree_join joins the main tree and write buffer of a with those of b, or 
+// with themselves when b is NULL.
+static bool tree_join(struct join *j, const struct rtree *a, 
+    const struct rtree *b)
+{
+    const struct rtree *c = b ? b : a;
+    for (int i = 0; i <= a->nbufs; i++) {
+        const struct rect *ra;
+        size_t ha;
+        struct node *na = tree_root(a, i, &ra, &ha);
+        if (!na) {
+            continue;
+        }
+        if (!b && !node_self_join(j, na, ha)) {
+            return false;
+        }
+        for (int k = b ? 0 : i+1; k <= c->nbufs; k++) {
+            const struct rect *rc;
+            size_t hc;
+            struct node *nc = tree_root(c, k, &rc, &hc);
+            if (nc && rect_intersects(ra, rc) && 
+                !node_join(j, na, ha, ra, nc, hc, rc))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void rtree_join(const struct rtree *a, const struct rtree *b, 
+    bool (*iter)(const NUMTYPE *amin, const NUMTYPE *amax, 
+        const DATATYPE adata, const NUMTYPE *bmin, const NUMTYPE *bmax, 
+        const DATATYPE bdata, void *udata),
+    void *udata)
+{
+    struct join j = { .iter = iter, .udata = udata };
+    tree_join(&j, a, b);
+}
+
+// node_self_join joins a node that is h levels above its leaves with 
+// itself, visiting every pair of distinct intersecting items once.
+static bool node_self_join(struct join *j, struct node *node, size_t h) {
+    if (j->tasks && h <= j->split) {
+        return join_task_add(j, node, h, NULL, NULL, 0, NULL);
+    }
+    for (int i = 0; i < node->count; i++) {
+        if (h > 1 && !node_self_join(j, node->children[i], h-1)) {
+            return false;
+        }
+        for (int m = i+1; m < node->count && 
+            !(node->rects[m].min[0] > node->rects[i].max[0]); m++)
+        {
+            if (rect_intersects(&node->rects[i], &node->rects[m])) {
+                if (!join_pair(j, node, i, h, node, m, h)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void rtree_self_join(const struct rtree *tr, 
+    bool (*iter)(const NUMTYPE *amin, const NUMTYPE *amax, 
+        const DATATYPE adata, const NUMTYPE *bmin, const NUMTYPE *bmax, 
+        const DATATYPE bdata, void *udata),
+    void *udata)
+{
+    struct join j = { .iter = iter, .udata = udata };
+    tree_join(&j, tr, NULL);
+}
+
+////////////////////////////////
+// thread pool
+////////////////////////////////
+
+// The pool runs a fixed set of tasks, numbered 0 to ntasks-1, over a number
+// of threads. Each thread starts with its own contiguous range of tasks in a
+// deque, working from the back. A thread whose deque is empty steals from 
+// the front of the others, so threads that finish early take over the work
+// of the slower ones.
+
+// Work is split into at least this many tasks per thread, to leave enough 
+// of them to steal when it is uneven.
+#define POOL_TASKS_PER_THREAD 16
+
+struct pool_deque {
+    pthread_mutex_t mu;
+    size_t head;        // the next task to steal
+    size_t tail;        // one past the next task of the owner
+};
+
+struct pool {
+    struct pool_deque *deques;
+    int nthreads;
+    pthread_mutex_t start;  // held until all threads have started
+    atomic_bool stop;
+    bool (*run)(void *ctx, size_t task, int thread);
+    void *ctx;
+};
+
+struct pool_worker {
+    struct pool *pool;
+    int thread;
+};
+
+static bool pool_next(struct pool *pool, int thread, size_t *task) {
+    for (int i = 0; i < pool->nthreads; i++) {
+        struct pool_deque *dq = &pool->deques[(thread+i)%pool->nthreads];
+        pthread_mutex_lock(&dq->mu);
+        bool ok = dq->head < dq->tail;
+        if (ok) {
+            *task = i == 0 ? --dq->tail : dq->head++;
+        }
+        pthread_mutex_unlock(&dq->mu);
+        if (ok) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *pool_work(void *arg) {
+    struct pool_worker *w = arg;
+    struct pool *pool = w->pool;
+    pthread_mutex_lock(&pool->start);
+    pthread_mutex_unlock(&pool->start);
+    size_t task;
+    while (!atomic_load(&pool->stop) && pool_next(pool, w->thread, &task)) {
+        if (!pool->run(pool->ctx, task, w->thread)) {
+            atomic_store(&pool->stop, true);
+        }
+    }
+    return NULL;
+}
+
+// pool_run runs the tasks, using the calling thread as the first of the
+// threads, and returns once they are all done or one of them returned false.
+// Returns false if the system is out of memory or threads could not be
+// started, in which case no tasks have run.
+static bool pool_run(const struct rtree *tr, size_t ntasks, int nthreads,
+    bool (*run)(void *ctx, size_t task, int thread), void *ctx)
+{
+    size_t size = (sizeof(struct pool_deque)+sizeof(struct pool_worker)+
+        sizeof(pthread_t))*nthreads;
+    char *mem = (char *)tr->malloc(size);
+    if (!mem) {
+        return false;
+    }
+    struct pool pool = {
+        .deques = (struct pool_deque *)mem,
+        .nthreads = nthreads,
+        .run = run,
+        .ctx = ctx,
+    };
+    struct pool_worker *workers = (struct pool_worker *)
+        (mem+sizeof(struct pool_deque)*nthreads);
+    pthread_t *threads = (pthread_t *)(mem+(sizeof(struct pool_deque)+
+        sizeof(struct pool_worker))*nthreads);
+    atomic_init(&pool.stop, false);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&pool.deques[i].mu, NULL);
+        pool.deques[i].head = ntasks*i/nthreads;
+        pool.deques[i].tail = ntasks*(i+1)/nthreads;
+        workers[i].pool = &pool;
+        workers[i].thread = i;
+    }
+    // Hold back the tasks until all threads have started.
+    pthread_mutex_init(&pool.start, NULL);
+    pthread_mutex_lock(&pool.start);
+    int started = 1;
+    bool ok = true;
+    for (; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, pool_work, 
+            &workers[started]))
+        {
+            atomic_store(&pool.stop, true);
+            ok = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool.start);
+    if (ok) {
+        pool_work(&workers[0]);
+    }
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.start);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&pool.deques[i].mu);
+    }
+    tr->free(mem);
+    return ok;
+}
+
+static int pool_threads(int nthreads) {
+    if (nthreads > 0) {
+        return nthreads;
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+////////////////////////////////
+// parallel join
+////////////////////////////////
+
+// A join task is a pair of nodes to join, or a single node to join with 
+// itself when b is NULL.
+struct join_task {
+    struct node *a;
+    struct node *b;
+    size_t ha;
+    size_t hb;
+    const struct rect *ra;
+    const struct rect *rb;
+};
+
+static bool join_task_add(struct join *j, struct node *a, size_t ha, 
+    const struct rect *ra, struct node *b, size_t hb, const struct rect *rb)
+{
+    if (j->ntasks == j->cap) {
+        size_t cap = j->cap*2;
+        struct join_task *tasks = (struct join_task *)j->tr->malloc(
+            sizeof(struct join_task)*cap);
+        if (!tasks) {
+            j->oom = true;
+            return false;
+        }
+        memcpy(tasks, j->tasks, sizeof(struct join_task)*j->ntasks);
+        j->tr->free(j->tasks);
+        j->tasks = tasks;
+        j->cap = cap;
+    }
+    j->tasks[j->ntasks++] = (struct join_task){ 
+        .a = a, .ha = ha, .ra = ra, .b = b, .hb = hb, .rb = rb,
+    };
+    return true;
+}
+
+struct join_parallel {
+    struct join_task *tasks;
+    bool (*iter)(const NUMTYPE *amin, const NUMTYPE *amax, 
+        const DATATYPE adata, const NUMTYPE *bmin, const NUMTYPE *bmax, 
+        const DATATYPE bdata, void *udata);
+    void **udatas;
+};
+
+static bool join_run(void *ctx, size_t t, int thread) {
+    struct join_parallel *jp = ctx;
+    struct join_task *task = &jp->tasks[t];
+    struct join j = { 
+        .iter = jp->iter, 
+        .udata = jp->udatas ? jp->udatas[thread] : NULL,
+    };
+    if (!task->b) {
+        return node_self_join(&j, task->a, task->ha);
+    }
+    return node_join(&j, task->a, task->ha, task->ra, task->b, task->hb, 
+        task->rb);
+}
+
+bool rtree_join_parallel(const struct rtree *a, const struct rtree *b, 
+    int nthreads,
+    bool (*iter)(const NUMTYPE *amin, const NUMTYPE *amax, 
+        const DATATYPE adata, const NUMTYPE *bmin, const NUMTYPE *bmax, 
+        const DATATYPE bdata, void *udata),
+    void **udatas)
+{
+    if ((!a->root && a->nbufs == 0) || (b && !b->root && b->nbufs == 0)) {
+        return true;
+    }
+    nthreads = pool_threads(nthreads);
+    struct join j = { .tr = (struct rtree *)a, .cap = 64 };
+    j.tasks = (struct join_task *)a->malloc(sizeof(struct join_task)*j.cap);
+    if (!j.tasks) {
+        return false;
+    }
+    // Lower the split height until there are enough tasks to balance.
+    j.split = MAX(MAX(a->height, b ? b->height : 0), 1);
+    while (1) {
+        j.ntasks = 0;
+        tree_join(&j, a, b);
+        if (j.oom || j.split == 1 || 
+            j.ntasks >= (size_t)nthreads*POOL_TASKS_PER_THREAD) 
+        {
+            break;
+        }
+        j.split--;
+    }
+    bool ok = !j.oom;
+    if (ok && j.ntasks > 0) {
+        struct join_parallel jp = { 
+            .tasks = j.tasks, .iter = iter, .udatas = udatas,
+        };
+        ok = pool_run(a, j.ntasks, nthreads, join_run, &jp);
+    }
+    a->free(j.tasks);
+    return ok;
+}
+
+////////////////////////////////
+// parallel search
+////////////////////////////////
+
+// A parallel search is split into tasks by the subtrees, at a split height,
+// that intersect the search rect.
+struct search_task {
+    struct node *node;
+    const struct rect *rect;
+};
+
+struct search_parallel {
+    const struct rtree *tr;
+    struct rect rect;
+    struct search_task *tasks;
+    size_t ntasks;
+    size_t cap;
+    size_t split;
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        void *udata);
+    void **udatas;
+};
+
+static bool search_tasks_add(struct search_parallel *sp, struct node *node,
+    size_t h, const struct rect *rect)
+{
+    if (h <= sp->split) {
+        if (sp->ntasks == sp->cap) {
+            size_t cap = sp->cap*2;
+            struct search_task *tasks = (struct search_task *)
+                sp->tr->malloc(sizeof(struct search_task)*cap);
+            if (!tasks) {
+                return false;
+            }
+            memcpy(tasks, sp->tasks, sizeof(struct search_task)*sp->ntasks);
+            sp->tr->free(sp->tasks);
+            sp->tasks = tasks;
+            sp->cap = cap;
+        }
+        sp->tasks[sp->ntasks++] = (struct search_task){ node, rect };
+        return true;
+    }
+    for (int i = 0; i < node->count; i++) {
+        if (rect_intersects(&node->rects[i], &sp->rect)) {
+            if (!search_tasks_add(sp, node->children[i], h-1, 
+                &node->rects[i]))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool search_run(void *ctx, size_t t, int thread) {
+    struct search_parallel *sp = ctx;
+    struct search_task *task = &sp->tasks[t];
+    void *udata = sp->udatas ? sp->udatas[thread] : NULL;
+    qstats_reset();
+    // Subtrees that are entirely inside the search rect need no tests.
+    if (rect_contains(&sp->rect, task->rect)) {
+        return node_scan(task->node, sp->iter, udata);
+    }
+    return node_search(task->node, &sp->rect, sp->iter, udata);
+}
+
+bool rtree_search_parallel(const struct rtree *tr, 
+    const NUMTYPE min[], const NUMTYPE max[], int nthreads,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void **udatas)
+{
+    struct search_parallel sp = { .tr = tr, .iter = iter, .udatas = udatas };
+    memcpy(&sp.rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&sp.rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    trace_search(tr, &sp.rect);
+    if (!tr->root && tr->nbufs == 0) {
+        return true;
+    }
+    nthreads = pool_threads(nthreads);
+    sp.cap = 64;
+    sp.tasks = (struct search_task *)tr->malloc(
+        sizeof(struct search_task)*sp.cap);
+    if (!sp.tasks) {
+        return false;
+    }
+    // Lower the split height until there are enough subtrees to balance.
+    bool ok = true;
+    sp.split = MAX(tr->height, 1);
+    while (1) {
+        sp.ntasks = 0;
+        for (int i = 0; ok && i <= tr->nbufs; i++) {
+            const struct rect *nr;
+            size_t height;
+            struct node *root = tree_root(tr, i, &nr, &height);
+            if (root && rect_intersects(nr, &sp.rect)) {
+                ok = search_tasks_add(&sp, root, height, nr);
+            }
+        }
+        if (!ok || sp.split == 1 || 
+            sp.ntasks >= (size_t)nthreads*POOL_TASKS_PER_THREAD)
+        {
+            break;
+        }
+        sp.split--;
+    }
+    if (ok && sp.ntasks > 0) {
+        ok = pool_run(tr, sp.ntasks, nthreads, search_run, &sp);
+    }
+    tr->free(sp.tasks);
+    return ok;
+}
+
+size_t rtree_count(const struct rtree *tr) {
+    return tr->count+tr->bcount;
+}
+
+// node_delete deletes the first item in the rect, or with the exact rect,
+// that matches the data. Returns false if out of memory.
+static bool node_delete(struct rtree *tr, struct rect *nr, struct node *node, 
+    struct rect *ir, bool exact, struct item item, bool *removed, bool *shrunk,
+    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
+    void *udata)
+{
+    *removed = false;
+    *shrunk = false;
+    qstats_enter();
+    if (node->kind == LEAF) {
+        for (int i = 0; i < node->count; i++) {
+            qstats_add(rect_tests, 1);
+            qstats_add(items_examined, 1);
+            if ((exact ? !rect_equals(ir, &node->rects[i]) :
+                !rect_contains(ir, &node->rects[i])) || node_tomb(node, i))
+            {
+                continue;
+            }
+            qstats_add(rect_hits, 1);
+            int cmp;
+            if (compare) {
+                cmp = compare(node_data(node, i), item.data, udata);
+            } else if (node->isize) {
+                cmp = memcmp(node_item(node, i), item.data, 
+                    (size_t)node->isize);
+            } else {
+                cmp = memcmp(&node->items[i].data, &item.data, sizeof(DATATYPE));
+            }
+            if (cmp != 0) {
+                continue;
+            }
+            // Found the target item to delete.
+            if (tr->ids) {
+                idmap_del(tr->ids, tr->item_id(node_data(node, i), tr->udata));
+            }
+            if (tr->journal) {
+                journal_append(tr, JOURNAL_DELETE, &node->rects[i], 
+                    node_data(node, i));
+            }
+            if (tr->item_free) {
+                tr->item_free(node_data(node, i), tr->udata);
+            }
+            qstats_add(items_returned, 1);
+            *removed = true;
+            if (tr->lazy) {
+                // Leave a tombstone, and the rects as they are.
+                node_tomb_set(node, i, true);
+                node->dead++;
+                return true;
+            }
+            memmove(&node->rects[i], &node->rects[i+1], 
+                (node->count-(i+1))*sizeof(struct rect));
+            memmove(node_item(node, i), node_item(node, i+1), 
+                (node->count-(i+1))*node_item_size(node));
+            node_tombs_close(node, i);
+            node->count--;
+            if (rect_onedge(ir, nr)) {
+                // The item rect was on the edge of the node rect.
+                // We need to recalculate the node rect.
+                *nr = node_rect_calc(node);
+                // Notify the caller that we shrunk the rect.
+                *shrunk = true; 
+            }
+            return true;
+        }
+        qstats_leave();
+        return true;
+    }
+    for (int i = 0; i < node->count; i++) {
+        qstats_add(rect_tests, 1);
+        if (!rect_contains(&node->rects[i], ir)) {
+            continue;
+        }
+        qstats_add(rect_hits, 1);
+        struct rect crect = node->rects[i];
+        cow_node_or(node->children[i], return false);
+        if (!node_delete(tr, &node->rects[i], node->children[i], ir, exact, 
+            item, removed, shrunk, compare, udata))
+        {
+            return false;
+        }
+        if (!*removed) {
+            continue;
+        }
+        if (tr->lazy) {
+            node->dead++;
+            return true;
+        }
+        if (node->children[i]->count == 0) {
+            // underflow
+            node_free(tr, node->children[i]);
+            memmove(&node->rects[i], &node->rects[i+1], 
+                (node->count-(i+1))*sizeof(struct rect));
+            memmove(&node->children[i], &node->children[i+1], 
+                (node->count-(i+1))*sizeof(struct node *));
+            node->count--;
+            *nr = node_rect_calc(node);
+            *shrunk = true;
+            return true;
+        }
+        if (*shrunk) {
+            *shrunk = !rect_equals(&node->rects[i], &crect);
+            if (*shrunk) {
+                *nr = node_rect_calc(node);
+            }
+            node_order_to_right(node, i);
+        }
+        return true;
+    }
+    qstats_leave();
+    return true;
+}
+
+// buf_drop removes a leaf from the write buffer.
+static void buf_drop(struct rtree *tr, int b) {
+    node_free(tr, tr->bufs[b]);
+    memmove(&tr->bufs[b], &tr->bufs[b+1], 
+        (size_t)(tr->nbufs-(b+1))*sizeof(struct node *));
+    memmove(&tr->brects[b], &tr->brects[b+1], 
+        (size_t)(tr->nbufs-(b+1))*sizeof(struct rect));
+    tr->nbufs--;
+}
+
+// buf_delete deletes an item from the write buffer, like node_delete. 
+// Returns false if out of memory.
+static bool buf_delete(struct rtree *tr, struct rect *rect, bool exact, 
+    struct item item, bool *removed,
+    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
+    void *udata)
+{
+    *removed = false;
+    for (int b = 0; b < tr->nbufs && !*removed; b++) {
+        if (!rect_intersects(&tr->brects[b], rect)) {
+            continue;
+        }
+        bool shrunk;
+        cow_node_or(tr->bufs[b], return false);
+        if (!node_delete(tr, &tr->brects[b], tr->bufs[b], rect, exact, item, 
+            removed, &shrunk, compare, udata))
+        {
+            return false;
+        }
+        if (*removed) {
+            tr->bcount--;
+            if (tr->bufs[b]->count == 0) {
+                buf_drop(tr, b);
+            }
+        }
+    }
+    return true;
+}
+
+// tree_delete deletes an item without touching the journal reserve or trace.
+// The write buffer holds the newest items, and is tried first.
+// Returns false if out of memory.
+static bool tree_delete(struct rtree *tr, struct rect *rect, bool exact, 
+    const DATATYPE data,
+    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
+    void *udata)
+{
+    struct item item;
+    memcpy(&item.data, &data, sizeof(DATATYPE));
+    bool removed = false;
+    bool shrunk = false;
+    if (!buf_delete(tr, rect, exact, item, &removed, compare, udata)) {
+        return false;
+    }
+    if (removed || !tr->root) {
+        return true;
+    }
+    cow_node_or(tr->root, return false);
+    if (!node_delete(tr, &tr->rect, tr->root, rect, exact, item, &removed, 
+        &shrunk, compare, udata))
+    {
+        return false;
+    }
+    if (!removed) {
+        return true;
+    }
+    tr->count--;
+    if (tr->count == 0) {
+        node_free(tr, tr->root);
+        tr->root = NULL;
+        memset(&tr->rect, 0, sizeof(struct rect));
+        tr->height = 0;
+    } else {
+        while (tr->root->kind == BRANCH && tr->root->count == 1) {
+            struct node *prev = tr->root;
+            tr->root = tr->root->children[0];
+            prev->count = 0;
+            node_free(tr, prev);
+            tr->height--;
+        }
+        if (shrunk) {
+            tr->rect = node_rect_calc(tr->root);
+        }
+    }
+    return true;
+}
+
+// returns false if out of memory
+static bool rtree_delete0(struct rtree *tr, const NUMTYPE *min, 
+    const NUMTYPE *max, const DATATYPE data,
+    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
+    void *udata)
+{
+    qstats_reset();
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    if (tr->root || tr->nbufs) {
+        if (!journal_reserve(tr, 1) || !ids_reserve(tr, 0)) {
+            return false;
+        }
+        if (!tree_delete(tr, &rect, false, data, compare, udata)) {
+            return false;
+        }
+    }
+    if (tr->trace) {
+        trace_append(tr, RTREE_TRACE_DELETE, &rect, data);
+    }
+    return true;
+}
+
+bool rtree_delete(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, 
+    const DATATYPE data)
+{
+    return rtree_delete0(tr, min, max, data, NULL, NULL);
+}
+
+bool rtree_delete_with_comparator(struct rtree *tr, const NUMTYPE *min, 
+    const NUMTYPE *max, const DATATYPE data,
+    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
+    void *udata)
+{
+    return rtree_delete0(tr, min, max, data, compare, udata);
+}
+
+void rtree_set_lazy_delete(struct rtree *tr, bool lazy) {
+    tr->lazy = lazy;
+}
+
+// leaf_compact removes the tombstones from a leaf, keeping the order of the
+// other items.
+static void leaf_compact(struct node *node) {
+    int j = 0;
+    for (int i = 0; i < node->count; i++) {
+        if (node_tomb(node, i)) {
+            continue;
+        }
+        if (i != j) {
+            node->rects[j] = node->rects[i];
+            memcpy(node_item(node, j), node_item(node, i), 
+                node_item_size(node));
+        }
+        j++;
+    }
+    node->tombs = 0;
+    node->count = j;
+    node->dead = 0;
+}
+
+// node_compact removes the tombstones from the leaves below the node, up to
+// the budget of leaves, and makes the rects above them tight again. 
+// Returns false if out of memory, which leaves the node valid but maybe not
+// fully compacted.
+static bool node_compact(struct rtree *tr, struct rect *nr, struct node *node,
+    size_t *budget)
+{
+    if (node->kind == LEAF) {
+        leaf_compact(node);
+        if (node->count > 0) {
+            *nr = node_rect_calc(node);
+        }
+        (*budget)--;
+        return true;
+    }
+    bool ok = true;
+    for (int i = 0; i < node->count && *budget > 0; i++) {
+        if (node->children[i]->dead == 0) {
+            continue;
+        }
+        cow_node_or(node->children[i], { ok = false; break; });
+        ok = node_compact(tr, &node->rects[i], node->children[i], budget);
+        if (node->children[i]->count == 0) {
+            node_free(tr, node->children[i]);
+            memmove(&node->rects[i], &node->rects[i+1], 
+                (node->count-(i+1))*sizeof(struct rect));
+            memmove(&node->children[i], &node->children[i+1], 
+                (node->count-(i+1))*sizeof(struct node *));
+            node->count--;
+            i--;
+        }
+        if (!ok) {
+            break;
+        }
+    }
+    node_count_dead(node);
+    if (node->count > 0) {
+        *nr = node_rect_calc(node);
+        node_sort(node);
+    }
+    return ok;
+}
+
+bool rtree_compact(struct rtree *tr, size_t max) {
+    size_t budget = max ? max : SIZE_MAX;
+    for (int b = 0; b < tr->nbufs && budget > 0; b++) {
+        if (tr->bufs[b]->dead == 0) {
+            continue;
+        }
+        cow_node_or(tr->bufs[b], return false);
+        leaf_compact(tr->bufs[b]);
+        budget--;
+        if (tr->bufs[b]->count == 0) {
+            buf_drop(tr, b--);
+        } else {
+            tr->brects[b] = node_rect_calc(tr->bufs[b]);
+        }
+    }
+    if (!tr->root || tr->root->dead == 0 || budget == 0) {
+        return true;
+    }
+    cow_node_or(tr->root, return false);
+    bool ok = node_compact(tr, &tr->rect, tr->root, &budget);
+    while (tr->root->kind == BRANCH && tr->root->count == 1) {
+        struct node *prev = tr->root;
+        tr->root = tr->root->children[0];
+        prev->count = 0;
+        node_free(tr, prev);
+        tr->height--;
+    }
+    return ok;
+}
+
+////////////////////////////////
+// write buffer
+////////////////////////////////
+
+// The write buffer is a list of leaves, outside of the main tree, that new
+// items are appended to without a descent. Searches check the leaves after 
+// the main tree. Once all of the leaves are full the items are moved into 
+// the main tree in the order of a Hilbert curve, so that neighbors follow 
+// the same path down.
+
+// buf_insert appends a prepared item to the write buffer, flushing it first
+// when it's full. Returns false if out of memory, leaving the item to the
+// caller.
+static bool buf_insert(struct rtree *tr, struct rect rect, const void *src) {
+    if (tr->nbufs == 0 || tr->bufs[tr->nbufs-1]->count == MAX_ENTRIES) {
+        if (tr->nbufs == tr->maxbufs && !rtree_flush(tr)) {
+            return false;
+        }
+        struct node *leaf = node_new(tr, LEAF);
+        if (!leaf) {
+            return false;
+        }
+        tr->bufs[tr->nbufs] = leaf;
+        tr->brects[tr->nbufs] = rect;
+        tr->nbufs++;
+    }
+    int b = tr->nbufs-1;
+    cow_node_or(tr->bufs[b], return false);
+    bool split = false;
+    bool grown = false;
+    node_insert(tr, &tr->brects[b], tr->bufs[b], &rect, src, &split, &grown);
+    if (grown) {
+        rect_expand(&tr->brects[b], &rect);
+    }
+    tr->bcount++;
+    return true;
+}
+
+// hilbert_index returns the distance of the cell x,y along a Hilbert curve
+// that fills a 65536x65536 grid.
+static uint64_t hilbert_index(uint32_t x, uint32_t y) {
+    const uint32_t n = 1<<16;
+    uint64_t d = 0;
+    for (uint32_t s = n/2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += (uint64_t)s*s*((3*rx)^ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n-1-x;
+                y = n-1-y;
+            }
+            uint32_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+// hilbert_cell returns the grid cell of a coordinate between lo and hi.
+static uint32_t hilbert_cell(double v, double lo, double hi) {
+    if (!(hi > lo)) {
+        return 0;
+    }
+    return (uint32_t)((v-lo)/(hi-lo)*65535);
+}
+
+// hilbert_key returns the Hilbert index of the center of a rect, over the 
+// first two dimensions of the bounds.
+static uint64_t hilbert_key(const struct rect *rect, 
+    const struct rect *bounds)
+{
+    uint32_t cell[2] = { 0, 0 };
+    for (int k = 0; k < DIMS && k < 2; k++) {
+        double mid = ((double)rect->min[k] + (double)rect->max[k]) / 2;
+        cell[k] = hilbert_cell(mid, (double)bounds->min[k], 
+            (double)bounds->max[k]);
+    }
+    return hilbert_index(cell[0], cell[1]);
+}
+
+struct buf_ref {
+    uint64_t key;
+    int leaf;
+    int index;
+};
+
+static int buf_ref_compare(const void *a, const void *b) {
+    const struct buf_ref *ra = (const struct buf_ref *)a;
+    const struct buf_ref *rb = (const struct buf_ref *)b;
+    return ra->key < rb->key ? -1 : ra->key > rb->key;
+}
+
+bool rtree_flush(struct rtree *tr) {
+    if (tr->nbufs == 0) {
+        return true;
+    }
+    // The moved items are marked with tombstones, which needs the leaves to
+    // be unshared.
+    for (int b = 0; b < tr->nbufs; b++) {
+        cow_node_or(tr->bufs[b], return false);
+    }
+    struct buf_ref *refs = (struct buf_ref *)tr->malloc(
+        sizeof(struct buf_ref)*(tr->bcount+1));
+    if (!refs) {
+        return false;
+    }
+    struct rect bounds = tr->brects[0];
+    for (int b = 1; b < tr->nbufs; b++) {
+        rect_expand(&bounds, &tr->brects[b]);
+    }
+    size_t n = 0;
+    for (int b = 0; b < tr->nbufs; b++) {
+        struct node *leaf = tr->bufs[b];
+        for (int i = 0; i < leaf->count; i++) {
+            if (node_tomb(leaf, i)) {
+                continue;
+            }
+            refs[n++] = (struct buf_ref){ 
+                hilbert_key(&leaf->rects[i], &bounds), b, i 
+            };
+        }
+    }
+    qsort(refs, n, sizeof(struct buf_ref), buf_ref_compare);
+    bool ok = true;
+    for (size_t i = 0; i < n; i++) {
+        struct node *leaf = tr->bufs[refs[i].leaf];
+        int index = refs[i].index;
+        if (!tree_insert(tr, leaf->rects[index], node_item(leaf, index))) {
+            ok = false;
+            break;
+        }
+        // The item now belongs to the main tree.
+        node_tomb_set(leaf, index, true);
+        leaf->dead++;
+        tr->bcount--;
+    }
+    tr->free(refs);
+    // Lazily deleted items are dropped along with the moved ones.
+    for (int b = 0; b < tr->nbufs; b++) {
+        leaf_compact(tr->bufs[b]);
+        if (tr->bufs[b]->count == 0) {
+            buf_drop(tr, b--);
+        } else {
+            tr->brects[b] = node_rect_calc(tr->bufs[b]);
+        }
+    }
+    return ok;
+}
+
+bool rtree_set_write_buffer(struct rtree *tr, size_t size) {
+    if (!rtree_flush(tr)) {
+        return false;
+    }
+    size = MIN(size, (size_t)1<<30);
+    int maxbufs = (int)((size+MAX_ENTRIES-1)/MAX_ENTRIES);
+    char *mem = NULL;
+    if (maxbufs > 0) {
+        mem = (char *)tr->malloc((sizeof(struct rect)+sizeof(struct node *))*
+            (size_t)maxbufs);
+        if (!mem) {
+            return false;
+        }
+    }
+    if (tr->brects) {
+        tr->free(tr->brects);
+    }
+    tr->brects = (struct rect *)mem;
+    tr->bufs = mem ? (struct node **)(tr->brects+maxbufs) : NULL;
+    tr->maxbufs = maxbufs;
+    return true;
+}
+
+////////////////////////////////
+// batch insert
+////////////////////////////////
+
+// A batch is sorted along a Hilbert curve and pushed down the tree in runs
+// of items that choose the same child, so each node on the way is visited 
+// and copied once per run instead of once per item. If anything fails, the
+// items that went in are taken back out.
+
+struct batch_item {
+    uint64_t key;
+    struct rect rect;
+    DATATYPE data;
+    struct item item;   // the prepared item
+    const void *src;    // the bytes to copy into the leaf
+};
+
+static int batch_item_compare(const void *a, const void *b) {
+    const struct batch_item *ia = (const struct batch_item *)a;
+    const struct batch_item *ib = (const struct batch_item *)b;
+    return ia->key < ib->key ? -1 : ia->key > ib->key;
+}
+
+// batch_sort sorts the items of a batch along a Hilbert curve over their
+// bounds.
+static void batch_sort(struct batch_item *items, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    struct rect bounds = items[0].rect;
+    for (size_t k = 1; k < n; k++) {
+        rect_expand(&bounds, &items[k].rect);
+    }
+    for (size_t k = 0; k < n; k++) {
+        items[k].key = hilbert_key(&items[k].rect, &bounds);
+    }
+    qsort(items, n, sizeof(struct batch_item), batch_item_compare);
+}
+
+// node_insert_run inserts the items from *i up to end into the node, moving
+// *i past them. The items that choose the same child as the first one go 
+// down to it together. It stops early with split set when the node is full
+// and must be split by its parent. Returns false if out of memory.
+static bool node_insert_run(struct rtree *tr, struct rect *nr, 
+    struct node *node, struct batch_item *items, size_t *i, size_t end, 
+    bool *split)
+{
+    *split = false;
+    if (node->kind == LEAF) {
+        for (; *i < end; (*i)++) {
+            if (node->count == MAX_ENTRIES) {
+                *split = true;
+                return true;
+            }
+            leaf_insert(node, &items[*i].rect, items[*i].src);
+            rect_expand(nr, &items[*i].rect);
+        }
+        return true;
+    }
+    int next = -1;
+    while (*i < end) {
+        // The choice of the item that ended the last run still holds, unless
+        // the children moved around.
+        int index = next >= 0 ? next : 
+            node_choose_subtree(node, &items[*i].rect);
+        size_t j = *i+1;
+        next = -1;
+        for (; j < end; j++) {
+            // Neighbors that already fit the child follow it down without a
+            // choice of their own.
+            if (rect_contains(&node->rects[index], &items[j].rect)) {
+                continue;
+            }
+            next = node_choose_subtree(node, &items[j].rect);
+            if (next != index) {
+                break;
+            }
+        }
+        cow_node_or(node->children[index], return false);
+        bool csplit;
+        if (!node_insert_run(tr, &node->rects[index], node->children[index], 
+            items, i, j, &csplit))
+        {
+            return false;
+        }
+        rect_expand(nr, &node->rects[index]);
+        int moved = node_order_to_left(node, index);
+        if (moved != index || csplit) {
+            next = -1;
+            index = moved;
+        }
+        if (csplit) {
+            if (node->count == MAX_ENTRIES) {
+                *split = true;
+                return true;
+            }
+            if (!node_split_child(tr, node, index)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// node_remove removes an item with the rect and the bytes at src from below
+// the node, looking only in unshared nodes. Every node on the way to an item
+// of a batch was copied when it went in, so backing the batch out this way 
+// can't run out of memory. Returns false if the item wasn't found.
+static bool node_remove(struct rtree *tr, struct rect *nr, struct node *node,
+    const struct rect *ir, const void *src)
+{
+    if (node->kind == LEAF) {
+        size_t isize = node_item_size(node);
+        for (int i = 0; i < node->count; i++) {
+            if (!rect_equals(&node->rects[i], ir) || node_tomb(node, i) ||
+                memcmp(node_item(node, i), src, isize) != 0)
+            {
+                continue;
+            }
+            memmove(&node->rects[i], &node->rects[i+1], 
+                (node->count-(i+1))*sizeof(struct rect));
+            memmove(node_item(node, i), node_item(node, i+1), 
+                (node->count-(i+1))*isize);
+            node_tombs_close(node, i);
+            node->count--;
+            if (node->count > 0) {
+                *nr = node_rect_calc(node);
+            }
+            return true;
+        }
+        return false;
+    }
+    for (int i = 0; i < node->count; i++) {
+        struct node *child = node->children[i];
+        if (atomic_load(&child->rc) > 0 || 
+            !rect_contains(&node->rects[i], ir) ||
+            !node_remove(tr, &node->rects[i], child, ir, src))
+        {
+            continue;
+        }
+        if (child->count == 0) {
+            node_free(tr, child);
+            memmove(&node->rects[i], &node->rects[i+1], 
+                (node->count-(i+1))*sizeof(struct rect));
+            memmove(&node->children[i], &node->children[i+1], 
+                (node->count-(i+1))*sizeof(struct node *));
+            node->count--;
+        }
+        if (node->count > 0) {
+            *nr = node_rect_calc(node);
+            node_sort(node);
+        }
+        return true;
+    }
+    return false;
+}
+
+// tree_remove_many backs the first n items of a batch out of the main tree,
+// along with any root that the batch added.
+static void tree_remove_many(struct rtree *tr, struct batch_item *items, 
+    size_t n)
+{
+    for (size_t k = 0; k < n; k++) {
+        node_remove(tr, &tr->rect, tr->root, &items[k].rect, items[k].src);
+        if (tr->item_free) {
+            tr->item_free(items[k].item.data, tr->udata);
+        }
+    }
+    tr->count -= n;
+    if (!tr->root) {
+        return;
+    }
+    if (tr->count == 0 && tr->root->count == 0) {
+        node_free(tr, tr->root);
+        tr->root = NULL;
+        memset(&tr->rect, 0, sizeof(struct rect));
+        tr->height = 0;
+        return;
+    }
+    while (tr->root->kind == BRANCH && tr->root->count == 1) {
+        struct node *prev = tr->root;
+        tr->root = tr->root->children[0];
+        prev->count = 0;
+        node_free(tr, prev);
+        tr->height--;
+    }
+}
+
+// tree_insert_many inserts a sorted batch into the main tree. The number of
+// items inserted is returned in done. Returns false if out of memory.
+static bool tree_insert_many(struct rtree *tr, struct batch_item *items, 
+    size_t n, size_t *done)
+{
+    size_t i = 0;
+    bool ok = true;
+    while (ok && i < n) {
+        if (!tr->root) {
+            struct node *new_root = node_new(tr, LEAF);
+            if (!new_root) {
+                ok = false;
+                break;
+            }
+            tr->root = new_root;
+            tr->rect = items[i].rect;
+            tr->height = 1;
+        }
+        cow_node_or(tr->root, { ok = false; break; });
+        bool split;
+        size_t start = i;
+        ok = node_insert_run(tr, &tr->rect, tr->root, items, &i, n, &split);
+        tr->count += i-start;
+        if (ok && split) {
+            struct node *new_root = node_new(tr, BRANCH);
+            if (!new_root) {
+                ok = false;
+                break;
+            }
+            new_root->rects[0] = tr->rect;
+            new_root->children[0] = tr->root;
+            new_root->count = 1;
+            new_root->dead = tr->root->dead;
+            tr->root = new_root;
+            tr->height++;
+            ok = node_split_child(tr, tr->root, 0);
+        }
+    }
+    *done = i;
+    return ok;
+}
+
+// journal_insert_many adds the insert records of a batch. A batch that 
+// doesn't fit in the group is written out right away, together with the
+// waiting records. Returns false if the records could not be written.
+static bool journal_insert_many(struct rtree *tr, 
+    const struct batch_item *items, size_t n)
+{
+    struct journal *j = tr->journal;
+    if ((size_t)j->nrecs+n <= (size_t)j->group) {
+        for (size_t k = 0; k < n; k++) {
+            journal_append(tr, JOURNAL_INSERT, &items[k].rect, items[k].data);
+        }
+        return true;
+    }
+    if (!journal_commit(j) || fseek(j->file, j->end, SEEK_SET) != 0) {
+        return false;
+    }
+    bool ok = true;
+    for (size_t k = 0; k < n && ok; ) {
+        size_t m = MIN(n-k, (size_t)j->group);
+        for (size_t r = 0; r < m; r++) {
+            journal_encode(j->buf+r*JOURNAL_RECSIZE, JOURNAL_INSERT, 
+                &items[k+r].rect, items[k+r].data);
+        }
+        ok = fwrite(j->buf, JOURNAL_RECSIZE, m, j->file) == m;
+        k += m;
+    }
+    if (!ok || !file_sync(j->file)) {
+        // The batch is rolled back, so the records that made it to the file
+        // are cut off, like the torn tail on open, or a replay would bring
+        // them back.
+        fflush(j->file);
+        (void)!ftruncate(fileno(j->file), j->end);
+        return false;
+    }
+    j->end += (long)(n*JOURNAL_RECSIZE);
+    return true;
+}
+
+bool rtree_insert_many(struct rtree *tr, const NUMTYPE *mins, 
+    const NUMTYPE *maxs, const void *const *datas, size_t n)
+{
+    if (n == 0) {
+        return true;
+    }
+    if (!ids_reserve(tr, n)) {
+        return false;
+    }
+    struct batch_item *items = (struct batch_item *)tr->malloc(
+        sizeof(struct batch_item)*n);
+    if (!items) {
+        return false;
+    }
+    for (size_t k = 0; k < n; k++) {
+        const NUMTYPE *max = maxs ? maxs : mins;
+        memcpy(&items[k].rect.min[0], &mins[k*DIMS], sizeof(NUMTYPE)*DIMS);
+        memcpy(&items[k].rect.max[0], &max[k*DIMS], sizeof(NUMTYPE)*DIMS);
+        items[k].data = (DATATYPE)datas[k];
+    }
+    batch_sort(items, n);
+    size_t made = 0;
+    while (made < n && item_make(tr, items[made].data, &items[made].item, 
+        &items[made].src))
+    {
+        made++;
+    }
+    bool ok = made == n;
+    size_t done = 0;
+    if (ok) {
+        ok = tree_insert_many(tr, items, n, &done);
+        if (ok && tr->journal) {
+            ok = journal_insert_many(tr, items, n);
+        }
+        if (!ok) {
+            tree_remove_many(tr, items, done);
+        }
+    }
+    if (!ok) {
+        // The prepared items that didn't make it into the tree.
+        for (size_t k = done; k < made && tr->item_free; k++) {
+            tr->item_free(items[k].item.data, tr->udata);
+        }
+        tr->free(items);
+        return false;
+    }
+    for (size_t k = 0; k < n; k++) {
+        if (tr->item_id) {
+            idmap_set(tr->ids, tr->item_id(items[k].data, tr->udata), 
+                &items[k].rect);
+        }
+        if (tr->trace) {
+            trace_append(tr, RTREE_TRACE_INSERT, &items[k].rect, 
+                items[k].data);
+        }
+    }
+    tr->free(items);
+    return true;
+}
+
+////////////////////////////////
+// merge
+////////////////////////////////
+
+// A merge grafts whole subtrees of one tree into the other, each at its own
+// height, in a node where it doesn't overlap the other children. Grafted 
+// nodes are shared through their reference counters, like a clone, so the
+// source stays as it is. A subtree that can't be grafted is broken up into 
+// its children, and the items of the leaves that are left over are inserted
+// as a batch. The merge works on a copy-on-write version of the tree, which
+// is dropped if anything fails.
+
+// subtree is a node along with its rect and height.
+struct subtree {
+    struct node *node;
+    struct rect rect;
+    size_t height;
+};
+
+struct merge {
+    struct subtree *stack;  // pieces left to place
+    size_t nstack;
+    struct batch_item *items;   // items of the leaves that were broken up
+    size_t nitems;
+    size_t cap;
+};
+
+// node_graft places a piece below the node, which is at the given height, 
+// as a child of a node one above the height of the piece. Placed is left 
+// unset when the piece overlaps a child there. It stops with split set when
+// that node is full and must be split by its parent. Returns false if out 
+// of memory.
+static bool node_graft(struct rtree *tr, struct rect *nr, struct node *node,
+    size_t height, const struct subtree *piece, bool *split, bool *placed)
+{
+    *split = false;
+    *placed = false;
+    if (height == piece->height+1) {
+        for (int i = 0; i < node->count; i++) {
+            if (rect_intersects(&node->rects[i], &piece->rect)) {
+                return true;
+            }
+        }
+        if (node->count == MAX_ENTRIES) {
+            *split = true;
+            return true;
+        }
+        node->rects[node->count] = piece->rect;
+        node->children[node->count] = piece->node;
+        node->count++;
+        atomic_fetch_add(&piece->node->rc, 1);
+        node_order_to_left(node, node->count-1);
+        *placed = true;
+    } else {
+        int index = node_choose_subtree(node, &piece->rect);
+        cow_node_or(node->children[index], return false);
+        if (!node_graft(tr, &node->rects[index], node->children[index], 
+            height-1, piece, split, placed))
+        {
+            return false;
+        }
+        if (*split) {
+            if (node->count == MAX_ENTRIES) {
+                return true;
+            }
+            if (!node_split_child(tr, node, index)) {
+                return false;
+            }
+            return node_graft(tr, nr, node, height, piece, split, placed);
+        }
+        if (!*placed) {
+            return true;
+        }
+        node_order_to_left(node, index);
+    }
+    node->dead += piece->node->dead;
+    rect_expand(nr, &piece->rect);
+    return true;
+}
+
+// tree_graft places a piece into the main tree, which must be taller than
+// the piece. Returns false if out of memory.
+static bool tree_graft(struct rtree *tr, const struct subtree *piece, 
+    bool *placed)
+{
+    cow_node_or(tr->root, return false);
+    bool split;
+    if (!node_graft(tr, &tr->rect, tr->root, tr->height, piece, &split, 
+        placed))
+    {
+        return false;
+    }
+    if (split) {
+        struct node *new_root = node_new(tr, BRANCH);
+        if (!new_root) {
+            return false;
+        }
+        new_root->rects[0] = tr->rect;
+        new_root->children[0] = tr->root;
+        new_root->count = 1;
+        new_root->dead = tr->root->dead;
+        tr->root = new_root;
+        tr->height++;
+        if (!node_split_child(tr, tr->root, 0)) {
+            return false;
+        }
+        return tree_graft(tr, piece, placed);
+    }
+    return true;
+}
+
+// merge_add adds the live items of a leaf to the batch of a merge. Returns
+// false if out of memory.
+static bool merge_add(struct rtree *tr, struct merge *m, 
+    const struct node *leaf)
+{
+    if (m->nitems+(size_t)leaf->count > m->cap) {
+        size_t cap = m->cap ? m->cap*2 : 256;
+        struct batch_item *items = (struct batch_item *)tr->malloc(
+            sizeof(struct batch_item)*cap);
+        if (!items) {
+            return false;
+        }
+        if (m->items) {
+            memcpy(items, m->items, sizeof(struct batch_item)*m->nitems);
+            tr->free(m->items);
+        }
+        m->items = items;
+        m->cap = cap;
+    }
+    for (int i = 0; i < leaf->count; i++) {
+        if (!node_tomb(leaf, i)) {
+            m->items[m->nitems].rect = leaf->rects[i];
+            m->items[m->nitems].data = node_data(leaf, i);
+            m->nitems++;
+        }
+    }
+    return true;
+}
+
+// merge_graft grafts the pieces of a tree into the main tree, breaking up
+// the ones that don't fit, and adds the items of the leaves that are left
+// over to the batch. Returns false if out of memory.
+static bool merge_graft(struct rtree *tr, struct merge *m, 
+    struct subtree donor)
+{
+    m->stack = (struct subtree *)tr->malloc(
+        sizeof(struct subtree)*(MAX_ENTRIES*donor.height+1));
+    if (!m->stack) {
+        return false;
+    }
+    m->stack[m->nstack++] = donor;
+    while (m->nstack > 0) {
+        struct subtree piece = m->stack[--m->nstack];
+        if (piece.height < tr->height) {
+            bool placed;
+            if (!tree_graft(tr, &piece, &placed)) {
+                return false;
+            }
+            if (placed) {
+                continue;
+            }
+        }
+        if (piece.node->kind == LEAF) {
+            if (!merge_add(tr, m, piece.node)) {
+                return false;
+            }
+            continue;
+        }
+        for (int i = 0; i < piece.node->count; i++) {
+            m->stack[m->nstack].node = piece.node->children[i];
+            m->stack[m->nstack].rect = piece.node->rects[i];
+            m->stack[m->nstack].height = piece.height-1;
+            m->nstack++;
+        }
+    }
+    return true;
+}
+
+// node_gather copies the rects and data of the live items below the node.
+static void node_gather(const struct node *node, struct batch_item *items,
+    size_t *n)
+{
+    for (int i = 0; i < node->count; i++) {
+        if (node->kind == BRANCH) {
+            node_gather(node->children[i], items, n);
+        } else if (!node_tomb(node, i)) {
+            items[*n].rect = node->rects[i];
+            items[*n].data = node_data(node, i);
+            (*n)++;
+        }
+    }
+}
+
+bool rtree_merge(struct rtree *tr, const struct rtree *src) {
+    size_t n = src->count+src->bcount;
+    if (n == 0) {
+        return true;
+    }
+    if (!ids_reserve(tr, n)) {
+        return false;
+    }
+    // The index, journal, and trace need to see each item of the source.
+    struct batch_item *all = NULL;
+    if (tr->item_id || tr->journal || tr->trace) {
+        all = (struct batch_item *)tr->malloc(sizeof(struct batch_item)*n);
+        if (!all) {
+            return false;
+        }
+        size_t k = 0;
+        for (int i = 0; i <= src->nbufs; i++) {
+            const struct rect *rect;
+            size_t height;
+            struct node *root = tree_root(src, i, &rect, &height);
+            if (root) {
+                node_gather(root, all, &k);
+            }
+        }
+    }
+    // Keep the current version of the tree to go back to.
+    struct node *root = tr->root;
+    struct rect rect = tr->rect;
+    size_t height = tr->height;
+    size_t count = tr->count;
+    struct subtree donor = { src->root, src->rect, src->height };
+    if (src->root && (!root || height < src->height)) {
+        // The taller tree becomes the main tree, and the shorter one is 
+        // grafted into it.
+        donor.node = root;
+        donor.rect = rect;
+        donor.height = height;
+        tr->root = src->root;
+        tr->rect = src->rect;
+        tr->height = src->height;
+    }
+    if (tr->root) {
+        atomic_fetch_add(&tr->root->rc, 1);
+    }
+    struct merge m = { 0 };
+    bool ok = !donor.node || merge_graft(tr, &m, donor);
+    for (int b = 0; ok && b < src->nbufs; b++) {
+        ok = merge_add(tr, &m, src->bufs[b]);
+    }
+    size_t made = 0;
+    size_t done = 0;
+    if (ok) {
+        batch_sort(m.items, m.nitems);
+        while (made < m.nitems && item_make(tr, m.items[made].data, 
+            &m.items[made].item, &m.items[made].src))
+        {
+            made++;
+        }
+        ok = made == m.nitems && 
+            (m.nitems == 0 || tree_insert_many(tr, m.items, m.nitems, &done));
+    }
+    if (ok && tr->journal) {
+        ok = journal_insert_many(tr, all, n);
+    }
+    if (!ok) {
+        if (tr->root) {
+            node_free(tr, tr->root);
+        }
+        tr->root = root;
+        tr->rect = rect;
+        tr->height = height;
+        tr->count = count;
+        // The prepared items that didn't make it into the tree.
+        for (size_t k = done; k < made && tr->item_free; k++) {
+            tr->item_free(m.items[k].item.data, tr->udata);
+        }
+    } else {
+        tr->count = count+n;
+        if (root) {
+            node_free(tr, root);
+        }
+        for (size_t k = 0; all && k < n; k++) {
+            if (tr->item_id) {
+                idmap_set(tr->ids, tr->item_id(all[k].data, tr->udata), 
+                    &all[k].rect);
+            }
+            if (tr->trace) {
+                trace_append(tr, RTREE_TRACE_INSERT, &all[k].rect, 
+                    all[k].data);
+            }
+        }
+    }
+    if (m.stack) {
+        tr->free(m.stack);
+    }
+    if (m.items) {
+        tr->free(m.items);
+    }
+    if (all) {
+        tr->free(all);
+    }
+    return ok;
+}
+
+static void node_ids(struct rtree *tr, struct idmap *map, struct node *node) {
+    if (node->kind == LEAF) {
+        for (int i = 0; i < node->count; i++) {
+            if (!node_tomb(node, i)) {
+                idmap_set(map, tr->item_id(node_data(node, i), tr->udata), 
+                    &node->rects[i]);
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < node->count; i++) {
+        node_ids(tr, map, node->children[i]);
+    }
+}
+
+bool rtree_set_item_id(struct rtree *tr, 
+    uint64_t (*id)(const DATATYPE item, void *udata))
+{
+    idmap_release(tr, tr->ids);
+    tr->ids = NULL;
+    tr->item_id = NULL;
+    if (!id) {
+        return true;
+    }
+    size_t cap = 16;
+    while ((tr->count+tr->bcount)*4 > cap*3) {
+        cap *= 2;
+    }
+    if (tr->root || tr->nbufs) {
+        struct idmap *map = idmap_new(tr, cap);
+        if (!map) return false;
+        tr->ids = map;
+    }
+    tr->item_id = id;
+    if (tr->root) {
+        node_ids(tr, tr->ids, tr->root);
+    }
+    for (int b = 0; b < tr->nbufs; b++) {
+        node_ids(tr, tr->ids, tr->bufs[b]);
+    }
+    return true;
+}
+
+struct id_match {
+    struct rtree *tr;
+    uint64_t id;
+    DATATYPE data;      // the data of the matched item
+};
+
+static int id_compare(const DATATYPE a, const DATATYPE b, void *udata) {
+    (void)b;
+    struct id_match *match = (struct id_match *)udata;
+    if (match->tr->item_id(a, match->tr->udata) != match->id) {
+        return 1;
+    }
+    memcpy(&match->data, &a, sizeof(DATATYPE));
+    return 0;
+}
+
+bool rtree_delete_id(struct rtree *tr, uint64_t id) {
+    if (!tr->item_id) {
+        return false;
+    }
+    qstats_reset();
+    struct identry *entry = idmap_get(tr->ids, id);
+    if (!entry) {
+        return true;
+    }
+    struct rect rect = entry->rect;
+    if (!journal_reserve(tr, 1) || !ids_reserve(tr, 0)) {
+        return false;
+    }
+    struct id_match match = { .tr = tr, .id = id };
+    if (!tree_delete(tr, &rect, true, match.data, id_compare, &match)) {
+        return false;
+    }
+    if (tr->trace) {
+        trace_append(tr, RTREE_TRACE_DELETE, &rect, match.data);
+    }
+    return true;
+}
+
+// node_unshare copies the shared nodes on every path that may lead to the 
+// item with the rect and ID, so that deleting it later can't run out of 
+// memory. The leaf and index of the item are returned when it's found.
+static bool node_unshare(struct rtree *tr, struct node *node, 
+    const struct rect *ir, struct id_match *match, struct node **leaf,
+    int *index)
+{
+    if (node->kind == LEAF) {
+        for (int i = 0; i < node->count && !*leaf; i++) {
+            if (rect_equals(&node->rects[i], ir) && !node_tomb(node, i) &&
+                id_compare(node_data(node, i), match->data, match) == 0)
+            {
+                *leaf = node;
+                *index = i;
+            }
+        }
+        return true;
+    }
+    for (int i = 0; i < node->count; i++) {
+        if (!rect_contains(&node->rects[i], ir)) {
+            continue;
+        }
+        cow_node_or(node->children[i], return false);
+        if (!node_unshare(tr, node->children[i], ir, match, leaf, index)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool rtree_update_id(struct rtree *tr, const NUMTYPE *min, 
+    const NUMTYPE *max, const DATATYPE data)
+{
+    if (!tr->item_id) {
+        return false;
+    }
+    uint64_t id = tr->item_id(data, tr->udata);
+    struct identry *entry = idmap_get(tr->ids, id);
+    if (!entry) {
+        return rtree_insert(tr, min, max, data);
+    }
+    qstats_reset();
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    struct rect old = entry->rect;
+    if (!journal_reserve(tr, 2) || !ids_reserve(tr, 0)) {
+        return false;
+    }
+    // Unshare every node that tree_delete may copy first, which is each
+    // write buffer leaf that intersects the old rect and each path in the 
+    // main tree that contains it, so that once the new item is in, nothing 
+    // can fail. The main tree is unshared even when the item is buffered,
+    // because the insert may flush the buffer into it.
+    struct id_match match = { .tr = tr, .id = id };
+    struct node *leaf = NULL;
+    int index = 0;
+    for (int b = 0; b < tr->nbufs; b++) {
+        if (!rect_intersects(&tr->brects[b], &old)) {
+            continue;
         }
-        return true;
+        cow_node_or(tr->bufs[b], return false);
+        node_unshare(tr, tr->bufs[b], &old, &match, &leaf, &index);
     }
-    for (int i = 0; i < node->count; i++) {
-        if (!node_scan(node->children[i], iter, udata)) {
+    if (tr->root) {
+        cow_node_or(tr->root, return false);
+        if (!node_unshare(tr, tr->root, &old, &match, &leaf, &index)) {
+            return false;
+        }
+    }
+    if (leaf && rect_equals(&rect, &old)) {
+        // The rect didn't change, so the item is replaced in place.
+        struct item item;
+        const void *src;
+        if (!item_make(tr, data, &item, &src)) {
             return false;
         }
+        if (tr->journal) {
+            journal_append(tr, JOURNAL_DELETE, &old, node_data(leaf, index));
+        }
+        if (tr->item_free) {
+            tr->item_free(node_data(leaf, index), tr->udata);
+        }
+        memcpy(node_item(leaf, index), src, node_item_size(leaf));
+    } else {
+        if (!insert0(tr, rect, data)) {
+            return false;
+        }
+        if (leaf) {
+            bool ok = tree_delete(tr, &old, true, match.data, id_compare, 
+                &match);
+            assert(ok);
+            (void)ok;
+        }
+    }
+    idmap_set(tr->ids, id, &rect);
+    if (tr->journal) {
+        journal_append(tr, JOURNAL_INSERT, &rect, data);
+    }
+    if (tr->trace) {
+        trace_append(tr, RTREE_TRACE_DELETE, &old, match.data);
+        trace_append(tr, RTREE_TRACE_INSERT, &rect, data);
     }
     return true;
 }
 
-void rtree_scan(const struct rtree *tr, 
-    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
-        void *udata), 
-    void *udata)
-{
-    if (tr->root) {
-        node_scan(tr->root, iter, udata);
-    }
+////////////////////////////////
+// partition
+////////////////////////////////
+
+// A partition takes the subtrees a few levels below the root, enough of 
+// them to balance the parts, and orders them along a Hilbert curve. Runs of
+// neighboring subtrees with about the same number of items become the 
+// parts, each one under a few new branches on top of the shared subtrees.
+
+struct part_ref {
+    uint64_t key;
+    struct subtree sub;
+    size_t count;       // number of live items in the subtree
+};
+
+static int part_ref_compare(const void *a, const void *b) {
+    const struct part_ref *ra = (const struct part_ref *)a;
+    const struct part_ref *rb = (const struct part_ref *)b;
+    return ra->key < rb->key ? -1 : ra->key > rb->key;
 }
 
-size_t rtree_count(const struct rtree *tr) {
-    return tr->count;
+// node_live returns the number of live items below the node.
+static size_t node_live(const struct node *node) {
+    if (node->kind == LEAF) {
+        return (size_t)node->count-node->dead;
+    }
+    size_t count = 0;
+    for (int i = 0; i < node->count; i++) {
+        count += node_live(node->children[i]);
+    }
+    return count;
 }
 
-static bool node_delete(struct rtree *tr, struct rect *nr, struct node *node, 
-    struct rect *ir, struct item item, bool *removed, bool *shrunk,
-    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
-    void *udata)
+// subtrees_pack puts n subtrees of the same height under new branches, one
+// level at a time, until a single root is left, which is returned. It takes
+// over the references to the subtrees, and releases them when out of 
+// memory, returning NULL.
+static struct node *subtrees_pack(struct rtree *tr, struct subtree *subs, 
+    size_t n, struct rect *rect, size_t *height)
 {
-    *removed = false;
-    *shrunk = false;
-    if (node->kind == LEAF) {
-        for (int i = 0; i < node->count; i++) {
-            if (!rect_contains(ir, &node->rects[i])) {
-                continue;
+    while (n > 1) {
+        size_t groups = (n+MAX_ENTRIES-1)/MAX_ENTRIES;
+        size_t start = 0;
+        for (size_t g = 0; g < groups; g++) {
+            size_t end = n*(g+1)/groups;
+            struct node *node = node_new(tr, BRANCH);
+            if (!node) {
+                for (size_t k = 0; k < g; k++) {
+                    node_free(tr, subs[k].node);
+                }
+                for (size_t k = start; k < n; k++) {
+                    node_free(tr, subs[k].node);
+                }
+                return NULL;
             }
-            int cmp;
-            if (compare) {
-                cmp = compare(node->items[i].data, item.data, udata);
-            } else {
-                cmp = memcmp(&node->items[i].data, &item.data, sizeof(DATATYPE));
+            size_t h = subs[start].height;
+            for (size_t k = start; k < end; k++) {
+                node->rects[node->count] = subs[k].rect;
+                node->children[node->count] = subs[k].node;
+                node->dead += subs[k].node->dead;
+                node->count++;
             }
-            if (cmp != 0) {
-                continue;
+            node_sort(node);
+            subs[g].node = node;
+            subs[g].rect = node_rect_calc(node);
+            subs[g].height = h+1;
+            start = end;
+        }
+        n = groups;
+    }
+    *rect = subs[0].rect;
+    *height = subs[0].height;
+    return subs[0].node;
+}
+
+// part_refs returns the subtrees at the first level from the top that has
+// at least the given number of them, or the leaves, in Hilbert order and 
+// with their counts. Returns NULL if out of memory.
+static struct part_ref *part_refs(struct rtree *tr, size_t want, size_t *n) {
+    struct part_ref *refs = (struct part_ref *)tr->malloc(
+        sizeof(struct part_ref));
+    if (!refs) {
+        return NULL;
+    }
+    refs[0].sub.node = tr->root;
+    refs[0].sub.rect = tr->rect;
+    refs[0].sub.height = tr->height;
+    *n = 1;
+    while (*n < want && refs[0].sub.height > 1) {
+        size_t m = 0;
+        for (size_t i = 0; i < *n; i++) {
+            m += (size_t)refs[i].sub.node->count;
+        }
+        struct part_ref *next = (struct part_ref *)tr->malloc(
+            sizeof(struct part_ref)*m);
+        if (!next) {
+            tr->free(refs);
+            return NULL;
+        }
+        m = 0;
+        for (size_t i = 0; i < *n; i++) {
+            struct node *node = refs[i].sub.node;
+            for (int j = 0; j < node->count; j++) {
+                next[m].sub.node = node->children[j];
+                next[m].sub.rect = node->rects[j];
+                next[m].sub.height = refs[i].sub.height-1;
+                m++;
             }
-            // Found the target item to delete.
-            if (tr->item_free) {
-                tr->item_free(node->items[i].data, tr->udata);
+        }
+        tr->free(refs);
+        refs = next;
+        *n = m;
+    }
+    for (size_t i = 0; i < *n; i++) {
+        refs[i].key = hilbert_key(&refs[i].sub.rect, &tr->rect);
+        refs[i].count = node_live(refs[i].sub.node);
+    }
+    qsort(refs, *n, sizeof(struct part_ref), part_ref_compare);
+    return refs;
+}
+
+bool rtree_partition(struct rtree *tr, int k, struct rtree **trs) {
+    if (k <= 0 || !rtree_flush(tr)) {
+        return false;
+    }
+    size_t n = 0;
+    struct part_ref *refs = NULL;
+    struct subtree *subs = NULL;
+    if (tr->root) {
+        refs = part_refs(tr, (size_t)k*16, &n);
+        subs = refs ? (struct subtree *)tr->malloc(sizeof(struct subtree)*n) :
+            NULL;
+        if (!subs) {
+            if (refs) {
+                tr->free(refs);
             }
-            memmove(&node->rects[i], &node->rects[i+1], 
-                (node->count-(i+1))*sizeof(struct rect));
-            memmove(&node->items[i], &node->items[i+1], 
-                (node->count-(i+1))*sizeof(struct item));
-            node->count--;
-            if (rect_onedge(ir, nr)) {
-                // The item rect was on the edge of the node rect.
-                // We need to recalculate the node rect.
-                *nr = node_rect_calc(node);
-                // Notify the caller that we shrunk the rect.
-                *shrunk = true; 
+            return false;
+        }
+    }
+    bool ok = true;
+    int made = 0;
+    for (; made < k; made++) {
+        struct rtree *part = (struct rtree *)tr->malloc(sizeof(struct rtree));
+        if (!part) {
+            ok = false;
+            break;
+        }
+        memcpy(part, tr, sizeof(struct rtree));
+        memset(&part->rect, 0, sizeof(struct rect));
+        part->root = NULL;
+        part->count = 0;
+        part->height = 0;
+        part->item_id = NULL;
+        part->ids = NULL;
+        part->bufs = NULL;
+        part->brects = NULL;
+        part->nbufs = 0;
+        part->maxbufs = 0;
+        part->bcount = 0;
+        part->journal = NULL;
+        if (part->trace) {
+            atomic_fetch_add(&part->trace->rc, 1);
+        }
+        trs[made] = part;
+    }
+    // Cut the subtrees into runs, where a subtree goes to the part that 
+    // holds the middle of its items.
+    size_t i = 0;
+    size_t sum = 0;
+    for (int p = 0; ok && p < k; p++) {
+        struct rtree *part = trs[p];
+        size_t target = tr->count*(size_t)(p+1)/(size_t)k;
+        size_t start = i;
+        while (i < n && (p == k-1 || sum+refs[i].count/2 < target)) {
+            subs[i-start] = refs[i].sub;
+            atomic_fetch_add(&refs[i].sub.node->rc, 1);
+            part->count += refs[i].count;
+            sum += refs[i].count;
+            i++;
+        }
+        if (i > start) {
+            part->root = subtrees_pack(tr, subs, i-start, &part->rect, 
+                &part->height);
+            if (!part->root) {
+                part->count = 0;
+                ok = false;
+                break;
             }
-            *removed = true;
-            return true;
         }
-        return true;
+        if (tr->item_id) {
+            ok = rtree_set_item_id(part, tr->item_id);
+        }
     }
-    for (int i = 0; i < node->count; i++) {
-        if (!rect_contains(&node->rects[i], ir)) {
-            continue;
+    if (!ok) {
+        for (int p = 0; p < made; p++) {
+            rtree_free(trs[p]);
+            trs[p] = NULL;
         }
-        struct rect crect = node->rects[i];
-        cow_node_or(node->children[i], return false);
-        if (!node_delete(tr, &node->rects[i], node->children[i], ir, item, 
-            removed, shrunk, compare, udata))
+    }
+    if (refs) {
+        tr->free(refs);
+        tr->free(subs);
+    }
+    return ok;
+}
+
+static char *journal_path_dup(struct rtree *tr, const char *path, 
+    const char *suffix)
+{
+    size_t n = strlen(path);
+    size_t m = strlen(suffix);
+    char *str = (char *)tr->malloc(n+m+1);
+    if (!str) return NULL;
+    memcpy(str, path, n);
+    memcpy(str+n, suffix, m+1);
+    return str;
+}
+
+// journal_dir_dup returns the directory part of a path, or "." if it has
+// none.
+static char *journal_dir_dup(struct rtree *tr, const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        return journal_path_dup(tr, ".", "");
+    }
+    size_t n = slash == path ? 1 : (size_t)(slash-path);
+    char *str = (char *)tr->malloc(n+1);
+    if (!str) return NULL;
+    memcpy(str, path, n);
+    str[n] = '\0';
+    return str;
+}
+
+static void journal_free(struct rtree *tr, struct journal *j) {
+    if (j->file) fclose(j->file);
+    if (j->path) tr->free(j->path);
+    if (j->snap_path) tr->free(j->snap_path);
+    if (j->tmp_path) tr->free(j->tmp_path);
+    if (j->dir_path) tr->free(j->dir_path);
+    if (j->buf) tr->free(j->buf);
+    tr->free(j);
+}
+
+// journal_load_snapshot inserts all items from the snapshot file, if any.
+static bool journal_load_snapshot(struct rtree *tr, struct journal *j) {
+    FILE *file = fopen(j->snap_path, "rb");
+    if (!file) {
+        return errno == ENOENT;
+    }
+    struct journal_header hdr;
+    if (fread(&hdr, sizeof(struct journal_header), 1, file) != 1 ||
+        !journal_header_valid(&hdr, "RTS1", 
+            sizeof(struct rect)+sizeof(DATATYPE)))
+    {
+        fclose(file);
+        return false;
+    }
+    for (uint64_t i = 0; i < hdr.count; i++) {
+        struct rect rect;
+        DATATYPE data;
+        if (fread(&rect, sizeof(struct rect), 1, file) != 1 ||
+            fread(&data, sizeof(DATATYPE), 1, file) != 1 ||
+            !rtree_insert(tr, rect.min, rect.max, data))
         {
+            fclose(file);
             return false;
         }
-        if (!*removed) {
-            continue;
-        }
-        if (node->children[i]->count == 0) {
-            // underflow
-            node_free(tr, node->children[i]);
-            memmove(&node->rects[i], &node->rects[i+1], 
-                (node->count-(i+1))*sizeof(struct rect));
-            memmove(&node->children[i], &node->children[i+1], 
-                (node->count-(i+1))*sizeof(struct node *));
-            node->count--;
-            *nr = node_rect_calc(node);
-            *shrunk = true;
-            return true;
-        }
-        if (*shrunk) {
-            *shrunk = !rect_equals(&node->rects[i], &crect);
-            if (*shrunk) {
-                *nr = node_rect_calc(node);
+    }
+    fclose(file);
+    j->gen = hdr.gen;
+    return true;
+}
+
+// journal_replay applies the records in the journal file that belong to the
+// loaded snapshot, drops any torn tail, and leaves the file open for appending.
+static bool journal_replay(struct rtree *tr, struct journal *j) {
+    long end = 0;
+    FILE *file = fopen(j->path, "r+b");
+    if (!file) {
+        if (errno != ENOENT) return false;
+        file = fopen(j->path, "w+b");
+        if (!file) return false;
+    }
+    struct journal_header hdr;
+    if (fread(&hdr, sizeof(struct journal_header), 1, file) == 1 &&
+        journal_header_valid(&hdr, "RTJ1", JOURNAL_RECSIZE) && 
+        hdr.gen == j->gen)
+    {
+        end = sizeof(struct journal_header);
+        unsigned char rec[JOURNAL_RECSIZE];
+        while (fread(rec, JOURNAL_RECSIZE, 1, file) == 1) {
+            int op;
+            struct rect rect;
+            DATATYPE data;
+            if (!journal_decode(rec, &op, &rect, &data) ||
+                (op != JOURNAL_INSERT && op != JOURNAL_DELETE))
+            {
+                break;
             }
-            node_order_to_right(node, i);
+            bool ok;
+            if (op == JOURNAL_INSERT) {
+                ok = rtree_insert(tr, rect.min, rect.max, data);
+            } else {
+                ok = rtree_delete(tr, rect.min, rect.max, data);
+            }
+            if (!ok) {
+                fclose(file);
+                return false;
+            }
+            end += (long)JOURNAL_RECSIZE;
         }
-        return true;
     }
-    return true;
+    j->file = file;
+    if (end == 0) {
+        // A missing or stale journal starts over with a new header.
+        return journal_reset(j);
+    }
+    // Drop the torn tail, if any, and continue appending after the last
+    // good record.
+    j->end = end;
+    return fflush(file) == 0 && ftruncate(fileno(file), end) == 0 &&
+        file_sync(file);
 }
 
-// returns false if out of memory
-static bool rtree_delete0(struct rtree *tr, const NUMTYPE *min, 
-    const NUMTYPE *max, const DATATYPE data,
-    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
-    void *udata)
+static void rtree_clear(struct rtree *tr) {
+    if (tr->root) {
+        node_free(tr, tr->root);
+    }
+    tr->root = NULL;
+    tr->count = 0;
+    tr->height = 0;
+    for (int b = 0; b < tr->nbufs; b++) {
+        node_free(tr, tr->bufs[b]);
+    }
+    tr->nbufs = 0;
+    tr->bcount = 0;
+    idmap_release(tr, tr->ids);
+    tr->ids = NULL;
+    memset(&tr->rect, 0, sizeof(struct rect));
+}
+
+bool rtree_journal_open(struct rtree *tr, const char *snap_path, 
+    const char *path, int group)
 {
-    struct rect rect;
-    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
-    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
-    struct item item;
-    memcpy(&item.data, &data, sizeof(DATATYPE));
-    if (!tr->root) {
+    if (tr->journal || tr->isize || tr->count+tr->bcount != 0) {
+        return false;
+    }
+    struct journal *j = (struct journal *)tr->malloc(sizeof(struct journal));
+    if (!j) return false;
+    memset(j, 0, sizeof(struct journal));
+    j->group = group < 1 ? 1 : group;
+    j->path = journal_path_dup(tr, path, "");
+    j->snap_path = journal_path_dup(tr, snap_path, "");
+    j->tmp_path = journal_path_dup(tr, snap_path, ".tmp");
+    j->dir_path = journal_dir_dup(tr, snap_path);
+    j->buf = (unsigned char *)tr->malloc((size_t)(j->group+1)*JOURNAL_RECSIZE);
+    if (!j->path || !j->snap_path || !j->tmp_path || !j->dir_path || 
+        !j->buf || !journal_load_snapshot(tr, j) || !journal_replay(tr, j))
+    {
+        journal_free(tr, j);
+        rtree_clear(tr);
+        return false;
+    }
+    tr->journal = j;
+    return true;
+}
+
+bool rtree_journal_sync(struct rtree *tr) {
+    if (!tr->journal) {
         return true;
     }
-    bool removed = false;
-    bool shrunk = false;
-    cow_node_or(tr->root, return false);
-    if (!node_delete(tr, &tr->rect, tr->root, &rect, item, &removed, &shrunk, 
-        compare, udata))
+    return journal_commit(tr->journal);
+}
+
+bool rtree_journal_close(struct rtree *tr) {
+    if (!tr->journal) {
+        return true;
+    }
+    bool ok = journal_commit(tr->journal);
+    journal_free(tr, tr->journal);
+    tr->journal = NULL;
+    return ok;
+}
+
+static bool snapshot_iter(const NUMTYPE *min, const NUMTYPE *max, 
+    const DATATYPE data, void *udata)
+{
+    FILE *file = (FILE *)udata;
+    return fwrite(min, sizeof(NUMTYPE)*DIMS, 1, file) == 1 &&
+        fwrite(max, sizeof(NUMTYPE)*DIMS, 1, file) == 1 &&
+        fwrite(&data, sizeof(DATATYPE), 1, file) == 1;
+}
+
+bool rtree_journal_checkpoint(struct rtree *tr) {
+    struct journal *j = tr->journal;
+    if (!j || !journal_commit(j)) {
+        return false;
+    }
+    // Write the new snapshot to a temporary file and atomically move it into
+    // place. The snapshot has the next generation, which makes the current
+    // journal stale even if we crash before it's reset below.
+    FILE *file = fopen(j->tmp_path, "wb");
+    if (!file) {
+        return false;
+    }
+    struct journal_header hdr;
+    journal_header_init(&hdr, "RTS1", sizeof(struct rect)+sizeof(DATATYPE), 
+        j->gen+1, tr->count+tr->bcount);
+    bool ok = fwrite(&hdr, sizeof(struct journal_header), 1, file) == 1;
+    if (ok && tr->root) {
+        ok = node_scan(tr->root, snapshot_iter, file);
+    }
+    for (int b = 0; ok && b < tr->nbufs; b++) {
+        ok = node_scan(tr->bufs[b], snapshot_iter, file);
+    }
+    ok = ok && file_sync(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(j->tmp_path, j->snap_path) != 0) {
+        remove(j->tmp_path);
+        return false;
+    }
+    // The new snapshot is in place, so the journal belongs to the next 
+    // generation even if the rest fails. The rename must reach the disk 
+    // before the journal is cut, or a crash could keep the cut and lose the
+    // rename, and every op since the last checkpoint with it.
+    j->gen++;
+    j->reset = true;
+    return dir_sync(j->dir_path) && journal_reset(j);
+}
+
+bool rtree_trace_start(struct rtree *tr, const char *path) {
+    if (tr->trace) {
+        return false;
+    }
+    struct trace *t = (struct trace *)tr->malloc(sizeof(struct trace));
+    if (!t) return false;
+    memset(t, 0, sizeof(struct trace));
+    atomic_flag_clear(&t->lock);
+    t->file = fopen(path, "wb");
+    struct journal_header hdr;
+    journal_header_init(&hdr, "RTT1", JOURNAL_RECSIZE, 0, 0);
+    if (!t->file ||
+        fwrite(&hdr, sizeof(struct journal_header), 1, t->file) != 1)
     {
+        if (t->file) fclose(t->file);
+        tr->free(t);
         return false;
     }
-    if (!removed) {
+    tr->trace = t;
+    return true;
+}
+
+bool rtree_trace_stop(struct rtree *tr) {
+    if (!tr->trace) {
         return true;
     }
-    tr->count--;
-    if (tr->count == 0) {
-        node_free(tr, tr->root);
-        tr->root = NULL;
-        memset(&tr->rect, 0, sizeof(struct rect));
-        tr->height = 0;
-    } else {
-        while (tr->root->kind == BRANCH && tr->root->count == 1) {
-            struct node *prev = tr->root;
-            tr->root = tr->root->children[0];
-            prev->count = 0;
-            node_free(tr, prev);
-            tr->height--;
-        }
-        if (shrunk) {
-            tr->rect = node_rect_calc(tr->root);
+    bool ok = trace_release(tr, tr->trace);
+    tr->trace = NULL;
+    return ok;
+}
+
+bool rtree_trace_read(const char *path,
+    bool (*iter)(int op, const NUMTYPE *min, const NUMTYPE *max, 
+        const DATATYPE data, void *udata),
+    void *udata)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    struct journal_header hdr;
+    bool ok = fread(&hdr, sizeof(struct journal_header), 1, file) == 1 &&
+        journal_header_valid(&hdr, "RTT1", JOURNAL_RECSIZE);
+    unsigned char rec[JOURNAL_RECSIZE];
+    while (ok && fread(rec, JOURNAL_RECSIZE, 1, file) == 1) {
+        int op;
+        struct rect rect;
+        DATATYPE data;
+        if (!journal_decode(rec, &op, &rect, &data)) {
+            ok = false;
+        } else if (!iter(op, rect.min, rect.max, data, udata)) {
+            break;
         }
     }
-    return true;
+    fclose(file);
+    return ok;
 }
 
-bool rtree_delete(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, 
-    const DATATYPE data)
+static double rect_overlap_area(const struct rect *rect, 
+    const struct rect *other)
 {
-    return rtree_delete0(tr, min, max, data, NULL, NULL);
+    double area = 1;
+    for (int i = 0; i < DIMS; i++) {
+        double min = (double)MAX(rect->min[i], other->min[i]);
+        double max = (double)MIN(rect->max[i], other->max[i]);
+        if (max < min) {
+            return 0;
+        }
+        area *= max - min;
+    }
+    return area;
 }
 
-bool rtree_delete_with_comparator(struct rtree *tr, const NUMTYPE *min, 
-    const NUMTYPE *max, const DATATYPE data,
-    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
-    void *udata)
+static void node_stats(const struct node *node, const struct rect *nr, 
+    int level, bool shared, struct rtree_stats *stats)
 {
-    return rtree_delete0(tr, min, max, data, compare, udata);
+    shared = shared || atomic_load(&node->rc) > 0;
+    stats->nodes++;
+    size_t size = node_size(node->kind, node->isize);
+    stats->bytes += size;
+    if (shared) {
+        stats->shared_bytes += size;
+    }
+    stats->fill[MIN(node->count*10/MAX_ENTRIES, 9)]++;
+    if (level < RTREE_MAX_LEVELS) {
+        struct rtree_level_stats *ls = &stats->levels[level];
+        double area = 0;
+        double overlap = 0;
+        for (int i = 0; i < node->count; i++) {
+            area += rect_area(&node->rects[i]);
+            for (int j = i+1; j < node->count; j++) {
+                // The rects are ordered by min[0], so none that follow can 
+                // overlap once this one is passed.
+                if (node->rects[j].min[0] > node->rects[i].max[0]) {
+                    break;
+                }
+                overlap += rect_overlap_area(&node->rects[i], 
+                    &node->rects[j]);
+            }
+        }
+        ls->nodes++;
+        ls->entries += node->count;
+        ls->overlap += overlap;
+        ls->dead_space += MAX(rect_area(nr) - area + overlap, 0);
+    }
+    if (node->kind == BRANCH) {
+        for (int i = 0; i < node->count; i++) {
+            node_stats(node->children[i], &node->rects[i], level+1, shared, 
+                stats);
+        }
+    }
+}
+
+void rtree_stats(const struct rtree *tr, struct rtree_stats *stats) {
+    memset(stats, 0, sizeof(struct rtree_stats));
+    stats->count = tr->count+tr->bcount;
+    stats->dead = tr->root ? tr->root->dead : 0;
+    stats->height = tr->height;
+    stats->bytes = sizeof(struct rtree) + 
+        (sizeof(struct rect)+sizeof(struct node *))*(size_t)tr->maxbufs;
+    for (int b = 0; b < tr->nbufs; b++) {
+        stats->dead += tr->bufs[b]->dead;
+        stats->bytes += node_size(LEAF, tr->isize);
+    }
+    if (tr->ids) {
+        stats->bytes += sizeof(struct idmap) + 
+            tr->ids->cap*sizeof(struct identry);
+    }
+    if (tr->root) {
+        node_stats(tr->root, &tr->rect, 0, false, stats);
+    }
 }
 
 struct rtree *rtree_clone(struct rtree *tr) {
@@ -842,10 +4845,37 @@ struct rtree *rtree_clone(struct rtree *tr) {
     struct rtree *tr2 = tr->malloc(sizeof(struct rtree));
     if (!tr2) return NULL;
     memcpy(tr2, tr, sizeof(struct rtree));
+    if (tr->maxbufs) {
+        size_t size = (sizeof(struct rect)+sizeof(struct node *))*
+            (size_t)tr->maxbufs;
+        char *mem = (char *)tr->malloc(size);
+        if (!mem) {
+            tr->free(tr2);
+            return NULL;
+        }
+        memcpy(mem, tr->brects, size);
+        tr2->brects = (struct rect *)mem;
+        tr2->bufs = (struct node **)(tr2->brects+tr->maxbufs);
+        for (int b = 0; b < tr2->nbufs; b++) {
+            atomic_fetch_add(&tr2->bufs[b]->rc, 1);
+        }
+    }
+    tr2->journal = NULL;
+    if (tr2->trace) atomic_fetch_add(&tr2->trace->rc, 1);
     if (tr2->root) atomic_fetch_add(&tr2->root->rc, 1);
+    if (tr2->ids) atomic_fetch_add(&tr2->ids->rc, 1);
     return tr2;
 } 
 
 #ifdef TEST_PRIVATE_FUNCTIONS
 #include "tests/priv_funcs.h"
 #endif
+
+// Release the prefixed names, which only lets rtree.h be included again, 
+// for another prefix. The types, static helpers, and settings such as DIMS
+// stay defined, so each prefix of rtree.c needs its own translation unit.
+#ifdef RTREE_PREFIX
+#undef RTREE_IMPL
+#define RTREE_RELEASE
+#include "rtree.h"
+#endif
@@ -2,12 +2,137 @@
 // Use of this source code is governed by an MIT-style
 // license that can be found in the LICENSE file.
 
-#ifndef RTREE_H
+#if !defined(RTREE_H) || defined(RTREE_PREFIX)
+#ifndef RTREE_PREFIX
 #define RTREE_H
+#endif
+
+// rtree.c includes this file again with RTREE_RELEASE defined to only 
+// release the settings.
+#ifndef RTREE_RELEASE
 
 #include <alloca.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+// RTREE_NUMTYPE is the coordinate type. It must match the NUMTYPE that 
+// rtree.c was compiled with.
+//
+// Defining RTREE_INT32 or RTREE_UINT32 selects 32-bit integer coordinates, 
+// such as tile or grid coordinates. These use exact integer math for the 
+// areas of rects, and SSE2 compares of whole rects in two dimensions.
+#if defined(RTREE_INT32)
+#define RTREE_NUMTYPE int32_t
+#elif defined(RTREE_UINT32)
+#define RTREE_NUMTYPE uint32_t
+#elif !defined(RTREE_NUMTYPE)
+#define RTREE_NUMTYPE double
+#endif
+
+// Defining RTREE_PREFIX before including this file, and before compiling 
+// rtree.c, adds the prefix to every rtree function and struct, such as 
+// struct rtree and struct rtree_stats, so that rtrees with different settings
+// can live in the same program. 
+// For example, with RTREE_PREFIX set to geo2d_ the functions become 
+// geo2d_rtree_new, geo2d_rtree_insert, and so on.
+//
+// RTREE_PREFIX and the coordinate type are undefined at the end of this file,
+// which may then be included again with other settings.
+#ifdef RTREE_PREFIX
+#define RTREE_CONCAT0(a, b) a##b
+#define RTREE_CONCAT(a, b) RTREE_CONCAT0(a, b)
+#define RTREE_NAME(name) RTREE_CONCAT(RTREE_PREFIX, name)
+#define rtree                        RTREE_NAME(rtree)
+#define rtree_nearest                RTREE_NAME(rtree_nearest)
+#define rtree_new                    RTREE_NAME(rtree_new)
+#define rtree_new_with_allocator     RTREE_NAME(rtree_new_with_allocator)
+#define rtree_new_with_item_size     RTREE_NAME(rtree_new_with_item_size)
+#define rtree_free                   RTREE_NAME(rtree_free)
+#define rtree_clone                  RTREE_NAME(rtree_clone)
+#define rtree_set_item_callbacks     RTREE_NAME(rtree_set_item_callbacks)
+#define rtree_set_udata              RTREE_NAME(rtree_set_udata)
+#define rtree_insert                 RTREE_NAME(rtree_insert)
+#define rtree_insert_many            RTREE_NAME(rtree_insert_many)
+#define rtree_merge                  RTREE_NAME(rtree_merge)
+#define rtree_partition              RTREE_NAME(rtree_partition)
+#define rtree_search                 RTREE_NAME(rtree_search)
+#define rtree_search_parallel        RTREE_NAME(rtree_search_parallel)
+#define rtree_search_contained       RTREE_NAME(rtree_search_contained)
+#define rtree_search_containing      RTREE_NAME(rtree_search_containing)
+#define rtree_search_custom          RTREE_NAME(rtree_search_custom)
+#define rtree_search_radius          RTREE_NAME(rtree_search_radius)
+#define rtree_raycast                RTREE_NAME(rtree_raycast)
+#define rtree_nearest_new            RTREE_NAME(rtree_nearest_new)
+#define rtree_nearest_next           RTREE_NAME(rtree_nearest_next)
+#define rtree_nearest_done           RTREE_NAME(rtree_nearest_done)
+#define rtree_nearest_free           RTREE_NAME(rtree_nearest_free)
+#define rtree_search_collect         RTREE_NAME(rtree_search_collect)
+#define rtree_search_many            RTREE_NAME(rtree_search_many)
+#define rtree_search_pipelined       RTREE_NAME(rtree_search_pipelined)
+#define rtree_scan                   RTREE_NAME(rtree_scan)
+#define rtree_join                   RTREE_NAME(rtree_join)
+#define rtree_self_join              RTREE_NAME(rtree_self_join)
+#define rtree_join_parallel          RTREE_NAME(rtree_join_parallel)
+#define rtree_count                  RTREE_NAME(rtree_count)
+#define rtree_delete                 RTREE_NAME(rtree_delete)
+#define rtree_delete_with_comparator RTREE_NAME(rtree_delete_with_comparator)
+#define rtree_set_item_id            RTREE_NAME(rtree_set_item_id)
+#define rtree_delete_id              RTREE_NAME(rtree_delete_id)
+#define rtree_update_id              RTREE_NAME(rtree_update_id)
+#define rtree_set_lazy_delete        RTREE_NAME(rtree_set_lazy_delete)
+#define rtree_compact                RTREE_NAME(rtree_compact)
+#define rtree_set_write_buffer       RTREE_NAME(rtree_set_write_buffer)
+#define rtree_flush                  RTREE_NAME(rtree_flush)
+#define rtree_level_stats            RTREE_NAME(rtree_level_stats)
+#define rtree_stats                  RTREE_NAME(rtree_stats)
+#define rtree_query_stats            RTREE_NAME(rtree_query_stats)
+#define rtree_journal_open           RTREE_NAME(rtree_journal_open)
+#define rtree_journal_sync           RTREE_NAME(rtree_journal_sync)
+#define rtree_journal_checkpoint     RTREE_NAME(rtree_journal_checkpoint)
+#define rtree_journal_close          RTREE_NAME(rtree_journal_close)
+#define rtree_trace_start            RTREE_NAME(rtree_trace_start)
+#define rtree_trace_stop             RTREE_NAME(rtree_trace_stop)
+#define rtree_trace_read             RTREE_NAME(rtree_trace_read)
+#define rtree_check                  RTREE_NAME(rtree_check)
+#define rtree_write_svg              RTREE_NAME(rtree_write_svg)
+#endif
+
+// The types below don't depend on the settings and are shared by all
+// prefixes.
+#ifndef RTREE_TYPES_H
+#define RTREE_TYPES_H
+
+// RTREE_MAX_LEVELS is the maximum height of an rtree, which is far more than
+// the memory of any machine can hold.
+#define RTREE_MAX_LEVELS 32
+
+// RTREE_MAX_ITEM_SIZE is the largest item size of rtree_new_with_item_size.
+#define RTREE_MAX_ITEM_SIZE 256
+
+// The relation of a rect to the region of a custom search.
+enum rtree_relation {
+    RTREE_DISJOINT,     // the rect is entirely outside
+    RTREE_INTERSECTS,   // the rect is partly inside
+    RTREE_INSIDE,       // the rect is entirely inside
+};
+
+// rtree_cursor is the position of a search that is collected in parts. It
+// must be zeroed before the first call.
+struct rtree_cursor {
+    int root;       // the main tree, or a leaf of the write buffer after it
+    int depth;
+    int idxs[RTREE_MAX_LEVELS];
+    bool done;      // the search is finished
+};
+
+enum rtree_trace_op {
+    RTREE_TRACE_INSERT = '+',
+    RTREE_TRACE_DELETE = '-',
+    RTREE_TRACE_SEARCH = '?',
+};
+
+#endif // RTREE_TYPES_H
 
 // rtree_new returns a new rtree
 //
@@ -20,6 +145,20 @@ struct rtree *rtree_new(void);
 // Returns NULL if the system is out of memory.
 struct rtree *rtree_new_with_allocator(void *(*malloc)(size_t), void (*free)(void*));
 
+// rtree_new_with_item_size returns a new rtree that stores items of a fixed
+// size, up to RTREE_MAX_ITEM_SIZE bytes, inline in its leaves. The allocator
+// is optional, as in rtree_new_with_allocator.
+//
+// The data passed to rtree_insert and rtree_delete points to the bytes of an
+// item, which are copied into the leaf or compared with memcmp. The data
+// passed to iters points to the item inside the leaf, and is only valid
+// until the rtree is changed. Leaves are copied with memcpy by 
+// copy-on-write, so no item callbacks are needed.
+//
+// Returns NULL if the system is out of memory or the size is out of range.
+struct rtree *rtree_new_with_item_size(size_t item_size, 
+    void *(*malloc)(size_t), void (*free)(void*));
+
 // rtree_free frees an rtree
 void rtree_free(struct rtree *tr);
 
@@ -36,6 +175,8 @@ struct rtree *rtree_clone(struct rtree *tr);
 //
 // The clone function should return true if the clone succeeded or false if the
 // system is out of memory.
+//
+// Not used by rtrees with inline items.
 void rtree_set_item_callbacks(struct rtree *tr,
     bool (*clone)(const void *item, void **into, void *udata), 
     void (*free)(const void *item, void *udata));
@@ -56,25 +197,267 @@ void rtree_set_udata(struct rtree *tr, void *udata);
 //
 // When inserting points, the max coordinates is optional (set to NULL).
 //
-// Returns false if the system is out of memory.
-bool rtree_insert(struct rtree *tr, const double *min, const double *max, const void *data);
+// Returns false if the system is out of memory, or if the rtree has a journal
+// and its pending records could not be written.
+bool rtree_insert(struct rtree *tr, const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data);
+
+// rtree_insert_many inserts a batch of n items. The mins and maxs arrays 
+// hold the min and max coordinates of each item back to back, and maxs is 
+// optional for points. The batch is sorted along a Hilbert curve and pushed
+// down the tree in runs of neighboring items, which share their descent. 
+// The batch goes straight into the tree, past any write buffer.
+//
+// Returns false if the system is out of memory, or if the rtree has a 
+// journal and the records could not be written. The rtree holds the same
+// items as before when it returns false.
+bool rtree_insert_many(struct rtree *tr, const RTREE_NUMTYPE *mins, 
+    const RTREE_NUMTYPE *maxs, const void *const *datas, size_t n);
+
+// rtree_merge adds all items of src to the rtree. Whole subtrees of src are
+// grafted in at their own height wherever they don't overlap their new 
+// siblings, sharing their nodes with src the way a clone does, and the 
+// rest of the items are inserted as a batch. The src rtree is unchanged and
+// may still be used or freed. Both rtrees must hold the same kind of items,
+// with the same item size and callbacks.
+//
+// Returns false if the system is out of memory, or if the rtree has a 
+// journal and the records could not be written. The rtree is unchanged when
+// it returns false.
+bool rtree_merge(struct rtree *tr, const struct rtree *src);
+
+// rtree_partition splits the items of the rtree into k new rtrees, which 
+// are written to trs. Each part covers a compact region and holds about the
+// same number of items, down to whole leaves, so an rtree with fewer leaves
+// than parts leaves some parts empty. The parts are made from the subtrees
+// a few levels below the root, which they share with the rtree the way a 
+// clone does, rather than from copies of the items. The write buffer is 
+// flushed first. The parts have no write buffer or journal, and each must be
+// freed with rtree_free.
+//
+// The k must be positive. Returns false if it's not, or if the system is out
+// of memory, in which case no parts are made.
+bool rtree_partition(struct rtree *tr, int k, struct rtree **trs);
 
 
 // rtree_search searches the rtree and iterates over each item that intersect
 // the provided rectangle.
 //
 // Returning false from the iter will stop the search.
-void rtree_search(const struct rtree *tr, const double *min, const double *max,
-    bool (*iter)(const double *min, const double *max, const void *data, void *udata), 
+void rtree_search(const struct rtree *tr, const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max,
+    bool (*iter)(const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data, void *udata), 
+    void *udata);
+
+// rtree_search_parallel searches the rtree over nthreads threads, which 
+// pays off for searches that return a large part of a large rtree. Zero 
+// threads uses one per CPU.
+//
+// The search is split into tasks by the subtrees that intersect the 
+// rectangle, which the threads take from each other as they run out of 
+// work. The iter is called from all threads at once, each thread passing its
+// own element of the udatas array, which must hold nthreads elements, or be 
+// NULL. Items are not visited in any particular order.
+//
+// Returning false from the iter will stop the search, after the other 
+// threads finish their current task. The rtree must not be changed until 
+// this returns, and a clone can be used to search an rtree that is being
+// changed.
+//
+// Returns false if the system is out of memory or the threads could not be
+// started, in which case no items were visited.
+bool rtree_search_parallel(const struct rtree *tr, const RTREE_NUMTYPE *min, 
+    const RTREE_NUMTYPE *max, int nthreads,
+    bool (*iter)(const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data, void *udata), 
+    void **udatas);
+
+// rtree_search_contained searches the rtree and iterates over each item that
+// is fully contained in the provided rectangle.
+//
+// Returning false from the iter will stop the search.
+void rtree_search_contained(const struct rtree *tr, const RTREE_NUMTYPE *min, 
+    const RTREE_NUMTYPE *max,
+    bool (*iter)(const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data, void *udata), 
+    void *udata);
+
+// rtree_search_containing searches the rtree and iterates over each item that
+// fully contains the provided rectangle, or point when max is NULL.
+//
+// Returning false from the iter will stop the search.
+void rtree_search_containing(const struct rtree *tr, const RTREE_NUMTYPE *min, 
+    const RTREE_NUMTYPE *max,
+    bool (*iter)(const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data, void *udata), 
+    void *udata);
+
+// rtree_search_custom searches the rtree for the items in a region of any 
+// shape, such as a polygon, that is described by two callbacks.
+//
+// The relate callback returns the rtree_relation of a rect to the region. It
+// is called for the rects of nodes, and the whole subtree of a node that is
+// RTREE_INSIDE is iterated over without further tests. 
+//
+// The match callback returns true for items that are in the region. When it
+// is NULL, an item matches when relate does not return RTREE_DISJOINT for
+// its rect.
+//
+// Returning false from the iter will stop the search.
+void rtree_search_custom(const struct rtree *tr, 
+    int (*relate)(const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, void *udata),
+    bool (*match)(const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data,
+        void *udata),
+    bool (*iter)(const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data, void *udata), 
+    void *udata);
+
+// rtree_search_radius searches the rtree and iterates over each item within
+// the radius of the center point. That is, items whose rect has a point at 
+// a distance of at most radius from the center.
+//
+// Returning false from the iter will stop the search.
+void rtree_search_radius(const struct rtree *tr, const RTREE_NUMTYPE *center, 
+    RTREE_NUMTYPE radius,
+    bool (*iter)(const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data, void *udata), 
+    void *udata);
+
+// rtree_raycast iterates over each item whose rect is hit by the ray from 
+// the origin point in the direction of dir, up to origin+dir*tmax, in the 
+// order the ray enters them. Use the end point minus the origin as dir and 1
+// as tmax for a line segment, or INFINITY as tmax for an unbounded ray.
+//
+// The iter is passed the position t where the ray enters the item rect, 
+// which is zero for rects around the origin. Returning false from the iter 
+// will stop the raycast, such as at the first hit.
+//
+// Returns false if the system is out of memory, which may happen after 
+// some items were visited.
+bool rtree_raycast(const struct rtree *tr, const RTREE_NUMTYPE *origin, 
+    const RTREE_NUMTYPE *dir, double tmax,
+    bool (*iter)(const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data, 
+        double t, void *udata),
+    void *udata);
+
+// rtree_nearest_new returns an iterator over the items of the rtree in order
+// of their distance from the point, nearest first, up to maxdist. Use 
+// INFINITY as maxdist for no limit. The distance to an item is to the 
+// nearest point of its rect.
+//
+// Items are found as they are asked for, so there is no fixed number of 
+// them, and a caller can keep taking items until one fits. The rtree must 
+// not be changed while the iterator is in use, and a clone can be used for 
+// an rtree that is being changed.
+//
+// Returns NULL if the system is out of memory.
+struct rtree_nearest *rtree_nearest_new(const struct rtree *tr, 
+    const RTREE_NUMTYPE *point, double maxdist);
+
+// rtree_nearest_next gets the next nearest item. Any of the outputs may be 
+// NULL. The squared distance is provided to spare a square root.
+//
+// Returns false when there are no more items, or if the system is out of 
+// memory, in which case rtree_nearest_done is false and calling it again 
+// retries.
+bool rtree_nearest_next(struct rtree_nearest *it, const RTREE_NUMTYPE **min,
+    const RTREE_NUMTYPE **max, void **data, double *dist2);
+
+// rtree_nearest_done returns true when the iterator has no more items.
+bool rtree_nearest_done(const struct rtree_nearest *it);
+
+// rtree_nearest_free frees the iterator.
+void rtree_nearest_free(struct rtree_nearest *it);
+
+// rtree_search_collect searches the rtree like rtree_search, but copies the
+// data of up to cap matching items into the items array instead of calling
+// an iter. The rects array, when not NULL, receives the min and max 
+// coordinates of each item back to back.
+//
+// Returns the number of items copied. When it returns cap, calling it again
+// with the same rectangle and cursor continues where it left off, until the
+// cursor is done. The rtree must not be changed in between, and a clone can
+// be used for collecting from an rtree that is being changed.
+size_t rtree_search_collect(const struct rtree *tr, const RTREE_NUMTYPE *min, 
+    const RTREE_NUMTYPE *max, void **items, RTREE_NUMTYPE *rects, size_t cap, 
+    struct rtree_cursor *cursor);
+
+// rtree_search_many searches the rtree for a batch of n rectangles at once,
+// walking the tree a single time for the whole batch instead of once per
+// rectangle, when the rectangles are near enough to each other to share 
+// nodes. A batch that is spread out is searched one rectangle at a time.
+// The rects array holds the min and max coordinates of each rectangle back
+// to back.
+//
+// The iter is called with the index of the matching rectangle. Items may be
+// returned in tree order, so the results of different rectangles can be
+// interleaved. Returning false from the iter stops the search for that 
+// rectangle only.
+//
+// Returns false if the system is out of memory.
+bool rtree_search_many(const struct rtree *tr, const RTREE_NUMTYPE *rects, int n,
+    bool (*iter)(int q, const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, 
+        const void *data, void *udata),
+    void *udata);
+
+// rtree_search_pipelined searches the rtree for a batch of n rectangles, in
+// the same form as rtree_search_many. It interleaves the searches, 
+// prefetching the next node of one while working on the others, which hides
+// much of the memory latency of batches of small or point searches over a
+// large rtree. It needs no memory.
+//
+// The iter is called with the index of the matching rectangle. Returning
+// false from the iter stops the search for that rectangle only.
+void rtree_search_pipelined(const struct rtree *tr, const RTREE_NUMTYPE *rects, 
+    int n,
+    bool (*iter)(int q, const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, 
+        const void *data, void *udata),
     void *udata);
 
 // rtree_scan iterates over every item in the rtree.
 //
 // Returning false from the iter will stop the scan.
 void rtree_scan(const struct rtree *tr,
-    bool (*iter)(const double *min, const double *max, const void *data, void *udata), 
+    bool (*iter)(const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data, void *udata), 
+    void *udata);
+
+// rtree_join iterates over every pair of intersecting items from two rtrees,
+// walking both trees together. The first item of each pair is from a, the 
+// second from b.
+//
+// Returning false from the iter will stop the join.
+void rtree_join(const struct rtree *a, const struct rtree *b, 
+    bool (*iter)(const RTREE_NUMTYPE *amin, const RTREE_NUMTYPE *amax, const void *adata,
+        const RTREE_NUMTYPE *bmin, const RTREE_NUMTYPE *bmax, const void *bdata, 
+        void *udata),
+    void *udata);
+
+// rtree_self_join iterates over every pair of distinct intersecting items in
+// the rtree, such as overlapping or duplicate items. Each pair is visited 
+// once.
+//
+// Returning false from the iter will stop the join.
+void rtree_self_join(const struct rtree *tr, 
+    bool (*iter)(const RTREE_NUMTYPE *amin, const RTREE_NUMTYPE *amax, const void *adata,
+        const RTREE_NUMTYPE *bmin, const RTREE_NUMTYPE *bmax, const void *bdata, 
+        void *udata),
     void *udata);
 
+// rtree_join_parallel is rtree_join, or rtree_self_join when b is NULL, 
+// running over nthreads threads. Zero threads uses one per CPU.
+//
+// The join is split into tasks by pairs of nodes near the top of the trees,
+// which the threads take from each other as they run out of work. The iter
+// is called from all threads at once, each thread passing its own element of
+// the udatas array, which must hold nthreads elements, or be NULL. Pairs
+// are not visited in any particular order.
+//
+// Returning false from the iter will stop the join, after the other threads
+// finish their current task. The rtrees must not be changed until this 
+// returns, and a clone can be used to join an rtree that is being changed.
+//
+// Returns false if the system is out of memory or the threads could not be
+// started, in which case no pairs were visited.
+bool rtree_join_parallel(const struct rtree *a, const struct rtree *b, 
+    int nthreads,
+    bool (*iter)(const RTREE_NUMTYPE *amin, const RTREE_NUMTYPE *amax, const void *adata,
+        const RTREE_NUMTYPE *bmin, const RTREE_NUMTYPE *bmax, const void *bdata, 
+        void *udata),
+    void **udatas);
+
 // rtree_count returns the number of items in the rtree.
 size_t rtree_count(const struct rtree *tr);
 
@@ -84,18 +467,263 @@ size_t rtree_count(const struct rtree *tr);
 // rectangle, and perform a binary comparison of its data to the provided
 // data. The first item that is found is deleted.
 //
-// Returns false if the system is out of memory.
-bool rtree_delete(struct rtree *tr, const double *min, const double *max, const void *data);
+// Returns false if the system is out of memory, or if the rtree has a journal
+// and its pending records could not be written.
+bool rtree_delete(struct rtree *tr, const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, const void *data);
 
 // rtree_delete_with_comparator deletes an item from the rtree.
 // This searches the tree for an item that is contained within the provided
 // rectangle, and perform a comparison of its data to the provided data using
 // a compare function. The first item that is found is deleted.
 //
-// Returns false if the system is out of memory.
-bool rtree_delete_with_comparator(struct rtree *tr, const double *min, 
-    const double *max, const void *data,
+// Returns false if the system is out of memory, or if the rtree has a journal
+// and its pending records could not be written.
+bool rtree_delete_with_comparator(struct rtree *tr, const RTREE_NUMTYPE *min, 
+    const RTREE_NUMTYPE *max, const void *data,
     int (*compare)(const void *a, const void *b, void *udata),
     void *udata);
 
+// rtree_set_item_id keeps an index of the items by the ID that the id 
+// callback returns for each of them, so that items can be deleted and 
+// updated by ID with rtree_delete_id and rtree_update_id, without knowing 
+// their rects. The callback is passed the udata of rtree_set_udata. 
+//
+// Every item must have its own ID. The index is built from the items that 
+// are in the rtree and kept up to date by every change after, and a NULL id
+// drops it. It holds the rect of each item, which a delete by ID descends 
+// to directly, and is shared by clones until one of them is changed.
+//
+// Returns false if the system is out of memory, in which case the rtree has
+// no index.
+bool rtree_set_item_id(struct rtree *tr, 
+    uint64_t (*id)(const void *item, void *udata));
+
+// rtree_delete_id deletes the item with the ID from an rtree that has an 
+// index from rtree_set_item_id.
+//
+// Returns false if the system is out of memory, if the rtree has a journal
+// and its pending records could not be written, or if the rtree has no 
+// index.
+bool rtree_delete_id(struct rtree *tr, uint64_t id);
+
+// rtree_update_id replaces the item that has the same ID as the data with 
+// the data and the new rect, in an rtree that has an index from 
+// rtree_set_item_id. The item is inserted when there's none with the ID.
+//
+// Returns false if the system is out of memory, if the rtree has a journal
+// and its pending records could not be written, or if the rtree has no 
+// index. The rtree is unchanged when it returns false.
+bool rtree_update_id(struct rtree *tr, const RTREE_NUMTYPE *min, 
+    const RTREE_NUMTYPE *max, const void *data);
+
+// rtree_set_lazy_delete turns lazy deletes on or off. A lazy delete frees 
+// the item and marks it with a tombstone in its leaf, which searches skip,
+// without moving the other items or shrinking the rects above it. That 
+// makes deletes cheap for bursts of them, at the cost of the tombstones 
+// taking space and search time until rtree_compact removes them.
+void rtree_set_lazy_delete(struct rtree *tr, bool lazy);
+
+// rtree_compact removes the tombstones of lazy deletes and makes the rects 
+// above them tight again. At most max leaves with tombstones are compacted 
+// per call, or all of them when max is zero, so that the work can be spread
+// out between other operations. It returns right away when there are no
+// tombstones.
+//
+// Returns false if the system is out of memory, in which case the rtree is
+// still valid but some tombstones may be left.
+bool rtree_compact(struct rtree *tr, size_t max);
+
+// rtree_set_write_buffer sets the number of items that inserts may collect 
+// in a write buffer, next to the main tree, before moving them into the 
+// tree together. Appending to the buffer is cheaper than descending the 
+// tree, and the items are moved in the order of a Hilbert curve, which 
+// keeps the paths of neighboring items warm in the cache. Every search 
+// also checks the buffer, which slows searches for large buffers. A size
+// of zero turns the buffer off. The current buffer is flushed first.
+//
+// Returns false if the system is out of memory.
+bool rtree_set_write_buffer(struct rtree *tr, size_t size);
+
+// rtree_flush moves all items in the write buffer into the main tree.
+//
+// Returns false if the system is out of memory, in which case some of the
+// items may be left in the buffer.
+bool rtree_flush(struct rtree *tr);
+
+struct rtree_level_stats {
+    size_t nodes;        // number of nodes
+    size_t entries;      // number of rects in all nodes
+    double overlap;      // summed area of overlap between rects in each node
+    double dead_space;   // estimated area in nodes that isn't covered by rects
+};
+
+struct rtree_stats {
+    size_t count;        // number of items
+    size_t dead;         // number of tombstones waiting for rtree_compact
+    size_t height;       // number of levels
+    size_t nodes;        // number of nodes
+    size_t bytes;        // bytes allocated for the rtree and its nodes
+    size_t shared_bytes; // bytes in nodes that are shared with clones
+    size_t fill[10];     // number of nodes by fill factor, in 10% steps
+    struct rtree_level_stats levels[RTREE_MAX_LEVELS]; // the root is level 0
+};
+
+// rtree_stats reports the shape of the rtree, which is useful for telling
+// when an rtree has degraded and needs to be rebuilt.
+//
+// The dead space is the area of each node rect minus the area of its rects,
+// adding back their pairwise overlap. It's exact when at most two rects
+// overlap at any point.
+void rtree_stats(const struct rtree *tr, struct rtree_stats *stats);
+
+struct rtree_query_stats {
+    size_t nodes[RTREE_MAX_LEVELS]; // nodes visited per level, root is 0
+    size_t rect_tests;              // rects tested against the query
+    size_t rect_hits;               // rects that passed the test
+    size_t items_examined;          // items looked at in leaves
+    size_t items_returned;          // items passed to the iter or deleted
+};
+
+// rtree_query_stats copies the counters of the most recent rtree_search,
+// rtree_scan, or delete operation on the calling thread.
+//
+// The counters are only collected when rtree.c is compiled with 
+// RTREE_INSTRUMENT defined. Otherwise they cost nothing and this returns 
+// false.
+bool rtree_query_stats(struct rtree_query_stats *stats);
+
+// rtree_journal_open loads the snapshot file and replays the journal file into
+// an empty rtree, then attaches the journal so that every following insert 
+// and delete is appended to it. Either file may be missing, in which case it
+// is created.
+//
+// Records are written and synced to storage in groups of the provided size.
+// A crash loses at most the last group - 1 operations. Use 
+// rtree_journal_sync to force the pending records out.
+//
+// Items are persisted as the raw bytes of their data, so this is meant for
+// rtrees whose data are plain values, such as ids, without item callbacks.
+// A cloned rtree does not inherit the journal.
+//
+// Returns false if the system is out of memory or the files could not be
+// read or written, in which case the rtree is left empty. Also returns false
+// for rtrees with inline items, which can't be journaled, and for rtrees 
+// that aren't empty, which are left as they are.
+bool rtree_journal_open(struct rtree *tr, const char *snap_path, 
+    const char *path, int group);
+
+// rtree_journal_sync writes and syncs all pending journal records.
+//
+// Returns false if the records could not be written.
+bool rtree_journal_sync(struct rtree *tr);
+
+// rtree_journal_checkpoint writes a new snapshot of the entire rtree and
+// resets the journal.
+//
+// Returns false if the files could not be written.
+bool rtree_journal_checkpoint(struct rtree *tr);
+
+// rtree_journal_close syncs the pending records and detaches the journal.
+// This is also done by rtree_free.
+//
+// Returns false if the records could not be written.
+bool rtree_journal_close(struct rtree *tr);
+
+// rtree_trace_start starts recording the inserts, deletes, and searches on
+// the rtree to a binary trace file, which can be replayed with
+// TRACE=<path> tests/run.sh bench.
+//
+// Clones made while recording share the trace, and searches may be recorded
+// from many threads at once. The file is closed once every rtree sharing it
+// has stopped or been freed.
+//
+// Returns false if the system is out of memory, the file could not be
+// created, or the rtree is already recording.
+bool rtree_trace_start(struct rtree *tr, const char *path);
+
+// rtree_trace_stop stops recording the rtree.
+//
+// Returns false if some of the trace could not be written.
+bool rtree_trace_stop(struct rtree *tr);
+
+// rtree_trace_read calls the iter for every operation in a trace file, in
+// the order they were recorded. The data of searches is NULL.
+//
+// Returning false from the iter will stop the reading.
+//
+// Returns false if the file could not be read or is damaged.
+bool rtree_trace_read(const char *path,
+    bool (*iter)(int op, const RTREE_NUMTYPE *min, const RTREE_NUMTYPE *max, 
+        const void *data, void *udata),
+    void *udata);
+
+#endif // RTREE_RELEASE
+#undef RTREE_RELEASE
+
+// rtree.c keeps the settings for its own use.
+#ifndef RTREE_IMPL
+#undef RTREE_NUMTYPE
+#undef RTREE_INT32
+#undef RTREE_UINT32
+#ifdef RTREE_PREFIX
+#undef rtree
+#undef rtree_nearest
+#undef rtree_new
+#undef rtree_new_with_allocator
+#undef rtree_new_with_item_size
+#undef rtree_free
+#undef rtree_clone
+#undef rtree_set_item_callbacks
+#undef rtree_set_udata
+#undef rtree_insert
+#undef rtree_insert_many
+#undef rtree_merge
+#undef rtree_partition
+#undef rtree_search
+#undef rtree_search_parallel
+#undef rtree_search_contained
+#undef rtree_search_containing
+#undef rtree_search_custom
+#undef rtree_search_radius
+#undef rtree_raycast
+#undef rtree_nearest_new
+#undef rtree_nearest_next
+#undef rtree_nearest_done
+#undef rtree_nearest_free
+#undef rtree_search_collect
+#undef rtree_search_many
+#undef rtree_search_pipelined
+#undef rtree_scan
+#undef rtree_join
+#undef rtree_self_join
+#undef rtree_join_parallel
+#undef rtree_count
+#undef rtree_delete
+#undef rtree_delete_with_comparator
+#undef rtree_set_item_id
+#undef rtree_delete_id
+#undef rtree_update_id
+#undef rtree_set_lazy_delete
+#undef rtree_compact
+#undef rtree_set_write_buffer
+#undef rtree_flush
+#undef rtree_level_stats
+#undef rtree_stats
+#undef rtree_query_stats
+#undef rtree_journal_open
+#undef rtree_journal_sync
+#undef rtree_journal_checkpoint
+#undef rtree_journal_close
+#undef rtree_trace_start
+#undef rtree_trace_stop
+#undef rtree_trace_read
+#undef rtree_check
+#undef rtree_write_svg
+#undef RTREE_NAME
+#undef RTREE_CONCAT
+#undef RTREE_CONCAT0
+#undef RTREE_PREFIX
+#endif
+#endif
+
 #endif // RTREE_H
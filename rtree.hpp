@@ -0,0 +1,753 @@
+// Copyright 2023 Joshua J Baker. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file.
+
+// rtree.hpp is a header-only C++ template version of rtree.c. It uses the
+// same node layout, subtree chooser, and split as the C library, but the
+// value type, dimensions, coordinate type, and node size are template
+// parameters and the visitors are called directly so the compiler can
+// inline them into the search loops.
+//
+// Requires C++11. Out of memory is reported by throwing std::bad_alloc, in
+// which case the tree is left unchanged.
+
+#ifndef RTREE_HPP
+#define RTREE_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <utility>
+
+namespace rtree_cpp {
+
+namespace detail {
+
+// dims calls f(i) for each i in [I, N) and stops on the first false. The
+// recursion is resolved at compile time, so the dimension loops are unrolled
+// no matter the optimization level.
+template <int I, int N>
+struct dims {
+    template <class F>
+    static inline bool all(F &f) {
+        return f(I) && dims<I+1, N>::all(f);
+    }
+};
+
+template <int N>
+struct dims<N, N> {
+    template <class F>
+    static inline bool all(F &) {
+        return true;
+    }
+};
+
+} // namespace detail
+
+// rtree is an R-tree of T values. Dims is the number of dimensions, Num is
+// the coordinate type, and Fanout is the maximum number of entries per node.
+//
+// T only needs to be move constructible and move assignable, so move-only
+// types such as std::unique_ptr can be stored directly.
+template <class T, int Dims = 2, class Num = double, int Fanout = 64>
+class rtree {
+    static_assert(Dims > 0, "Dims must be positive");
+    static_assert(Fanout >= 4, "Fanout must be at least 4");
+
+public:
+    struct rect {
+        Num min[Dims];
+        Num max[Dims];
+    };
+
+    rtree() noexcept {}
+
+    ~rtree() {
+        clear();
+    }
+
+    rtree(rtree &&other) noexcept {
+        steal(other);
+    }
+
+    rtree &operator=(rtree &&other) noexcept {
+        if (this != &other) {
+            clear();
+            steal(other);
+        }
+        return *this;
+    }
+
+    rtree(const rtree &) = delete;
+    rtree &operator=(const rtree &) = delete;
+
+    // size returns the number of items in the tree.
+    size_t size() const noexcept {
+        return count_;
+    }
+
+    // empty returns true if the tree has no items.
+    bool empty() const noexcept {
+        return count_ == 0;
+    }
+
+    // height returns the number of levels, where a single leaf is 1.
+    int height() const noexcept {
+        return height_;
+    }
+
+    // bounds copies the minimum bounding rectangle of all items into min and
+    // max. Returns false if the tree is empty.
+    bool bounds(Num *min, Num *max) const noexcept {
+        if (!root_) {
+            return false;
+        }
+        std::memcpy(min, rect_.min, sizeof(Num)*Dims);
+        std::memcpy(max, rect_.max, sizeof(Num)*Dims);
+        return true;
+    }
+
+    // clear removes all items.
+    void clear() noexcept {
+        if (root_) {
+            node_free(root_);
+        }
+        root_ = nullptr;
+        count_ = 0;
+        height_ = 0;
+        std::memset(&rect_, 0, sizeof(rect));
+    }
+
+    // insert adds a value with the rectangle min/max. Passing a null max
+    // inserts a point.
+    //
+    // Throws std::bad_alloc if the system is out of memory, in which case the
+    // value has not been moved from.
+    void insert(const Num *min, const Num *max, T &&value) {
+        rect ir = make_rect(min, max);
+        for (;;) {
+            if (!root_) {
+                root_ = node_new(LEAF);
+                rect_ = ir;
+                height_ = 1;
+            }
+            bool split = false;
+            bool grown = false;
+            node_insert(rect_, root_, ir, value, split, grown);
+            if (split) {
+                branch *new_root = static_cast<branch*>(node_new(BRANCH));
+                node *left = root_;
+                node *right;
+                try {
+                    right = node_split(rect_, left);
+                } catch (...) {
+                    node_free(new_root);
+                    throw;
+                }
+                new_root->rects[0] = node_rect_calc(left);
+                new_root->rects[1] = node_rect_calc(right);
+                new_root->children[0] = left;
+                new_root->children[1] = right;
+                new_root->count = 2;
+                root_ = new_root;
+                height_++;
+                node_sort(root_);
+                continue;
+            }
+            if (grown) {
+                rect_expand(rect_, ir);
+                node_sort(root_);
+            }
+            count_++;
+            return;
+        }
+    }
+
+    // insert adds a copy of value with the rectangle min/max.
+    void insert(const Num *min, const Num *max, const T &value) {
+        T copy(value);
+        insert(min, max, std::move(copy));
+    }
+
+    // search visits every item that intersects the rectangle min/max. Passing
+    // a null max searches for a point.
+    //
+    // The visitor is called as iter(min, max, value) and returns false to
+    // stop early. Returns false if the search was stopped.
+    template <class Iter>
+    bool search(const Num *min, const Num *max, Iter &&iter) const {
+        rect r = make_rect(min, max);
+        if (root_ && rect_intersects(rect_, r)) {
+            return node_search(root_, r, iter);
+        }
+        return true;
+    }
+
+    // scan visits every item in the tree. Returns false if the visitor
+    // stopped early.
+    template <class Iter>
+    bool scan(Iter &&iter) const {
+        if (root_) {
+            return node_scan(root_, iter);
+        }
+        return true;
+    }
+
+    // remove_if deletes the first item with the rectangle min/max for which
+    // eq(value) returns true. Passing a null max removes a point.
+    //
+    // Returns true if an item was removed. Never allocates.
+    template <class Eq>
+    bool remove_if(const Num *min, const Num *max, Eq &&eq) {
+        if (!root_) {
+            return false;
+        }
+        rect ir = make_rect(min, max);
+        bool removed = false;
+        bool shrunk = false;
+        node_delete(rect_, root_, ir, eq, removed, shrunk);
+        if (!removed) {
+            return false;
+        }
+        count_--;
+        if (count_ == 0) {
+            clear();
+            return true;
+        }
+        while (root_->kind == BRANCH && root_->count == 1) {
+            branch *prev = static_cast<branch*>(root_);
+            root_ = prev->children[0];
+            prev->count = 0;
+            node_free(prev);
+            height_--;
+        }
+        if (shrunk) {
+            rect_ = node_rect_calc(root_);
+        }
+        return true;
+    }
+
+    // remove deletes the first item with the rectangle min/max that compares
+    // equal to value. Returns true if an item was removed.
+    bool remove(const Num *min, const Num *max, const T &value) {
+        return remove_if(min, max, [&value](const T &v) {
+            return v == value;
+        });
+    }
+
+private:
+    enum node_kind { LEAF = 1, BRANCH = 2 };
+
+    static constexpr int MIN_ENTRIES = Fanout * 10 / 100 + 1;
+
+    struct node {
+        node_kind kind;
+        int count;
+        rect rects[Fanout];
+        explicit node(node_kind k) noexcept : kind(k), count(0) {}
+    };
+
+    struct branch : node {
+        node *children[Fanout];
+        branch() noexcept : node(BRANCH) {}
+    };
+
+    // Leaf items live in a union so that only the first count entries are
+    // ever constructed.
+    struct leaf : node {
+        union {
+            T items[Fanout];
+        };
+        leaf() noexcept : node(LEAF) {}
+        ~leaf() {
+            for (int i = 0; i < this->count; i++) {
+                items[i].~T();
+            }
+        }
+    };
+
+    rect rect_ {};
+    node *root_ = nullptr;
+    size_t count_ = 0;
+    int height_ = 0;
+
+    void steal(rtree &other) noexcept {
+        rect_ = other.rect_;
+        root_ = other.root_;
+        count_ = other.count_;
+        height_ = other.height_;
+        other.root_ = nullptr;
+        other.count_ = 0;
+        other.height_ = 0;
+    }
+
+    static rect make_rect(const Num *min, const Num *max) noexcept {
+        rect r;
+        std::memcpy(r.min, min, sizeof(Num)*Dims);
+        std::memcpy(r.max, max ? max : min, sizeof(Num)*Dims);
+        return r;
+    }
+
+    ////////////////////////////////
+    // rects
+    ////////////////////////////////
+
+    static inline void rect_expand(rect &r, const rect &other) noexcept {
+        auto f = [&](int i) {
+            if (other.min[i] < r.min[i]) r.min[i] = other.min[i];
+            if (other.max[i] > r.max[i]) r.max[i] = other.max[i];
+            return true;
+        };
+        detail::dims<0, Dims>::all(f);
+    }
+
+    static inline double rect_area(const rect &r) noexcept {
+        double area = 1;
+        auto f = [&](int i) {
+            area *= (double)r.max[i] - (double)r.min[i];
+            return true;
+        };
+        detail::dims<0, Dims>::all(f);
+        return area;
+    }
+
+    static inline double rect_unioned_area(const rect &r, const rect &other)
+        noexcept
+    {
+        double area = 1;
+        auto f = [&](int i) {
+            Num min = other.min[i] < r.min[i] ? other.min[i] : r.min[i];
+            Num max = other.max[i] > r.max[i] ? other.max[i] : r.max[i];
+            area *= (double)max - (double)min;
+            return true;
+        };
+        detail::dims<0, Dims>::all(f);
+        return area;
+    }
+
+    static inline bool rect_contains(const rect &r, const rect &other)
+        noexcept
+    {
+        auto f = [&](int i) {
+            return !(other.min[i] < r.min[i] || other.max[i] > r.max[i]);
+        };
+        return detail::dims<0, Dims>::all(f);
+    }
+
+    static inline bool rect_intersects(const rect &r, const rect &other)
+        noexcept
+    {
+        auto f = [&](int i) {
+            return !(other.min[i] > r.max[i] || other.max[i] < r.min[i]);
+        };
+        return detail::dims<0, Dims>::all(f);
+    }
+
+    static inline bool nums_equal(Num a, Num b) noexcept {
+        return !(a < b || a > b);
+    }
+
+    static inline bool rect_onedge(const rect &r, const rect &other) noexcept {
+        auto f = [&](int i) {
+            return !(nums_equal(r.min[i], other.min[i]) ||
+                nums_equal(r.max[i], other.max[i]));
+        };
+        return !detail::dims<0, Dims>::all(f);
+    }
+
+    static inline bool rect_equals(const rect &r, const rect &other) noexcept {
+        auto f = [&](int i) {
+            return nums_equal(r.min[i], other.min[i]) &&
+                nums_equal(r.max[i], other.max[i]);
+        };
+        return detail::dims<0, Dims>::all(f);
+    }
+
+    static int rect_largest_axis(const rect &r) noexcept {
+        int axis = 0;
+        double nlength = (double)r.max[0] - (double)r.min[0];
+        for (int i = 1; i < Dims; i++) {
+            double length = (double)r.max[i] - (double)r.min[i];
+            if (length > nlength) {
+                nlength = length;
+                axis = i;
+            }
+        }
+        return axis;
+    }
+
+    ////////////////////////////////
+    // nodes
+    ////////////////////////////////
+
+    static node *node_new(node_kind k) {
+        if (k == LEAF) {
+            return new leaf();
+        }
+        return new branch();
+    }
+
+    static void node_free(node *n) noexcept {
+        if (n->kind == BRANCH) {
+            branch *b = static_cast<branch*>(n);
+            for (int i = 0; i < b->count; i++) {
+                node_free(b->children[i]);
+            }
+            delete b;
+        } else {
+            delete static_cast<leaf*>(n);
+        }
+    }
+
+    static rect node_rect_calc(const node *n) noexcept {
+        rect r = n->rects[0];
+        for (int i = 1; i < n->count; i++) {
+            rect_expand(r, n->rects[i]);
+        }
+        return r;
+    }
+
+    static void node_swap(node *n, int i, int j) {
+        rect tmp = n->rects[i];
+        n->rects[i] = n->rects[j];
+        n->rects[j] = tmp;
+        if (n->kind == LEAF) {
+            leaf *l = static_cast<leaf*>(n);
+            using std::swap;
+            swap(l->items[i], l->items[j]);
+        } else {
+            branch *b = static_cast<branch*>(n);
+            node *tmp = b->children[i];
+            b->children[i] = b->children[j];
+            b->children[j] = tmp;
+        }
+    }
+
+    static void node_qsort(node *n, int s, int e, int axis, bool rev,
+        bool max)
+    {
+        int nrects = e - s;
+        if (nrects < 2) {
+            return;
+        }
+        int left = 0;
+        int right = nrects-1;
+        int pivot = nrects / 2;
+        node_swap(n, s+pivot, s+right);
+        rect *rects = &n->rects[s];
+        for (int i = 0; i < nrects; i++) {
+            bool less;
+            if (!rev) {
+                less = rects[i].min[axis] < rects[right].min[axis];
+            } else if (!max) {
+                less = rects[right].min[axis] < rects[i].min[axis];
+            } else {
+                less = rects[right].max[axis] < rects[i].max[axis];
+            }
+            if (less) {
+                node_swap(n, s+i, s+left);
+                left++;
+            }
+        }
+        node_swap(n, s+left, s+right);
+        node_qsort(n, s, s+left, axis, rev, max);
+        node_qsort(n, s+left+1, e, axis, rev, max);
+    }
+
+    // sort the node rectangles
+    static void node_sort(node *n) {
+        node_qsort(n, 0, n->count, 0, false, false);
+    }
+
+    // sort the node rectangles by the axis. used during splits
+    static void node_sort_by_axis(node *n, int axis, bool rev, bool max) {
+        node_qsort(n, 0, n->count, axis, rev, max);
+    }
+
+    static void node_order_to_right(node *n, int index) {
+        while (index < n->count-1 &&
+            n->rects[index+1].min[0] < n->rects[index].min[0])
+        {
+            node_swap(n, index+1, index);
+            index++;
+        }
+    }
+
+    static void node_order_to_left(node *n, int index) {
+        while (index > 0 && n->rects[index].min[0] < n->rects[index-1].min[0])
+        {
+            node_swap(n, index, index-1);
+            index--;
+        }
+    }
+
+    static int node_rsearch(const node *n, Num key) noexcept {
+        for (int i = 0; i < n->count; i++) {
+            if (!(n->rects[i].min[0] < key)) {
+                return i;
+            }
+        }
+        return n->count;
+    }
+
+    // node_move_rect_at_index_into moves an entry to the end of another node
+    // and fills the hole with the last entry.
+    static void node_move_rect_at_index_into(node *from, int index,
+        node *into)
+    {
+        into->rects[into->count] = from->rects[index];
+        from->rects[index] = from->rects[from->count-1];
+        if (from->kind == LEAF) {
+            leaf *lf = static_cast<leaf*>(from);
+            leaf *li = static_cast<leaf*>(into);
+            new (&li->items[into->count]) T(std::move(lf->items[index]));
+            if (index != from->count-1) {
+                lf->items[index] = std::move(lf->items[from->count-1]);
+            }
+            lf->items[from->count-1].~T();
+        } else {
+            branch *bf = static_cast<branch*>(from);
+            branch *bi = static_cast<branch*>(into);
+            bi->children[into->count] = bf->children[index];
+            bf->children[index] = bf->children[from->count-1];
+        }
+        from->count--;
+        into->count++;
+    }
+
+    static node *node_split(const rect &r, node *left) {
+        int axis = rect_largest_axis(r);
+        node *right = node_new(left->kind);
+        for (int i = 0; i < left->count; i++) {
+            double min_dist = (double)left->rects[i].min[axis] -
+                              (double)r.min[axis];
+            double max_dist = (double)r.max[axis] -
+                              (double)left->rects[i].max[axis];
+            if (!(min_dist < max_dist)) {
+                node_move_rect_at_index_into(left, i, right);
+                i--;
+            }
+        }
+        // Make sure that both left and right nodes have at least
+        // MIN_ENTRIES by moving items into underflowed nodes.
+        if (left->count < MIN_ENTRIES) {
+            node_sort_by_axis(right, axis, true, false);
+            do {
+                node_move_rect_at_index_into(right, right->count-1, left);
+            } while (left->count < MIN_ENTRIES);
+        } else if (right->count < MIN_ENTRIES) {
+            node_sort_by_axis(left, axis, true, true);
+            do {
+                node_move_rect_at_index_into(left, left->count-1, right);
+            } while (right->count < MIN_ENTRIES);
+        }
+        node_sort(right);
+        node_sort(left);
+        return right;
+    }
+
+    static int node_choose_subtree(const node *n, const rect &ir) noexcept {
+        // Take a quick look for the first node that contain the rect.
+        for (int i = 0; i < n->count; i++) {
+            if (rect_contains(n->rects[i], ir)) {
+                return i;
+            }
+        }
+        // Fallback to using the "choose least enlargment" algorithm.
+        int j = 0;
+        double jenlarge = 0;
+        for (int i = 0; i < n->count; i++) {
+            double enlarge = rect_unioned_area(n->rects[i], ir) -
+                rect_area(n->rects[i]);
+            if (i == 0 || enlarge < jenlarge) {
+                j = i;
+                jenlarge = enlarge;
+            }
+        }
+        return j;
+    }
+
+    // node_insert sets split when the target leaf is full. The caller splits
+    // the full node and tries again, so an exception thrown while allocating
+    // the new node leaves the tree unchanged.
+    static void node_insert(rect &nr, node *n, const rect &ir, T &value,
+        bool &split, bool &grown)
+    {
+        split = false;
+        grown = false;
+        if (n->kind == LEAF) {
+            if (n->count == Fanout) {
+                split = true;
+                return;
+            }
+            leaf *l = static_cast<leaf*>(n);
+            int index = node_rsearch(n, ir.min[0]);
+            std::memmove(&n->rects[index+1], &n->rects[index],
+                (n->count-index)*sizeof(rect));
+            n->rects[index] = ir;
+            if (index == n->count) {
+                new (&l->items[index]) T(std::move(value));
+            } else {
+                new (&l->items[n->count]) T(std::move(l->items[n->count-1]));
+                for (int i = n->count-1; i > index; i--) {
+                    l->items[i] = std::move(l->items[i-1]);
+                }
+                l->items[index] = std::move(value);
+            }
+            n->count++;
+            grown = !rect_contains(nr, ir);
+            return;
+        }
+
+        // Choose a subtree for inserting the rectangle.
+        branch *b = static_cast<branch*>(n);
+        int index = node_choose_subtree(n, ir);
+        node_insert(n->rects[index], b->children[index], ir, value, split,
+            grown);
+        if (split) {
+            if (n->count == Fanout) {
+                return;
+            }
+            // split the child node
+            node *left = b->children[index];
+            node *right = node_split(n->rects[index], left);
+            n->rects[index] = node_rect_calc(left);
+            std::memmove(&n->rects[index+2], &n->rects[index+1],
+                (n->count-(index+1))*sizeof(rect));
+            std::memmove(&b->children[index+2], &b->children[index+1],
+                (n->count-(index+1))*sizeof(node*));
+            n->rects[index+1] = node_rect_calc(right);
+            b->children[index+1] = right;
+            n->count++;
+            if (n->rects[index].min[0] > n->rects[index+1].min[0]) {
+                node_swap(n, index+1, index);
+            }
+            node_order_to_right(n, index+1);
+            node_insert(nr, n, ir, value, split, grown);
+            return;
+        }
+        if (grown) {
+            // The child rectangle must expand to accomadate the new item.
+            rect_expand(n->rects[index], ir);
+            node_order_to_left(n, index);
+            grown = !rect_contains(nr, ir);
+        }
+    }
+
+    template <class Iter>
+    static bool node_search(const node *n, const rect &r, Iter &iter) {
+        if (n->kind == LEAF) {
+            const leaf *l = static_cast<const leaf*>(n);
+            for (int i = 0; i < n->count; i++) {
+                if (rect_intersects(n->rects[i], r)) {
+                    if (!iter(n->rects[i].min, n->rects[i].max, l->items[i])) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+        const branch *b = static_cast<const branch*>(n);
+        for (int i = 0; i < n->count; i++) {
+            if (rect_intersects(n->rects[i], r)) {
+                if (!node_search(b->children[i], r, iter)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    template <class Iter>
+    static bool node_scan(const node *n, Iter &iter) {
+        if (n->kind == LEAF) {
+            const leaf *l = static_cast<const leaf*>(n);
+            for (int i = 0; i < n->count; i++) {
+                if (!iter(n->rects[i].min, n->rects[i].max, l->items[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        const branch *b = static_cast<const branch*>(n);
+        for (int i = 0; i < n->count; i++) {
+            if (!node_scan(b->children[i], iter)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <class Eq>
+    static void node_delete(rect &nr, node *n, const rect &ir, Eq &eq,
+        bool &removed, bool &shrunk)
+    {
+        removed = false;
+        shrunk = false;
+        if (n->kind == LEAF) {
+            leaf *l = static_cast<leaf*>(n);
+            for (int i = 0; i < n->count; i++) {
+                if (!rect_contains(ir, n->rects[i]) || !eq(l->items[i])) {
+                    continue;
+                }
+                // Found the target item to delete.
+                for (int j = i; j < n->count-1; j++) {
+                    l->items[j] = std::move(l->items[j+1]);
+                }
+                l->items[n->count-1].~T();
+                std::memmove(&n->rects[i], &n->rects[i+1],
+                    (n->count-(i+1))*sizeof(rect));
+                n->count--;
+                if (rect_onedge(ir, nr)) {
+                    // The item rect was on the edge of the node rect.
+                    // We need to recalculate the node rect.
+                    if (n->count > 0) {
+                        nr = node_rect_calc(n);
+                    }
+                    shrunk = true;
+                }
+                removed = true;
+                return;
+            }
+            return;
+        }
+        branch *b = static_cast<branch*>(n);
+        for (int i = 0; i < n->count; i++) {
+            if (!rect_contains(n->rects[i], ir)) {
+                continue;
+            }
+            rect crect = n->rects[i];
+            node_delete(n->rects[i], b->children[i], ir, eq, removed,
+                shrunk);
+            if (!removed) {
+                continue;
+            }
+            if (b->children[i]->count == 0) {
+                // underflow
+                node_free(b->children[i]);
+                std::memmove(&n->rects[i], &n->rects[i+1],
+                    (n->count-(i+1))*sizeof(rect));
+                std::memmove(&b->children[i], &b->children[i+1],
+                    (n->count-(i+1))*sizeof(node*));
+                n->count--;
+                if (n->count > 0) {
+                    nr = node_rect_calc(n);
+                }
+                shrunk = true;
+                return;
+            }
+            if (shrunk) {
+                shrunk = !rect_equals(n->rects[i], crect);
+                if (shrunk) {
+                    nr = node_rect_calc(n);
+                }
+                node_order_to_right(n, i);
+            }
+            return;
+        }
+    }
+};
+
+} // namespace rtree_cpp
+
+#endif // RTREE_HPP
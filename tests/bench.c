@@ -1,9 +1,59 @@
+#include <pthread.h>
 #include "tests.h"
 #include "../rtree.h"
 
 
 
 
+#ifndef DIMS
+#define DIMS 2
+#endif
+
+static const char *bench_workload = "";
+static FILE *bench_json = NULL;
+
+// nanotime returns the monotonic clock in nanoseconds.
+static uint64_t nanotime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int float_compare(const void *a, const void *b) {
+    float x = *(float*)a;
+    float y = *(float*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const float *lats, int N, double p) {
+    int i = (int)(p*N);
+    return lats[i < N ? i : N-1];
+}
+
+// bench_report prints the latency percentiles of the sampled ops of a 
+// finished bench, and writes a json line with its results when the JSON 
+// environment variable is set to a file path.
+static void bench_report(const char *name, int N, double elapsed_secs, 
+    float *lats, int nlats)
+{
+    qsort(lats, nlats, sizeof(float), float_compare);
+    double p50 = percentile(lats, nlats, 0.50);
+    double p99 = percentile(lats, nlats, 0.99);
+    double p999 = percentile(lats, nlats, 0.999);
+    printf(" p50 %.0f p99 %.0f p999 %.0f ns", p50, p99, p999);
+    if (bench_json) {
+        fprintf(bench_json, "{\"workload\":\"%s\",\"dims\":%d,\"name\":\"%s\","
+            "\"ops\":%d,\"secs\":%.6f,\"ns_op\":%.1f,\"p50\":%.0f,"
+            "\"p99\":%.0f,\"p999\":%.0f}\n", bench_workload, DIMS, name, N, 
+            elapsed_secs, elapsed_secs/(double)N*1e9, p50, p99, p999);
+    }
+}
+
+// Only one op in BENCH_SAMPLE is timed on its own, for the latency 
+// percentiles. The ns/op and op/sec come from the time spent in the other 
+// ops, which run without timers around them.
+#define BENCH_SAMPLE 16
+
 #define bench(name, N, code) {{ \
     if (strlen(name) > 0) { \
         printf("%-14s ", name); \
@@ -11,14 +61,28 @@
     size_t tmem = (size_t)total_mem; \
     size_t tallocs = (size_t)total_allocs; \
     uint64_t bytes = 0; \
-    clock_t begin = clock(); \
+    float *lats = malloc(sizeof(float)*((N)/BENCH_SAMPLE+1)); \
+    assert(lats); \
+    int nlats = 0; \
+    uint64_t sampled = 0; \
+    uint64_t begin = nanotime(); \
     for (int i = 0; i < N; i++) { \
-        (code); \
+        if (i%BENCH_SAMPLE == 0) { \
+            uint64_t opbegin = nanotime(); \
+            (code); \
+            uint64_t opend = nanotime(); \
+            lats[nlats++] = (float)(opend-opbegin); \
+            sampled += opend-opbegin; \
+        } else { \
+            (code); \
+        } \
     } \
-    clock_t end = clock(); \
-    double elapsed_secs = (double)(end - begin) / CLOCKS_PER_SEC; \
+    uint64_t end = nanotime(); \
+    double ns_op = (N) > nlats ? \
+        (double)(end-begin-sampled)/(double)((N)-nlats) : \
+        (double)sampled/(double)nlats; \
+    double elapsed_secs = ns_op*(double)(N)/1e9; \
     double bytes_sec = (double)bytes/elapsed_secs; \
-    double ns_op = elapsed_secs/(double)N*1e9; \
     char *pops = commaize(N); \
     char *psec = commaize((double)N/elapsed_secs); \
     printf("%10s ops in %.3f secs %8.1f ns/op %11s op/sec", \
@@ -36,6 +100,8 @@
         size_t used_allocs = (size_t)total_allocs-tallocs; \
         printf(" %5.2f allocs/op", (double)used_allocs/N); \
     } \
+    bench_report(name, N, elapsed_secs, lats, nlats); \
+    free(lats); \
     printf("\n"); \
 }}
 
@@ -179,6 +245,14 @@ static bool search_iter(const double *min, const double *max, const void *item,
     return true;
 }
 
+static bool search_many_iter(int q, const double *min, const double *max, 
+    const void *item, void *udata)
+{
+    (void)q; (void)min; (void)max; (void)item;
+    (*(int*)udata)++;
+    return true;
+}
+
 struct search_iter_one_context {
     double *point;
     void *data;
@@ -394,15 +468,653 @@ void test_rand_bench(bool hilbert_ordered, int N) {
 
 
 
+void test_journal_bench(int N) {
+    printf("-- JOURNAL --\n");
+    double *points = make_random_points(N);
+    struct rtree *tr = rtree_new_with_allocator(xmalloc, xfree);
+    bench("insert", N, {
+        double *point = &points[i*2];
+        rtree_insert(tr, point, point, (void *)(uintptr_t)(i));
+    });
+    rtree_free(tr);
+
+    remove("bench.snap");
+    remove("bench.journal");
+    tr = rtree_new_with_allocator(xmalloc, xfree);
+    assert(rtree_journal_open(tr, "bench.snap", "bench.journal", 4096));
+    bench("insert-journal", N, {
+        double *point = &points[i*2];
+        rtree_insert(tr, point, point, (void *)(uintptr_t)(i));
+    });
+    assert(rtree_journal_sync(tr));
+    rtree_free(tr);
+    remove("bench.snap");
+    remove("bench.journal");
+    xfree(points);
+}
+
+////////////////////////////////
+// workloads
+////////////////////////////////
+
+// The workloads are generic in the number of dimensions and operate in a
+// [0,1000) space on every axis.
+#define SPACE 1000.0
+
+enum dataset {
+    UNIFORM,    // evenly distributed
+    CLUSTERED,  // gathered around a number of random centers
+    SKEWED,     // increasingly dense toward the origin
+};
+
+static double rand_normal(void) {
+    double u = rand_double();
+    double v = rand_double();
+    return sqrt(-2*log(1-u))*cos(2*M_PI*v);
+}
+
+// rand_aspect fills random side lengths for a box with the provided volume 
+// and an aspect ratio of up to 1:20 between any two sides.
+static void rand_aspect(double volume, double sides[]) {
+    double logs[DIMS];
+    double mean = 0;
+    for (int d = 0; d < DIMS; d++) {
+        logs[d] = rand_double()*3-1.5;
+        mean += logs[d]/DIMS;
+    }
+    for (int d = 0; d < DIMS; d++) {
+        sides[d] = pow(volume, 1.0/DIMS)*exp(logs[d]-mean);
+    }
+}
+
+// make_rects returns N rects, each as DIMS min coordinates followed by DIMS
+// max coordinates. Without sizes all rects are points.
+static double *make_rects(enum dataset ds, bool sized, int N) {
+    double *rects = malloc(sizeof(double)*DIMS*2*N);
+    assert(rects);
+    double centers[64*DIMS];
+    for (int i = 0; i < 64*DIMS; i++) {
+        centers[i] = rand_double()*SPACE;
+    }
+    for (int i = 0; i < N; i++) {
+        double *min = &rects[i*DIMS*2];
+        double *max = &rects[i*DIMS*2+DIMS];
+        int c = rand()%64;
+        for (int d = 0; d < DIMS; d++) {
+            switch (ds) {
+            case UNIFORM:
+                min[d] = rand_double()*SPACE;
+                break;
+            case CLUSTERED:
+                min[d] = centers[c*DIMS+d]+rand_normal()*SPACE/100;
+                break;
+            case SKEWED:
+                min[d] = pow(rand_double(), 4)*SPACE;
+                break;
+            }
+            max[d] = min[d];
+        }
+        if (sized) {
+            // sizes are spread between 1e-6 and 1e-4 of the space
+            double sides[DIMS];
+            rand_aspect(pow(SPACE, DIMS)*pow(10, -6+rand_double()*2), sides);
+            for (int d = 0; d < DIMS; d++) {
+                max[d] = min[d]+sides[d];
+            }
+        }
+    }
+    return rects;
+}
+
+// make_windows returns N search windows, each covering the fraction of the 
+// space and centered on a random item, so that clustered and skewed data is
+// actually hit.
+static double *make_windows(const double *rects, int nrects, double frac, 
+    int N)
+{
+    double *windows = malloc(sizeof(double)*DIMS*2*N);
+    assert(windows);
+    for (int i = 0; i < N; i++) {
+        const double *item = &rects[(rand()%nrects)*DIMS*2];
+        double sides[DIMS];
+        rand_aspect(pow(SPACE, DIMS)*frac, sides);
+        for (int d = 0; d < DIMS; d++) {
+            windows[i*DIMS*2+d] = item[d]-sides[d]/2;
+            windows[i*DIMS*2+DIMS+d] = item[d]+sides[d]/2;
+        }
+    }
+    return windows;
+}
+
+// make_tiles returns N/100 batches of 10x10 adjacent square windows, each 
+// covering 0.01% of the space, like the tiles of a rendered map view.
+static double *make_tiles(int N) {
+    double *tiles = malloc(sizeof(double)*DIMS*2*N);
+    assert(tiles);
+    double side = pow(pow(SPACE, DIMS)*0.0001, 1.0/DIMS);
+    for (int b = 0; b < N/100; b++) {
+        double origin[DIMS];
+        for (int d = 0; d < DIMS; d++) {
+            origin[d] = rand_double()*(SPACE-side*10);
+        }
+        for (int i = 0; i < 100; i++) {
+            double *tile = &tiles[(b*100+i)*DIMS*2];
+            for (int d = 0; d < DIMS; d++) {
+                int k = d == 0 ? i%10 : d == 1 ? i/10 : 0;
+                tile[d] = origin[d]+side*k;
+                tile[DIMS+d] = tile[d]+side;
+            }
+        }
+    }
+    return tiles;
+}
+
+struct search_pipelined_context {
+    int base;   // the id of the item of the first query
+    int found;
+};
+
+// search_pipelined_iter counts the queries that found their own item.
+static bool search_pipelined_iter(int q, const double *min, const double *max, 
+    const void *data, void *udata)
+{
+    (void)min; (void)max;
+    struct search_pipelined_context *ctx = udata;
+    if ((uintptr_t)data == (uintptr_t)(ctx->base+q)) {
+        ctx->found++;
+        return false;
+    }
+    return true;
+}
+
+static bool raycast_iter(const double *min, const double *max, 
+    const void *data, double t, void *udata)
+{
+    (void)min; (void)max; (void)data; (void)t;
+    (*(int*)udata)++;
+    return true;
+}
+
+static bool raycast_first_iter(const double *min, const double *max, 
+    const void *data, double t, void *udata)
+{
+    (void)min; (void)max; (void)data; (void)t; (void)udata;
+    return false;
+}
+
+struct radius_filter_context {
+    const double *center;
+    double radius;
+    int count;
+};
+
+static bool radius_filter_iter(const double *min, const double *max, 
+    const void *data, void *udata)
+{
+    (void)data;
+    struct radius_filter_context *ctx = udata;
+    double dist = 0;
+    for (int d = 0; d < DIMS; d++) {
+        double c = ctx->center[d];
+        double x = c < min[d] ? min[d]-c : c > max[d] ? c-max[d] : 0;
+        dist += x*x;
+    }
+    if (dist <= ctx->radius*ctx->radius) {
+        ctx->count++;
+    }
+    return true;
+}
+
+struct search_item_context {
+    const void *data;
+    bool found;
+};
+
+static bool search_item_iter(const double *min, const double *max, 
+    const void *data, void *udata)
+{
+    (void)min; (void)max;
+    struct search_item_context *ctx = udata;
+    if (data == ctx->data) {
+        ctx->found = true;
+        return false;
+    }
+    return true;
+}
+
+struct bench_thread {
+    struct rtree *tr;
+    const double *windows;
+    int nwindows;
+    int N;
+    int count;
+};
+
+static void *bench_thread_run(void *arg) {
+    struct bench_thread *th = arg;
+    for (int i = 0; i < th->N; i++) {
+        const double *window = &th->windows[(i%th->nwindows)*DIMS*2];
+        rtree_search(th->tr, window, window+DIMS, search_iter, &th->count);
+    }
+    return NULL;
+}
+
+// bench_threads runs searches on 1, 2, 4, ... threads, each on its own clone
+// of the rtree, and reports the throughput relative to a single thread.
+static void bench_threads(struct rtree *tr, const double *windows, 
+    int nwindows, int N)
+{
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxthreads = nprocs < 1 ? 1 : nprocs > 64 ? 64 : (int)nprocs;
+    double base = 0;
+    for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+        struct bench_thread ths[64];
+        pthread_t threads[64];
+        for (int i = 0; i < nthreads; i++) {
+            ths[i] = (struct bench_thread){ 
+                .tr = rtree_clone(tr), .windows = windows, 
+                .nwindows = nwindows, .N = N,
+            };
+            assert(ths[i].tr);
+        }
+        uint64_t begin = nanotime();
+        for (int i = 0; i < nthreads; i++) {
+            assert(!pthread_create(&threads[i], NULL, bench_thread_run, 
+                &ths[i]));
+        }
+        for (int i = 0; i < nthreads; i++) {
+            assert(!pthread_join(threads[i], NULL));
+            rtree_free(ths[i].tr);
+        }
+        double elapsed_secs = (double)(nanotime()-begin)/1e9;
+        int ops = N*nthreads;
+        double ops_sec = (double)ops/elapsed_secs;
+        if (nthreads == 1) {
+            base = ops_sec;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "search-%dt", nthreads);
+        char *pops = commaize(ops);
+        char *psec = commaize(ops_sec);
+        printf("%-14s %10s ops in %.3f secs %8.1f ns/op %11s op/sec "
+            "%5.2fx\n", name, pops, elapsed_secs, elapsed_secs/ops*1e9, 
+            psec, ops_sec/base);
+        free(psec);
+        free(pops);
+        if (bench_json) {
+            fprintf(bench_json, "{\"workload\":\"%s\",\"dims\":%d,"
+                "\"name\":\"%s\",\"threads\":%d,\"ops\":%d,\"secs\":%.6f,"
+                "\"ns_op\":%.1f,\"scaling\":%.2f}\n", bench_workload, DIMS, 
+                name, nthreads, ops, elapsed_secs, elapsed_secs/ops*1e9, 
+                ops_sec/base);
+        }
+    }
+}
+
+void test_workload_bench(const char *workload, enum dataset ds, bool sized, 
+    int N) 
+{
+    bench_workload = workload;
+    printf("-- %s (%dD) --\n", workload, DIMS);
+    double *rects = make_rects(ds, sized, N);
+    struct rtree *tr = rtree_new_with_allocator(xmalloc, xfree);
+    bench("insert", N, {
+        double *rect = &rects[i*DIMS*2];
+        rtree_insert(tr, rect, rect+DIMS, (void *)(uintptr_t)(i));
+    });
+    bench("search-item", N, {
+        double *rect = &rects[i*DIMS*2];
+        struct search_item_context ctx = { .data = (void *)(uintptr_t)(i) };
+        rtree_search(tr, rect, rect+DIMS, search_item_iter, &ctx);
+        assert(ctx.found);
+    });
+    // The same lookups as search-item, in batches of 1000.
+    int nbatches = N/1000;
+    if (nbatches > 0) {
+        bench("search-pipelined", nbatches, {
+            struct search_pipelined_context ctx = { .base = i*1000 };
+            rtree_search_pipelined(tr, &rects[i*1000*DIMS*2], 1000, 
+                search_pipelined_iter, &ctx);
+            assert(ctx.found == 1000);
+        });
+    }
+    const double fracs[] = { 0.0001, 0.001, 0.01 };
+    const char *names[] = { "search-0.01%", "search-0.1%", "search-1%" };
+    double *windows = NULL;
+    for (int j = 0; j < 3; j++) {
+        free(windows);
+        windows = make_windows(rects, N, fracs[j], 1000);
+        bench(names[j], 1000, {
+            double *window = &windows[i*DIMS*2];
+            int res = 0;
+            rtree_search(tr, window, window+DIMS, search_iter, &res);
+        });
+    }
+    bench("contained-1%", 1000, {
+        double *window = &windows[i*DIMS*2];
+        int res = 0;
+        rtree_search_contained(tr, window, window+DIMS, search_iter, &res);
+    });
+    bench("containing", 1000, {
+        double *point = &rects[(i*7919%N)*DIMS*2];
+        int res = 0;
+        rtree_search_containing(tr, point, NULL, search_iter, &res);
+    });
+    // Balls inscribed in the 1% windows, searched directly and as their 
+    // bounding box with a distance filter.
+    double radius = pow(pow(SPACE, DIMS)*0.01, 1.0/DIMS)/2;
+    bench("radius-1%", 1000, {
+        double *point = &rects[(i*7919%N)*DIMS*2];
+        int res = 0;
+        rtree_search_radius(tr, point, radius, search_iter, &res);
+    });
+    bench("radius-bbox-1%", 1000, {
+        struct radius_filter_context ctx = { 0 };
+        ctx.center = &rects[(i*7919%N)*DIMS*2];
+        ctx.radius = radius;
+        double min[DIMS];
+        double max[DIMS];
+        for (int d = 0; d < DIMS; d++) {
+            min[d] = ctx.center[d]-radius;
+            max[d] = ctx.center[d]+radius;
+        }
+        rtree_search(tr, min, max, radius_filter_iter, &ctx);
+    });
+    // Diagonal segments across the 1% windows, to their first hit.
+    bench("raycast-1%", 1000, {
+        double *window = &windows[i*DIMS*2];
+        double dir[DIMS];
+        for (int d = 0; d < DIMS; d++) {
+            dir[d] = window[DIMS+d]-window[d];
+        }
+        int res = 0;
+        rtree_raycast(tr, window, dir, 1, raycast_iter, &res);
+    });
+    bench("raycast-first", 1000, {
+        double *window = &windows[i*DIMS*2];
+        double dir[DIMS];
+        for (int d = 0; d < DIMS; d++) {
+            dir[d] = window[DIMS+d]-window[d];
+        }
+        rtree_raycast(tr, window, dir, 1, raycast_first_iter, NULL);
+    });
+    bench("nearest-10", 1000, {
+        double *point = &rects[(i*7919%N)*DIMS*2];
+        struct rtree_nearest *it = rtree_nearest_new(tr, point, INFINITY);
+        for (int j = 0; j < 10; j++) {
+            rtree_nearest_next(it, NULL, NULL, NULL, NULL);
+        }
+        rtree_nearest_free(it);
+    });
+    // The same windows as search-1%, collected into a buffer.
+    void *items[4096];
+    bench("collect-1%", 1000, {
+        double *window = &windows[i*DIMS*2];
+        struct rtree_cursor cursor = { 0 };
+        while (!cursor.done) {
+            rtree_search_collect(tr, window, window+DIMS, items, NULL, 4096,
+                &cursor);
+        }
+    });
+    free(windows);
+    windows = make_windows(rects, N, 0.1, 100);
+    bench("search-10%", 100, {
+        double *window = &windows[i*DIMS*2];
+        int res = 0;
+        rtree_search(tr, window, window+DIMS, search_iter, &res);
+    });
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = nprocs < 1 ? 1 : nprocs > 64 ? 64 : (int)nprocs;
+    int counts[64];
+    void *udatas[64];
+    for (int j = 0; j < 64; j++) {
+        udatas[j] = &counts[j];
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "search-10%%-%dt", nthreads);
+    bench(name, 100, {
+        double *window = &windows[i*DIMS*2];
+        assert(rtree_search_parallel(tr, window, window+DIMS, nthreads, 
+            search_iter, udatas));
+    });
+    free(windows);
+    windows = make_windows(rects, N, 0.0001, 1000);
+    // The same windows as search-0.01%, in batches of 100.
+    bench("search-many", 10, {
+        int res = 0;
+        rtree_search_many(tr, &windows[i*100*DIMS*2], 100, search_many_iter, 
+            &res);
+    });
+    double *tiles = make_tiles(1000);
+    bench("search-tiles", 1000, {
+        double *tile = &tiles[i*DIMS*2];
+        int res = 0;
+        rtree_search(tr, tile, tile+DIMS, search_iter, &res);
+    });
+    bench("search-many-tiles", 10, {
+        int res = 0;
+        rtree_search_many(tr, &tiles[i*100*DIMS*2], 100, search_many_iter, 
+            &res);
+    });
+    free(tiles);
+    bench_threads(tr, windows, 1000, N/10);
+    free(windows);
+    bench("delete", N, {
+        double *rect = &rects[i*DIMS*2];
+        rtree_delete(tr, rect, rect+DIMS, (void*)(uintptr_t)(i));
+    });
+    assert(rtree_count(tr) == 0);
+    rtree_free(tr);
+    free(rects);
+}
+
+static bool join_iter(const double *amin, const double *amax, 
+    const void *adata, const double *bmin, const double *bmax, 
+    const void *bdata, void *udata)
+{
+    (void)amin; (void)amax; (void)adata; (void)bmin; (void)bmax; (void)bdata;
+    (*(int*)udata)++;
+    return true;
+}
+
+// test_join_bench joins N sized rects (parcels) against N/100 windows that
+// each cover 0.01% of the space (zones), once with a search per parcel and 
+// once with rtree_join.
+void test_join_bench(int N) {
+    bench_workload = "join";
+    printf("-- JOIN (%dD) --\n", DIMS);
+    double *parcels = make_rects(UNIFORM, true, N);
+    double *zones = make_windows(parcels, N, 0.0001, N/100);
+    struct rtree *a = rtree_new_with_allocator(xmalloc, xfree);
+    struct rtree *b = rtree_new_with_allocator(xmalloc, xfree);
+    for (int i = 0; i < N; i++) {
+        double *rect = &parcels[i*DIMS*2];
+        rtree_insert(a, rect, rect+DIMS, (void *)(uintptr_t)(i));
+    }
+    for (int i = 0; i < N/100; i++) {
+        double *rect = &zones[i*DIMS*2];
+        rtree_insert(b, rect, rect+DIMS, (void *)(uintptr_t)(i));
+    }
+    int searched = 0;
+    bench("search-each", N, {
+        double *rect = &parcels[i*DIMS*2];
+        rtree_search(b, rect, rect+DIMS, search_iter, &searched);
+    });
+    int joined = 0;
+    bench("join", 1, {
+        rtree_join(a, b, join_iter, &joined);
+    });
+    assert(joined == searched);
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = nprocs < 1 ? 1 : nprocs > 64 ? 64 : (int)nprocs;
+    int counts[64] = { 0 };
+    void *udatas[64];
+    for (int i = 0; i < 64; i++) {
+        udatas[i] = &counts[i];
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "join-%dt", nthreads);
+    bench(name, 1, {
+        assert(rtree_join_parallel(a, b, nthreads, join_iter, udatas));
+    });
+    joined = 0;
+    bench("self-join", 1, {
+        rtree_self_join(a, join_iter, &joined);
+    });
+    snprintf(name, sizeof(name), "self-join-%dt", nthreads);
+    bench(name, 1, {
+        assert(rtree_join_parallel(a, NULL, nthreads, join_iter, udatas));
+    });
+    rtree_free(a);
+    rtree_free(b);
+    free(parcels);
+    free(zones);
+}
+
+struct trace_op {
+    int op;
+    double min[DIMS];
+    double max[DIMS];
+    const void *data;
+};
+
+struct trace_ops {
+    struct trace_op *ops;
+    int len;
+    int cap;
+};
+
+static bool trace_load_iter(int op, const double *min, const double *max,
+    const void *data, void *udata)
+{
+    struct trace_ops *ops = udata;
+    if (ops->len == ops->cap) {
+        ops->cap = ops->cap == 0 ? 1024 : ops->cap*2;
+        ops->ops = realloc(ops->ops, sizeof(struct trace_op)*ops->cap);
+        assert(ops->ops);
+    }
+    struct trace_op *top = &ops->ops[ops->len++];
+    top->op = op;
+    memcpy(top->min, min, sizeof(double)*DIMS);
+    memcpy(top->max, max, sizeof(double)*DIMS);
+    top->data = data;
+    return true;
+}
+
+// test_trace_replay replays a trace recorded with rtree_trace_start on a
+// fresh rtree, and reports the latencies of each kind of operation.
+void test_trace_replay(const char *path) {
+    printf("-- REPLAY %s --\n", path);
+    struct trace_ops ops = { 0 };
+    if (!rtree_trace_read(path, trace_load_iter, &ops)) {
+        fprintf(stderr, "%s: cannot read trace (recorded with other DIMS?)\n",
+            path);
+        exit(1);
+    }
+    const char *names[3] = { "insert", "delete", "search" };
+    float *lats[3];
+    int nlats[3] = { 0 };
+    int nops[3] = { 0 };
+    for (int k = 0; k < 3; k++) {
+        lats[k] = malloc(sizeof(float)*(ops.len+1));
+        assert(lats[k]);
+    }
+    struct rtree *tr = rtree_new_with_allocator(xmalloc, xfree);
+    int count = 0;
+    int nsampled = 0;
+    uint64_t sampled = 0;
+    uint64_t begin = nanotime();
+    for (int i = 0; i < ops.len; i++) {
+        struct trace_op *top = &ops.ops[i];
+        int k = top->op == RTREE_TRACE_INSERT ? 0 :
+            top->op == RTREE_TRACE_DELETE ? 1 : 2;
+        // Each kind of op is sampled on its own, so that none is missed by
+        // a trace that repeats in steps.
+        bool sample = nops[k]%BENCH_SAMPLE == 0;
+        nops[k]++;
+        uint64_t opbegin = sample ? nanotime() : 0;
+        switch (k) {
+        case 0:
+            rtree_insert(tr, top->min, top->max, top->data);
+            break;
+        case 1:
+            rtree_delete(tr, top->min, top->max, top->data);
+            break;
+        default:
+            rtree_search(tr, top->min, top->max, search_iter, &count);
+        }
+        if (sample) {
+            uint64_t opend = nanotime();
+            lats[k][nlats[k]++] = (float)(opend-opbegin);
+            sampled += opend-opbegin;
+            nsampled++;
+        }
+    }
+    uint64_t end = nanotime();
+    double ns_op = ops.len > nsampled ?
+        (double)(end-begin-sampled)/(double)(ops.len-nsampled) :
+        (double)sampled/(double)(nsampled > 0 ? nsampled : 1);
+    double elapsed_secs = ns_op*(double)ops.len/1e9;
+    char *pops = commaize(ops.len);
+    char *psec = commaize((double)ops.len/elapsed_secs);
+    printf("%-14s %10s ops in %.3f secs %8.1f ns/op %11s op/sec\n", "total",
+        pops, elapsed_secs, ns_op, psec);
+    free(psec);
+    free(pops);
+    bench_workload = "replay";
+    for (int k = 0; k < 3; k++) {
+        if (nlats[k] > 0) {
+            // Each kind of op is only timed by its samples.
+            double secs = 0;
+            for (int i = 0; i < nlats[k]; i++) {
+                secs += lats[k][i]/1e9;
+            }
+            secs = secs/(double)nlats[k]*(double)nops[k];
+            pops = commaize(nops[k]);
+            printf("%-14s %10s ops %8.1f ns/op", names[k], pops, 
+                secs/(double)nops[k]*1e9);
+            free(pops);
+            bench_report(names[k], nops[k], secs, lats[k], nlats[k]);
+            printf("\n");
+        }
+        free(lats[k]);
+    }
+    rtree_free(tr);
+    free(ops.ops);
+}
+
 int main() {
     int seed = getenv("SEED")?atoi(getenv("SEED")):time(NULL);
     int N = getenv("N")?atoi(getenv("N")):1000000;
-    printf("seed=%d, count=%d\n", seed, N);
+    printf("seed=%d, count=%d, dims=%d\n", seed, N, DIMS);
     srand(seed);
+    if (getenv("JSON")) {
+        bench_json = fopen(getenv("JSON"), "a");
+        assert(bench_json);
+    }
 
     init_test_allocator(false);
+    if (getenv("TRACE")) {
+        test_trace_replay(getenv("TRACE"));
+        cleanup_test_allocator();
+        return 0;
+    }
+#if DIMS == 2
+    bench_workload = "random";
     test_rand_bench(false, N);
+    bench_workload = "hilbert";
     test_rand_bench(true, N);
+    bench_workload = "journal";
+    test_journal_bench(N);
+#endif
+    test_workload_bench("uniform", UNIFORM, false, N);
+    test_workload_bench("clustered", CLUSTERED, false, N);
+    test_workload_bench("skewed", SKEWED, false, N);
+    test_workload_bench("rects", UNIFORM, true, N);
+    test_join_bench(N);
     cleanup_test_allocator();
+    if (bench_json) {
+        fclose(bench_json);
+    }
     return 0;
-}
\ No newline at end of file
+}
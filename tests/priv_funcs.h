@@ -47,6 +47,30 @@ static bool rtree_check_rects(const struct rtree *tr) {
     return true;
 }
 
+static bool node_check_dead(const struct node *node) {
+    size_t dead = 0;
+    for (int i = 0; i < node->count; i++) {
+        if (node->kind == LEAF) {
+            dead += (node->tombs >> i) & 1;
+        } else {
+            if (!node_check_dead(node->children[i])) return false;
+            dead += node->children[i]->dead;
+        }
+    }
+    if (dead != node->dead) {
+        fprintf(stderr, "invalid dead count\n");
+        return false;
+    }
+    return true;
+}
+
+static bool rtree_check_dead(const struct rtree *tr) {
+    if (tr->root) {
+        if (!node_check_dead(tr->root)) return false;
+    }
+    return true;
+}
+
 static bool rtree_check_height(const struct rtree *tr) {
     size_t height = 0;
     struct node *node = tr->root;
@@ -62,10 +86,32 @@ static bool rtree_check_height(const struct rtree *tr) {
     return true;
 }
 
+static bool rtree_check_buffer(const struct rtree *tr) {
+    size_t count = 0;
+    for (int b = 0; b < tr->nbufs; b++) {
+        struct node *leaf = tr->bufs[b];
+        if (leaf->kind != LEAF || leaf->count == 0 || b >= tr->maxbufs) {
+            fprintf(stderr, "invalid buffer leaf\n");
+            return false;
+        }
+        if (!node_check_order(leaf)) return false;
+        if (!node_check_rect(&tr->brects[b], leaf)) return false;
+        if (!node_check_dead(leaf)) return false;
+        count += (size_t)leaf->count - leaf->dead;
+    }
+    if (count != tr->bcount) {
+        fprintf(stderr, "invalid buffer count\n");
+        return false;
+    }
+    return true;
+}
+
 bool rtree_check(const struct rtree *tr) {
     if (!rtree_check_order(tr)) return false;
     if (!rtree_check_rects(tr)) return false;
     if (!rtree_check_height(tr)) return false;
+    if (!rtree_check_dead(tr)) return false;
+    if (!rtree_check_buffer(tr)) return false;
     return true;
 }
 
@@ -21,6 +21,7 @@ if [[ "$1" != "bench" ]]; then
     CFLAGS="-O0 -g3 -Wall -Wextra -fstrict-aliasing $CFLAGS"
     if [[ ("$CC" == "" || "$CC" == "clang") && "`which clang`" != "" ]]; then
         CC=clang
+        CXX=${CXX:-clang++}
         CFLAGS="$CFLAGS -fno-omit-frame-pointer"
         CFLAGS="$CFLAGS -fprofile-instr-generate"
         CFLAGS="$CFLAGS -fcoverage-mapping"
@@ -48,14 +49,27 @@ else
 fi
 CFLAGS="$CFLAGS -DTEST_PRIVATE_FUNCTIONS -DTEST_DEBUG"
 CC=${CC:-cc}
+CXX=${CXX:-c++}
 echo "CC: $CC"
 echo "CFLAGS: $CFLAGS"
 $CC --version
 
 if [[ "$1" == "bench" ]]; then
     echo "BENCHMARKING..."
-    echo $CC $CFLAGS ../rtree.c bench.c
-    $CC $CFLAGS ../rtree.c bench.c
+    # JSON=<path> writes the results as json lines to the file.
+    # TRACE=<path> replays a trace from rtree_trace_start instead.
+    if [[ "$TRACE" != "" ]]; then
+        TRACE=$(realpath "$TRACE")
+    fi
+    if [[ "$JSON" != "" ]]; then
+        rm -f "$JSON"
+    fi
+    echo $CC $CFLAGS ../rtree.c bench.c -lm
+    $CC $CFLAGS ../rtree.c bench.c -lm
+    ./a.out $@
+    if [[ "$TRACE" != "" ]]; then exit; fi
+    echo $CC $CFLAGS -DDIMS=3 ../rtree.c bench.c -lm
+    $CC $CFLAGS -DDIMS=3 ../rtree.c bench.c -lm
     ./a.out $@
 else
     echo "For benchmarks: 'run.sh bench'"
@@ -64,7 +78,7 @@ else
     fi
     echo "TESTING..."
     for f in *; do 
-        if [[ "$f" != test_*.c ]]; then continue; fi 
+        if [[ "$f" != test_*.c && "$f" != test_*.cpp ]]; then continue; fi 
         if [[ "$1" == test_* ]]; then 
             p=$1
             if [[ "$1" == test_*_* ]]; then
@@ -76,13 +90,29 @@ else
             fi 
             if [[ "$f" != $p* ]]; then continue; fi
         fi
-        $CC $CFLAGS -o $f.test ../rtree.c $f
+        if [[ "$f" == *.cpp ]]; then
+            # rtree.hpp is header-only
+            $CXX $CFLAGS -std=c++11 -o $f.test $f
+        else
+            $CC $CFLAGS -o $f.test ../rtree.c $f
+        fi
         if [[ "$WITHCOV" == "1" ]]; then
             MallocNanoZone=0 LLVM_PROFILE_FILE="$f.profraw" ./$f.test $@
         else
             ./$f.test $@
         fi
     done
+    # The query stats are only counted in an instrumented build.
+    if [[ "test_rtree_query_stats" == *"$1"* ]]; then
+        $CC $CFLAGS -DRTREE_INSTRUMENT -o instrument.test ../rtree.c \
+            test_rtree.c
+        if [[ "$WITHCOV" == "1" ]]; then
+            MallocNanoZone=0 LLVM_PROFILE_FILE="instrument.profraw" \
+                ./instrument.test test_rtree_query_stats
+        else
+            ./instrument.test test_rtree_query_stats
+        fi
+    fi
     echo "OK"
 
     if [[ "$COVREGIONS" == "" ]]; then 
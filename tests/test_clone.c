@@ -525,6 +525,144 @@ void test_clone_threads(void) {
     rtree_free(rtree2);
 }
 
+struct lazy_ctx {
+    struct pair **pairs;
+    bool *live;
+    const double *min;  // the search rect, or NULL for a scan
+    const double *max;
+    size_t count;
+};
+
+bool lazy_iter(const double *min, const double *max, const void *data, 
+    void *udata)
+{
+    struct lazy_ctx *ctx = udata;
+    const struct pair *pair = data;
+    assert(ctx->live[pair->val]);
+    assert(memcmp(pair, ctx->pairs[pair->val], sizeof(struct pair)) == 0);
+    assert(memcmp(min, pair->min, sizeof(double)*2) == 0);
+    assert(memcmp(max, pair->max, sizeof(double)*2) == 0);
+    ctx->count++;
+    return true;
+}
+
+// lazy_check checks that the searches and scans of the rtree see exactly 
+// the live pairs.
+void lazy_check(struct rtree *tr, struct pair **pairs, bool *live, size_t n) {
+    struct lazy_ctx ctx = { .pairs = pairs, .live = live };
+    rtree_scan(tr, lazy_iter, &ctx);
+    assert(ctx.count == rtree_count(tr));
+    for (int i = 0; i < 50; i++) {
+        struct rect r = rand_rect();
+        r.max[0] += rand_double()*60;
+        r.max[1] += rand_double()*60;
+        size_t expect = 0, expect_contained = 0;
+        for (size_t j = 0; j < n; j++) {
+            if (!live[j]) continue;
+            struct pair *p = pairs[j];
+            if (!(p->min[0] > r.max[0] || p->max[0] < r.min[0] ||
+                  p->min[1] > r.max[1] || p->max[1] < r.min[1]))
+            {
+                expect++;
+            }
+            if (p->min[0] >= r.min[0] && p->max[0] <= r.max[0] &&
+                p->min[1] >= r.min[1] && p->max[1] <= r.max[1])
+            {
+                expect_contained++;
+            }
+        }
+        ctx.count = 0;
+        rtree_search(tr, r.min, r.max, lazy_iter, &ctx);
+        assert(ctx.count == expect);
+        ctx.count = 0;
+        rtree_search_contained(tr, r.min, r.max, lazy_iter, &ctx);
+        assert(ctx.count == expect_contained);
+    }
+    assert(rtree_check(tr));
+}
+
+void test_clone_lazy(void) {
+    size_t N = 10000;
+    struct pair **pairs;
+    bool *live, *live2;
+    while (!(pairs = xmalloc(sizeof(struct pair*) * N)));
+    while (!(live = xmalloc(sizeof(bool) * N)));
+    while (!(live2 = xmalloc(sizeof(bool) * N)));
+    for (size_t i = 0; i < N; i++) {
+        while (!(pairs[i] = xmalloc(sizeof(struct pair))));
+        fill_rand_rect(&pairs[i]->min[0]);
+        pairs[i]->val = i;
+        live[i] = live2[i] = true;
+    }
+    struct rtree *tr;
+    int udata = 9876;
+    while(!(tr = rtree_new_with_allocator(xmalloc, xfree)));
+    rtree_set_udata(tr, &udata);
+    rtree_set_item_callbacks(tr, pair_clone, pair_free);
+    for (size_t i = 0; i < N; i++) {
+        while(!(rtree_insert(tr, pairs[i]->min, pairs[i]->max, pairs[i])));
+    }
+    rtree_set_lazy_delete(tr, true);
+    struct rtree *tr2;
+    while(!(tr2 = rtree_clone(tr)));
+
+    // delete 30% lazily, which the clone must not see
+    size_t ndead = 0;
+    for (size_t i = 0; i < N; i++) {
+        if (i%10 < 3) {
+            for (int j = 0; j < 2; j++) {
+                while(!(rtree_delete_with_comparator(tr, pairs[i]->min, 
+                    pairs[i]->max, pairs[i], pair_compare, NULL)));
+            }
+            live[i] = false;
+            ndead++;
+        }
+    }
+    struct rtree_stats stats;
+    rtree_stats(tr, &stats);
+    assert(stats.dead == ndead);
+    assert(stats.count == N-ndead);
+    lazy_check(tr, pairs, live, N);
+    lazy_check(tr2, pairs, live2, N);
+
+    // insert them again, splitting leaves with tombstones, and delete some 
+    // for real
+    for (size_t i = 0; i < N; i++) {
+        if (!live[i]) {
+            while(!(rtree_insert(tr, pairs[i]->min, pairs[i]->max, 
+                pairs[i])));
+            live[i] = true;
+        }
+    }
+    rtree_set_lazy_delete(tr, false);
+    for (size_t i = 5; i < N; i += 10) {
+        while(!(rtree_delete_with_comparator(tr, pairs[i]->min, 
+            pairs[i]->max, pairs[i], pair_compare, NULL)));
+        live[i] = false;
+    }
+    rtree_stats(tr, &stats);
+    assert(stats.dead == ndead);
+    lazy_check(tr, pairs, live, N);
+
+    // compact a few leaves at a time
+    do {
+        while (!rtree_compact(tr, 8));
+        rtree_stats(tr, &stats);
+        assert(rtree_check(tr));
+    } while (stats.dead > 0);
+    assert(stats.count == N-N/10);
+    lazy_check(tr, pairs, live, N);
+    lazy_check(tr2, pairs, live2, N);
+    rtree_free(tr);
+    rtree_free(tr2);
+    for (size_t i = 0; i < N; i++) {
+        xfree(pairs[i]);
+    }
+    xfree(pairs);
+    xfree(live);
+    xfree(live2);
+}
+
 int main(int argc, char **argv) {
     do_chaos_test(test_clone_items);
     do_chaos_test(test_clone_items_nocallbacks);
@@ -532,6 +670,7 @@ int main(int argc, char **argv) {
     do_chaos_test(test_clone_delete_nocallbacks);
     do_chaos_test(test_clone_pairs_diverge);
     do_chaos_test(test_clone_pairs_diverge_nocallbacks);
+    do_chaos_test(test_clone_lazy);
     // do_chaos_test(test_clone_pop);
     // do_chaos_test(test_clone_pop_nocallbacks);
 
@@ -0,0 +1,151 @@
+// An rtree with 32-bit integer coordinates is compiled into this file with
+// the tile_ prefix and checked against brute force. test_uint.c includes
+// this file again for unsigned coordinates.
+
+#include <stdint.h>
+
+#ifdef RTREE_UINT32
+#define UNSIGNED
+typedef uint32_t num_t;
+#define NUM_MAX UINT32_MAX
+#else
+#define RTREE_INT32
+typedef int32_t num_t;
+#define NUM_MAX INT32_MAX
+#endif
+#define RTREE_PREFIX tile_
+#include "../rtree.c"
+
+#include <time.h>
+
+static num_t rand_num(void) {
+    uint32_t v = ((uint32_t)rand()<<16) ^ (uint32_t)rand();
+    switch (rand()%8) {
+    case 0: return (num_t)v | (num_t)0x80000000;  // the far low or high end
+    case 1: return (num_t)0x7FFFFFF0 + (num_t)(v%16);
+    default: return (num_t)v;
+    }
+}
+
+static void rand_tile(struct rect *rect) {
+    for (int i = 0; i < DIMS; i++) {
+        num_t a = rand_num();
+        int64_t b = rand()%4 ? (int64_t)a + rand()%1000 : (int64_t)rand_num();
+        if (b < a) b = a;
+        if (b > NUM_MAX) b = NUM_MAX;
+        rect->min[i] = a;
+        rect->max[i] = (num_t)b;
+    }
+}
+
+static bool tile_intersects(const struct rect *a, const struct rect *b) {
+    for (int i = 0; i < DIMS; i++) {
+        if (a->min[i] > b->max[i] || a->max[i] < b->min[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool tile_contains(const struct rect *a, const struct rect *b) {
+    for (int i = 0; i < DIMS; i++) {
+        if (b->min[i] < a->min[i] || b->max[i] > a->max[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool tile_count_iter(const num_t *min, const num_t *max,
+    const void *data, void *udata)
+{
+    (void)min; (void)max; (void)data;
+    (*(int*)udata)++;
+    return true;
+}
+
+void test_int_rects(void) {
+    // the kernels against the plain loops
+    for (int i = 0; i < 100000; i++) {
+        struct rect a, b;
+        rand_tile(&a);
+        rand_tile(&b);
+        if (i%4 == 0) {
+            b = a;
+            b.max[i%DIMS] = a.min[i%DIMS];
+        }
+        assert(rect_intersects(&a, &b) == tile_intersects(&a, &b));
+        assert(rect_contains(&a, &b) == tile_contains(&a, &b));
+    }
+    // the areas of the widest rects are exact
+    struct rect full, point;
+    for (int i = 0; i < DIMS; i++) {
+#ifdef UNSIGNED
+        full.min[i] = 0;
+        full.max[i] = UINT32_MAX;
+#else
+        full.min[i] = INT32_MIN;
+        full.max[i] = INT32_MAX;
+#endif
+        point.min[i] = point.max[i] = full.max[i];
+    }
+    assert(rect_area(&full) == (area_t)UINT32_MAX*UINT32_MAX);
+    assert(rect_area(&point) == 0);
+    struct rect line = point;
+    line.min[0] = full.min[0];
+    assert(rect_unioned_area(&line, &point) == 0);
+    line.min[1] = full.max[1]-1;
+    assert(rect_unioned_area(&line, &point) == (area_t)UINT32_MAX);
+    assert(rect_unioned_area(&point, &full) == rect_area(&full));
+}
+
+void test_int_ops(void) {
+    int N = 5000;
+    struct rect *rects = malloc(sizeof(struct rect)*N);
+    assert(rects);
+    struct tile_rtree *tr = tile_rtree_new();
+    assert(tr);
+    for (int i = 0; i < N; i++) {
+        rand_tile(&rects[i]);
+        assert(tile_rtree_insert(tr, rects[i].min, rects[i].max,
+            (void*)(uintptr_t)i));
+    }
+    assert(tile_rtree_check(tr));
+    for (int i = 0; i < 200; i++) {
+        struct rect win;
+        rand_tile(&win);
+        int expect = 0, expect_contained = 0;
+        for (int j = 0; j < N; j++) {
+            expect += tile_intersects(&rects[j], &win);
+            expect_contained += tile_contains(&win, &rects[j]);
+        }
+        int count = 0;
+        tile_rtree_search(tr, win.min, win.max, tile_count_iter, &count);
+        assert(count == expect);
+        count = 0;
+        tile_rtree_search_contained(tr, win.min, win.max, tile_count_iter,
+            &count);
+        assert(count == expect_contained);
+    }
+    for (int i = 0; i < N; i += 2) {
+        assert(tile_rtree_delete(tr, rects[i].min, rects[i].max,
+            (void*)(uintptr_t)i));
+    }
+    assert(tile_rtree_count(tr) == (size_t)N/2);
+    assert(tile_rtree_check(tr));
+    tile_rtree_free(tr);
+    free(rects);
+}
+
+int main(int argc, char **argv) {
+    srand(getenv("SEED") ? atoi(getenv("SEED")) : time(NULL));
+    if (argc < 2 || strstr("test_int_rects", argv[1])) {
+        printf("test_int_rects\n");
+        test_int_rects();
+    }
+    if (argc < 2 || strstr("test_int_ops", argv[1])) {
+        printf("test_int_ops\n");
+        test_int_ops();
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+// A 3D float rtree with the vox3d_ prefix is compiled into this file and
+// linked with the default 2D double rtree from ../rtree.c. This file cannot
+// use tests.h, which has its own struct rect.
+
+#define RTREE_PREFIX vox3d_
+#define RTREE_NUMTYPE float
+#define DIMS 3
+#include "../rtree.c"
+#undef DIMS
+
+#include <time.h>
+#include "../rtree.h"
+
+bool rtree_check(struct rtree *tr);
+
+static float rand_float(void) {
+    return (float)rand() / (float)RAND_MAX * 100;
+}
+
+struct box {
+    float min[3];
+    float max[3];
+};
+
+static bool box_intersects(const struct box *a, const float *min,
+    const float *max)
+{
+    for (int i = 0; i < 3; i++) {
+        if (a->min[i] > max[i] || a->max[i] < min[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool count_vox3d_iter(const float *min, const float *max,
+    const void *data, void *udata)
+{
+    (void)min; (void)max; (void)data;
+    (*(int*)udata)++;
+    return true;
+}
+
+static bool count_iter(const double *min, const double *max,
+    const void *data, void *udata)
+{
+    (void)min; (void)max; (void)data;
+    (*(int*)udata)++;
+    return true;
+}
+
+void test_prefix_instances(void) {
+    int N = 5000;
+    struct box *boxes = malloc(sizeof(struct box)*N);
+    assert(boxes);
+    struct vox3d_rtree *vox = vox3d_rtree_new();
+    struct rtree *geo = rtree_new();
+    assert(vox && geo);
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < 3; j++) {
+            boxes[i].min[j] = rand_float();
+            boxes[i].max[j] = boxes[i].min[j] + rand_float() / 20;
+        }
+        assert(vox3d_rtree_insert(vox, boxes[i].min, boxes[i].max,
+            (void*)(uintptr_t)i));
+        double min[2] = { boxes[i].min[0], boxes[i].min[1] };
+        double max[2] = { boxes[i].max[0], boxes[i].max[1] };
+        assert(rtree_insert(geo, min, max, (void*)(uintptr_t)i));
+    }
+    assert(vox3d_rtree_count(vox) == (size_t)N);
+    assert(rtree_count(geo) == (size_t)N);
+    assert(vox3d_rtree_check(vox));
+    assert(rtree_check(geo));
+    for (int i = 0; i < 100; i++) {
+        float min[3], max[3];
+        for (int j = 0; j < 3; j++) {
+            min[j] = rand_float();
+            max[j] = min[j] + 10;
+        }
+        int expect3 = 0, expect2 = 0;
+        for (int k = 0; k < N; k++) {
+            if (box_intersects(&boxes[k], min, max)) {
+                expect3++;
+            }
+            float min2[3] = { min[0], min[1], -1 };
+            float max2[3] = { max[0], max[1], 1000 };
+            if (box_intersects(&boxes[k], min2, max2)) {
+                expect2++;
+            }
+        }
+        int count3 = 0;
+        vox3d_rtree_search(vox, min, max, count_vox3d_iter, &count3);
+        assert(count3 == expect3);
+        int count2 = 0;
+        double dmin[2] = { min[0], min[1] };
+        double dmax[2] = { max[0], max[1] };
+        rtree_search(geo, dmin, dmax, count_iter, &count2);
+        assert(count2 == expect2);
+    }
+    struct vox3d_rtree_stats stats;
+    vox3d_rtree_stats(vox, &stats);
+    assert(stats.count == (size_t)N);
+    for (int i = 0; i < N; i += 2) {
+        assert(vox3d_rtree_delete(vox, boxes[i].min, boxes[i].max,
+            (void*)(uintptr_t)i));
+    }
+    assert(vox3d_rtree_count(vox) == (size_t)N/2);
+    assert(vox3d_rtree_check(vox));
+    vox3d_rtree_free(vox);
+    rtree_free(geo);
+    free(boxes);
+}
+
+int main(int argc, char **argv) {
+    srand(getenv("SEED") ? atoi(getenv("SEED")) : time(NULL));
+    if (argc < 2 || strstr("test_prefix_instances", argv[1])) {
+        printf("test_prefix_instances\n");
+        test_prefix_instances();
+    }
+    return 0;
+}
@@ -247,6 +247,1611 @@ void test_rtree_ops(void) {
     xfree(coords);
 }
 
+struct rtree *journal_recover(const char *snap, const char *path) {
+    // A replay starts over on failure, so don't let it run out of memory
+    // over and over.
+    bool fail = rand_alloc_fail;
+    rand_alloc_fail = false;
+    struct rtree *tr = rtree_new_with_allocator(xmalloc, xfree);
+    assert(tr);
+    assert(rtree_journal_open(tr, snap, path, 64));
+    assert(rtree_check(tr));
+    rand_alloc_fail = fail;
+    return tr;
+}
+
+void test_rtree_journal(void) {
+    const char *snap = "journal.snap";
+    const char *path = "journal.log";
+    remove(snap);
+    remove(path);
+    int N = 10000;
+    double *coords;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+    }
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    // the items of an rtree that isn't empty would never be journaled
+    while (!rtree_insert(tr, &coords[0], &coords[2], NULL)){}
+    assert(!rtree_journal_open(tr, snap, path, 64));
+    assert(rtree_count(tr) == 1);
+    while (!rtree_delete(tr, &coords[0], &coords[2], NULL)){}
+    while (!rtree_journal_open(tr, snap, path, 64)){}
+    assert(rtree_count(tr) == 0);
+    for (int i = 0; i < N; i++) {
+        void *data = (void *)(uintptr_t)i;
+        while (!rtree_insert(tr, &coords[i*4+0], &coords[i*4+2], data)){}
+        if (i == N/2) {
+            while (!rtree_journal_checkpoint(tr)){}
+        }
+    }
+    for (int i = 0; i < N; i += 3) {
+        void *data = (void *)(uintptr_t)i;
+        while (!rtree_delete(tr, &coords[i*4+0], &coords[i*4+2], data)){}
+    }
+    assert(rtree_journal_sync(tr));
+
+    // Recover into a new rtree while the first one is still open, which is
+    // the same as if the program had crashed right after the sync.
+    struct rtree *tr2 = journal_recover(snap, path);
+    assert(rtree_count(tr2) == rtree_count(tr));
+    for (int i = 0; i < N; i++) {
+        void *data = (void *)(uintptr_t)i;
+        assert(find_one(tr2, &coords[i*4+0], &coords[i*4+2], data, NULL, 
+            NULL) == (i%3 != 0));
+    }
+    assert(rtree_journal_close(tr2));
+    rtree_free(tr2);
+
+    // A torn record at the tail of the journal is ignored.
+    FILE *f = fopen(path, "ab");
+    assert(f);
+    assert(fwrite("torn", 4, 1, f) == 1);
+    fclose(f);
+    tr2 = journal_recover(snap, path);
+    assert(rtree_count(tr2) == rtree_count(tr));
+    rtree_free(tr2);
+
+    // Operations after a checkpoint go to the new journal.
+    while (!rtree_journal_checkpoint(tr)){}
+    for (int i = 0; i < N; i += 3) {
+        void *data = (void *)(uintptr_t)i;
+        while (!rtree_insert(tr, &coords[i*4+0], &coords[i*4+2], data)){}
+    }
+    rtree_free(tr);
+    tr2 = journal_recover(snap, path);
+    assert(rtree_count(tr2) == (size_t)N);
+    rtree_free(tr2);
+
+    remove(snap);
+    remove(path);
+    xfree(coords);
+}
+
+struct trace_read_ctx {
+    int count;
+    int ops[3];
+    bool ordered;
+};
+
+bool trace_read_iter(int op, const double *min, const double *max,
+    const void *data, void *udata)
+{
+    (void)min; (void)max;
+    struct trace_read_ctx *ctx = udata;
+    int i = (int)(uintptr_t)data;
+    switch (op) {
+    case RTREE_TRACE_INSERT:
+        ctx->ordered = ctx->ordered && ctx->ops[1] == 0 && i == ctx->ops[0];
+        ctx->ops[0]++;
+        break;
+    case RTREE_TRACE_DELETE:
+        ctx->ordered = ctx->ordered && ctx->ops[2] == 0 && i == ctx->ops[1]*2;
+        ctx->ops[1]++;
+        break;
+    case RTREE_TRACE_SEARCH:
+        ctx->ordered = ctx->ordered && data == NULL;
+        ctx->ops[2]++;
+        break;
+    default:
+        ctx->ordered = false;
+    }
+    ctx->count++;
+    return true;
+}
+
+void test_rtree_trace(void) {
+    const char *path = "trace.out";
+    remove(path);
+    int N = 10000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_trace_start(tr, path)){}
+    assert(!rtree_trace_start(tr, path));
+    struct rect *rects;
+    while (!(rects = xmalloc(sizeof(struct rect)*N))) {}
+    for (int i = 0; i < N; i++) {
+        rects[i] = rand_rect();
+        while (!rtree_insert(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    for (int i = 0; i < N; i += 2) {
+        while (!rtree_delete(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    // Searches on clones are recorded to the same trace.
+    struct rtree *tr2;
+    while (!(tr2 = rtree_clone(tr))){}
+    for (int i = 0; i < 100; i++) {
+        struct iter_scan_all_ctx ctx = { 0 };
+        rtree_search(i%2?tr:tr2, rects[i].min, rects[i].max, iter_scan_all,
+            &ctx);
+    }
+    assert(rtree_trace_stop(tr));
+    // The trace stays open until the clone is freed too.
+    rtree_free(tr2);
+    rtree_free(tr);
+
+    struct trace_read_ctx ctx = { .ordered = true };
+    assert(rtree_trace_read(path, trace_read_iter, &ctx));
+    assert(ctx.ordered);
+    assert(ctx.ops[0] == N && ctx.ops[1] == N/2 && ctx.ops[2] == 100);
+    assert(ctx.count == N+N/2+100);
+    assert(!rtree_trace_read("trace.missing", trace_read_iter, &ctx));
+
+    remove(path);
+    xfree(rects);
+}
+
+struct search_many_ctx {
+    size_t *counts;
+    size_t limit;   // stop each query after this many items, when not zero
+};
+
+bool search_many_iter(int q, const double *min, const double *max, 
+    const void *data, void *udata)
+{
+    (void)min; (void)max; (void)data;
+    struct search_many_ctx *ctx = udata;
+    ctx->counts[q]++;
+    return ctx->limit == 0 || ctx->counts[q] < ctx->limit;
+}
+
+void test_rtree_search_many(void) {
+    int N = 10000;
+    int Q = 500;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    for (int i = 0; i < N; i++) {
+        struct rect rect = rand_rect();
+        while (!rtree_insert(tr, rect.min, rect.max, (void *)(uintptr_t)i)){}
+    }
+    double *queries;
+    size_t *expect;
+    size_t *counts;
+    while (!(queries = xmalloc(sizeof(double)*Q*4))) {}
+    while (!(expect = xmalloc(sizeof(size_t)*Q))) {}
+    while (!(counts = xmalloc(sizeof(size_t)*Q))) {}
+    // wide queries walk the tree together, and small scattered ones alone
+    for (int grow = 20; grow >= 0; grow -= 20) {
+        for (int q = 0; q < Q; q++) {
+            fill_rand_rect(&queries[q*4]);
+            queries[q*4+2] += rand_double()*grow;
+            queries[q*4+3] += rand_double()*grow;
+            struct iter_scan_all_ctx ctx = { 0 };
+            rtree_search(tr, &queries[q*4], &queries[q*4+2], iter_scan_all, 
+                &ctx);
+            expect[q] = ctx.count;
+        }
+        struct search_many_ctx ctx = { .counts = counts };
+        memset(counts, 0, sizeof(size_t)*Q);
+        while (!rtree_search_many(tr, queries, Q, search_many_iter, &ctx)) {}
+        for (int q = 0; q < Q; q++) {
+            assert(counts[q] == expect[q]);
+        }
+
+        // stopping one query leaves the others running
+        ctx.limit = 3;
+        memset(counts, 0, sizeof(size_t)*Q);
+        while (!rtree_search_many(tr, queries, Q, search_many_iter, &ctx)) {}
+        for (int q = 0; q < Q; q++) {
+            assert(counts[q] == (expect[q] < 3 ? expect[q] : 3));
+        }
+
+        // the pipelined search returns the same items
+        ctx.limit = 0;
+        memset(counts, 0, sizeof(size_t)*Q);
+        rtree_search_pipelined(tr, queries, Q, search_many_iter, &ctx);
+        for (int q = 0; q < Q; q++) {
+            assert(counts[q] == expect[q]);
+        }
+        ctx.limit = 3;
+        memset(counts, 0, sizeof(size_t)*Q);
+        rtree_search_pipelined(tr, queries, Q, search_many_iter, &ctx);
+        for (int q = 0; q < Q; q++) {
+            assert(counts[q] == (expect[q] < 3 ? expect[q] : 3));
+        }
+    }
+
+    rtree_free(tr);
+    xfree(queries);
+    xfree(expect);
+    xfree(counts);
+}
+
+struct search_sum_ctx {
+    size_t count;
+    uint64_t sum;
+};
+
+bool search_sum_iter(const double *min, const double *max, const void *data,
+    void *udata)
+{
+    (void)min; (void)max;
+    struct search_sum_ctx *ctx = udata;
+    ctx->count++;
+    ctx->sum += (uintptr_t)data;
+    return true;
+}
+
+void test_rtree_search_parallel(void) {
+    int N = 20000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    struct search_sum_ctx ctxs[4];
+    void *udatas[4] = { &ctxs[0], &ctxs[1], &ctxs[2], &ctxs[3] };
+    double min[2] = { -100, -50 };
+    double max[2] = { 100, 50 };
+    while (!rtree_search_parallel(tr, min, max, 4, search_sum_iter, udatas)){}
+    for (int i = 0; i < N; i++) {
+        struct rect rect = rand_rect();
+        while (!rtree_insert(tr, rect.min, rect.max, (void *)(uintptr_t)i)){}
+    }
+    double windows[3][4] = {
+        { -100, -50, 100, 50 },     // most of the tree
+        { -200, -100, 200, 100 },   // all of the tree
+        { 10, 10, 12, 12 },         // a few items
+    };
+    for (int w = 0; w < 3; w++) {
+        struct search_sum_ctx expect = { 0 };
+        rtree_search(tr, &windows[w][0], &windows[w][2], search_sum_iter, 
+            &expect);
+        for (int nthreads = 1; nthreads <= 4; nthreads++) {
+            do {
+                memset(ctxs, 0, sizeof(ctxs));
+            } while (!rtree_search_parallel(tr, &windows[w][0], 
+                &windows[w][2], nthreads, search_sum_iter, udatas));
+            struct search_sum_ctx ctx = { 0 };
+            for (int i = 0; i < nthreads; i++) {
+                ctx.count += ctxs[i].count;
+                ctx.sum += ctxs[i].sum;
+            }
+            assert(ctx.count == expect.count && ctx.sum == expect.sum);
+        }
+    }
+    rtree_free(tr);
+}
+
+void test_rtree_search_collect(void) {
+    int N = 10000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    void *items[7];
+    double rects[7*4];
+    double min[2] = { -100, -50 };
+    double max[2] = { 100, 50 };
+    struct rtree_cursor cursor = { 0 };
+    assert(rtree_search_collect(tr, min, max, items, rects, 7, &cursor) == 0);
+    assert(cursor.done);
+    for (int i = 0; i < N; i++) {
+        struct rect rect = rand_rect();
+        while (!rtree_insert(tr, rect.min, rect.max, (void *)(uintptr_t)i)){}
+    }
+    struct search_sum_ctx expect = { 0 };
+    rtree_search(tr, min, max, search_sum_iter, &expect);
+    assert(expect.count > 7);
+    struct search_sum_ctx ctx = { 0 };
+    memset(&cursor, 0, sizeof(cursor));
+    while (!cursor.done) {
+        size_t n = rtree_search_collect(tr, min, max, items, rects, 7, 
+            &cursor);
+        assert(n == 7 || cursor.done);
+        for (size_t i = 0; i < n; i++) {
+            double *rect = &rects[i*4];
+            assert(!(rect[0] > max[0] || rect[2] < min[0] || 
+                rect[1] > max[1] || rect[3] < min[1]));
+            assert(find_one(tr, rect, rect+2, items[i], NULL, NULL));
+            ctx.count++;
+            ctx.sum += (uintptr_t)items[i];
+        }
+    }
+    assert(ctx.count == expect.count && ctx.sum == expect.sum);
+    assert(rtree_search_collect(tr, min, max, items, rects, 7, &cursor) == 0);
+
+    // without rects, in one call
+    void **all;
+    while (!(all = xmalloc(sizeof(void*)*N))) {}
+    memset(&cursor, 0, sizeof(cursor));
+    size_t n = rtree_search_collect(tr, min, max, all, NULL, N, &cursor);
+    assert(cursor.done && n == expect.count);
+    xfree(all);
+    rtree_free(tr);
+}
+
+struct contain_filter_ctx {
+    const double *min;
+    const double *max;
+    bool containing;    // items that contain the rect, else are contained
+    struct search_sum_ctx sum;
+};
+
+bool contain_filter_iter(const double *min, const double *max, 
+    const void *data, void *udata)
+{
+    struct contain_filter_ctx *ctx = udata;
+    for (int i = 0; i < 2; i++) {
+        if (ctx->containing) {
+            if (min[i] > ctx->min[i] || max[i] < ctx->max[i]) return true;
+        } else {
+            if (min[i] < ctx->min[i] || max[i] > ctx->max[i]) return true;
+        }
+    }
+    return search_sum_iter(min, max, data, &ctx->sum);
+}
+
+void test_rtree_search_contain(void) {
+    int N = 10000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    for (int i = 0; i < N; i++) {
+        struct rect rect = rand_rect();
+        rect.max[0] += rand_double()*rand_double()*50;
+        rect.max[1] += rand_double()*rand_double()*50;
+        while (!rtree_insert(tr, rect.min, rect.max, (void *)(uintptr_t)i)){}
+    }
+    size_t total[2] = { 0 };
+    for (int j = 0; j < 200; j++) {
+        struct rect rect = rand_rect();
+        rect.max[0] += rand_double()*(j%2?2:100);
+        rect.max[1] += rand_double()*(j%2?2:100);
+        for (int k = 0; k < 2; k++) {
+            struct contain_filter_ctx expect = { 
+                .min = rect.min, .max = rect.max, .containing = k == 1,
+            };
+            rtree_search(tr, rect.min, rect.max, contain_filter_iter, 
+                &expect);
+            struct search_sum_ctx ctx = { 0 };
+            if (k == 1) {
+                rtree_search_containing(tr, rect.min, rect.max, 
+                    search_sum_iter, &ctx);
+            } else {
+                rtree_search_contained(tr, rect.min, rect.max, 
+                    search_sum_iter, &ctx);
+            }
+            assert(ctx.count == expect.sum.count && 
+                ctx.sum == expect.sum.sum);
+            total[k] += ctx.count;
+        }
+    }
+    assert(total[0] > 0 && total[1] > 0);
+
+    // everything is contained in a window around the whole tree
+    struct search_sum_ctx ctx = { 0 };
+    rtree_search_contained(tr, (double[2]){ -1000, -1000 }, 
+        (double[2]){ 1000, 1000 }, search_sum_iter, &ctx);
+    assert(ctx.count == (size_t)N);
+    rtree_free(tr);
+}
+
+struct band {
+    double lo;
+    double hi;
+    struct search_sum_ctx sum;
+};
+
+// band_relate relates a rect to the diagonal band lo <= x+y <= hi.
+int band_relate(const double *min, const double *max, void *udata) {
+    struct band *band = udata;
+    double lo = min[0]+min[1];
+    double hi = max[0]+max[1];
+    if (hi < band->lo || lo > band->hi) return RTREE_DISJOINT;
+    if (lo >= band->lo && hi <= band->hi) return RTREE_INSIDE;
+    return RTREE_INTERSECTS;
+}
+
+bool band_filter_iter(const double *min, const double *max, const void *data,
+    void *udata)
+{
+    if (band_relate(min, max, udata) == RTREE_DISJOINT) return true;
+    return search_sum_iter(min, max, data, &((struct band *)udata)->sum);
+}
+
+bool band_iter(const double *min, const double *max, const void *data,
+    void *udata)
+{
+    return search_sum_iter(min, max, data, &((struct band *)udata)->sum);
+}
+
+struct radius_filter_ctx {
+    const double *center;
+    double radius;
+    struct search_sum_ctx sum;
+};
+
+bool radius_filter_iter(const double *min, const double *max, 
+    const void *data, void *udata)
+{
+    struct radius_filter_ctx *ctx = udata;
+    double dist = 0;
+    for (int i = 0; i < 2; i++) {
+        double c = ctx->center[i];
+        double d = c < min[i] ? min[i]-c : c > max[i] ? c-max[i] : 0;
+        dist += d*d;
+    }
+    if (dist > ctx->radius*ctx->radius) return true;
+    return search_sum_iter(min, max, data, &ctx->sum);
+}
+
+void test_rtree_search_custom(void) {
+    int N = 10000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    for (int i = 0; i < N; i++) {
+        struct rect rect = rand_rect();
+        while (!rtree_insert(tr, rect.min, rect.max, (void *)(uintptr_t)i)){}
+    }
+    size_t total = 0;
+    for (int j = 0; j < 100; j++) {
+        // radius
+        struct rect rect = rand_rect();
+        double radius = rand_double()*30;
+        struct radius_filter_ctx expect = { .center = rect.min, 
+            .radius = radius };
+        rtree_search(tr, (double[2]){ rect.min[0]-radius, rect.min[1]-radius },
+            (double[2]){ rect.min[0]+radius, rect.min[1]+radius }, 
+            radius_filter_iter, &expect);
+        struct search_sum_ctx ctx = { 0 };
+        rtree_search_radius(tr, rect.min, radius, search_sum_iter, &ctx);
+        assert(ctx.count == expect.sum.count && ctx.sum == expect.sum.sum);
+        total += ctx.count;
+
+        // custom band
+        struct band band = { .lo = rand_double()*400-200 };
+        band.hi = band.lo + rand_double()*20;
+        struct band band2 = band;
+        rtree_scan(tr, band_filter_iter, &band);
+        rtree_search_custom(tr, band_relate, NULL, band_iter, &band2);
+        assert(band.sum.count == band2.sum.count && 
+            band.sum.sum == band2.sum.sum);
+        total += band.sum.count;
+    }
+    assert(total > 0);
+    rtree_free(tr);
+}
+
+struct raycast_ctx {
+    const double *origin;
+    const double *dir;
+    size_t count;
+    double tmin;    // the nearest hit
+    double last;    // the previous t, to check the order
+    bool first;     // stop at the first hit
+};
+
+// ray_entry returns where the ray from origin along dir enters the rect, or
+// -1 if it misses it before t=1.
+double ray_entry(const double *origin, const double *dir, const double *min,
+    const double *max)
+{
+    double tnear = 0;
+    double tfar = 1;
+    for (int i = 0; i < 2; i++) {
+        if (dir[i] == 0) {
+            if (origin[i] < min[i] || origin[i] > max[i]) return -1;
+            continue;
+        }
+        double t1 = (min[i]-origin[i])/dir[i];
+        double t2 = (max[i]-origin[i])/dir[i];
+        if (t1 > t2) { double t = t1; t1 = t2; t2 = t; }
+        if (t1 > tnear) tnear = t1;
+        if (t2 < tfar) tfar = t2;
+    }
+    return tnear > tfar ? -1 : tnear;
+}
+
+bool raycast_scan_iter(const double *min, const double *max, const void *data,
+    void *udata)
+{
+    (void)data;
+    struct raycast_ctx *ctx = udata;
+    double t = ray_entry(ctx->origin, ctx->dir, min, max);
+    if (t >= 0) {
+        ctx->count++;
+        if (t < ctx->tmin) ctx->tmin = t;
+    }
+    return true;
+}
+
+bool raycast_iter(const double *min, const double *max, const void *data,
+    double t, void *udata)
+{
+    (void)data;
+    struct raycast_ctx *ctx = udata;
+    assert(t >= ctx->last);
+    assert(t == ray_entry(ctx->origin, ctx->dir, min, max));
+    ctx->last = t;
+    if (ctx->count == 0) ctx->tmin = t;
+    ctx->count++;
+    return !ctx->first;
+}
+
+void test_rtree_raycast(void) {
+    int N = 10000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    for (int i = 0; i < N; i++) {
+        struct rect rect = rand_rect();
+        while (!rtree_insert(tr, rect.min, rect.max, (void *)(uintptr_t)i)){}
+    }
+    size_t total = 0;
+    for (int j = 0; j < 100; j++) {
+        struct rect a = rand_rect();
+        struct rect b = rand_rect();
+        double dir[2] = { b.min[0]-a.min[0], b.min[1]-a.min[1] };
+        if (j%10 == 0) {
+            dir[j%20 == 0] = 0; // axis aligned
+        }
+        struct raycast_ctx expect = { .origin = a.min, .dir = dir, 
+            .tmin = 2 };
+        rtree_scan(tr, raycast_scan_iter, &expect);
+        struct raycast_ctx ctx = { .origin = a.min, .dir = dir };
+        while (!rtree_raycast(tr, a.min, dir, 1, raycast_iter, &ctx)) {
+            memset(&ctx, 0, sizeof(ctx));
+            ctx.origin = a.min;
+            ctx.dir = dir;
+        }
+        assert(ctx.count == expect.count);
+        if (expect.count > 0) {
+            assert(ctx.tmin == expect.tmin);
+            memset(&ctx, 0, sizeof(ctx));
+            ctx.origin = a.min;
+            ctx.dir = dir;
+            ctx.first = true;
+            while (!rtree_raycast(tr, a.min, dir, 1, raycast_iter, &ctx)) {}
+            assert(ctx.count == 1 && ctx.tmin == expect.tmin);
+        }
+        total += expect.count;
+    }
+    assert(total > 0);
+    rtree_free(tr);
+}
+
+int double_compare(const void *a, const void *b) {
+    double x = *(double*)a;
+    double y = *(double*)b;
+    return x < y ? -1 : x > y;
+}
+
+void test_rtree_nearest(void) {
+    int N = 10000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    struct rect *rects;
+    double *dists;
+    while (!(rects = xmalloc(sizeof(struct rect)*N))) {}
+    while (!(dists = xmalloc(sizeof(double)*N))) {}
+    double point[2] = { 0, 0 };
+    struct rtree_nearest *it;
+    while (!(it = rtree_nearest_new(tr, point, INFINITY))) {}
+    assert(!rtree_nearest_next(it, NULL, NULL, NULL, NULL));
+    assert(rtree_nearest_done(it));
+    rtree_nearest_free(it);
+    for (int i = 0; i < N; i++) {
+        rects[i] = rand_rect();
+        while (!rtree_insert(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    for (int j = 0; j < 10; j++) {
+        struct rect rect = rand_rect();
+        for (int i = 0; i < N; i++) {
+            double d2 = 0;
+            for (int k = 0; k < 2; k++) {
+                double p = rect.min[k];
+                double d = p < rects[i].min[k] ? rects[i].min[k]-p :
+                           p > rects[i].max[k] ? p-rects[i].max[k] : 0;
+                d2 += d*d;
+            }
+            dists[i] = d2;
+        }
+        qsort(dists, N, sizeof(double), double_compare);
+        double maxdist = j%2 ? INFINITY : 20;
+        while (!(it = rtree_nearest_new(tr, rect.min, maxdist))) {}
+        int count = 0;
+        while (1) {
+            const double *min, *max;
+            void *data;
+            double dist2;
+            if (!rtree_nearest_next(it, &min, &max, &data, &dist2)) {
+                if (rtree_nearest_done(it)) break;
+                continue;
+            }
+            assert(dist2 == dists[count]);
+            int i = (int)(uintptr_t)data;
+            assert(min[0] == rects[i].min[0] && max[1] == rects[i].max[1]);
+            count++;
+        }
+        rtree_nearest_free(it);
+        int expect = N;
+        if (maxdist < INFINITY) {
+            expect = 0;
+            while (expect < N && dists[expect] <= maxdist*maxdist) expect++;
+        }
+        assert(count == expect);
+    }
+    rtree_free(tr);
+    xfree(rects);
+    xfree(dists);
+}
+
+struct inline_item {
+    uint64_t id;
+    double rect[4];
+};
+
+struct inline_ctx {
+    struct rect *rects;
+    bool *deleted;
+    int count;
+};
+
+bool inline_iter(const double *min, const double *max, const void *data, 
+    void *udata)
+{
+    struct inline_ctx *ctx = udata;
+    const struct inline_item *item = data;
+    assert(!ctx->deleted || !ctx->deleted[item->id]);
+    assert(memcmp(item->rect, &ctx->rects[item->id], sizeof(struct rect)) == 0);
+    assert(memcmp(min, ctx->rects[item->id].min, sizeof(double)*2) == 0);
+    assert(memcmp(max, ctx->rects[item->id].max, sizeof(double)*2) == 0);
+    ctx->count++;
+    return true;
+}
+
+int inline_count(struct rtree *tr, struct rect *rects, bool *deleted, int n,
+    const struct rect *window)
+{
+    int expect = 0;
+    for (int i = 0; i < n; i++) {
+        if ((!deleted || !deleted[i]) && 
+            !(rects[i].min[0] > window->max[0] || 
+              rects[i].max[0] < window->min[0] ||
+              rects[i].min[1] > window->max[1] || 
+              rects[i].max[1] < window->min[1]))
+        {
+            expect++;
+        }
+    }
+    struct inline_ctx ctx = { .rects = rects, .deleted = deleted };
+    rtree_search(tr, window->min, window->max, inline_iter, &ctx);
+    assert(ctx.count == expect);
+    return ctx.count;
+}
+
+void test_rtree_inline(void) {
+    assert(!rtree_new_with_item_size(0, xmalloc, xfree));
+    assert(!rtree_new_with_item_size(RTREE_MAX_ITEM_SIZE+1, xmalloc, xfree));
+    int N = 10000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_item_size(sizeof(struct inline_item), 
+        xmalloc, xfree))){}
+    struct rect *rects;
+    bool *deleted;
+    while (!(rects = xmalloc(sizeof(struct rect)*N))) {}
+    while (!(deleted = xmalloc(sizeof(bool)*N))) {}
+    memset(deleted, 0, sizeof(bool)*N);
+    for (int i = 0; i < N; i++) {
+        rects[i] = rand_rect();
+        struct inline_item item = { .id = (uint64_t)i };
+        memcpy(item.rect, &rects[i], sizeof(struct rect));
+        while (!rtree_insert(tr, rects[i].min, rects[i].max, &item)){}
+    }
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_check(tr));
+    assert(!rtree_journal_open(tr, "/dev/null", "/dev/null", 1));
+
+    // delete half of the items from a clone, leaving the original as it was
+    struct rtree *tr2;
+    while (!(tr2 = rtree_clone(tr))) {}
+    for (int i = 0; i < N; i += 2) {
+        // all of the bytes must match, not just the rect
+        struct inline_item item = { .id = (uint64_t)i+1 };
+        memcpy(item.rect, &rects[i], sizeof(struct rect));
+        while (!rtree_delete(tr2, rects[i].min, rects[i].max, &item)){}
+        item.id = (uint64_t)i;
+        while (!rtree_delete(tr2, rects[i].min, rects[i].max, &item)){}
+        deleted[i] = true;
+    }
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_count(tr2) == (size_t)N/2);
+    assert(rtree_check(tr));
+    assert(rtree_check(tr2));
+    int total[2] = { 0 };
+    for (int i = 0; i < 100; i++) {
+        struct rect window = rand_rect();
+        window.max[0] += rand_double()*50;
+        window.max[1] += rand_double()*50;
+        total[0] += inline_count(tr, rects, NULL, N, &window);
+        total[1] += inline_count(tr2, rects, deleted, N, &window);
+    }
+    assert(total[0] > total[1] && total[1] > 0);
+    struct inline_ctx ctx = { .rects = rects, .deleted = deleted };
+    rtree_scan(tr2, inline_iter, &ctx);
+    assert(ctx.count == N/2);
+    rtree_free(tr2);
+    rtree_free(tr);
+    xfree(deleted);
+    xfree(rects);
+}
+
+struct join_ctx {
+    size_t count;
+    size_t limit;
+    uint64_t sum;   // sum of the pairs, to compare against a brute force
+    bool self;      // sum the pairs with the lowest id first
+};
+
+uint64_t ids_item_id(const void *item, void *udata) {
+    (void)udata;
+    return (uint64_t)(uintptr_t)item;
+}
+
+struct ids_ctx {
+    struct rect *rects;
+    bool *live;
+    size_t count;
+};
+
+bool ids_iter(const double *min, const double *max, const void *data, 
+    void *udata)
+{
+    struct ids_ctx *ctx = udata;
+    uintptr_t i = (uintptr_t)data;
+    assert(ctx->live[i]);
+    assert(memcmp(min, ctx->rects[i].min, sizeof(double)*2) == 0);
+    assert(memcmp(max, ctx->rects[i].max, sizeof(double)*2) == 0);
+    ctx->count++;
+    return true;
+}
+
+// ids_check checks that the rtree has exactly the live items, with their 
+// rects.
+void ids_check(struct rtree *tr, struct rect *rects, bool *live, int n) {
+    size_t expect = 0;
+    for (int i = 0; i < n; i++) {
+        expect += live[i];
+    }
+    struct ids_ctx ctx = { .rects = rects, .live = live };
+    rtree_scan(tr, ids_iter, &ctx);
+    assert(ctx.count == expect);
+    assert(rtree_count(tr) == expect);
+    assert(rtree_check(tr));
+}
+
+// ids_move returns the rect moved by a bit, or shrunk to a part of itself, 
+// or the same.
+struct rect ids_move(struct rect rect) {
+    switch (rand()%3) {
+    case 0:
+        for (int j = 0; j < 2; j++) {
+            double d = rand_double()*2-1;
+            rect.min[j] += d;
+            rect.max[j] += d;
+        }
+        break;
+    case 1:
+        rect.max[0] = rect.min[0] + (rect.max[0]-rect.min[0])/2;
+        break;
+    }
+    return rect;
+}
+
+void test_rtree_ids(void) {
+    const char *snap = "ids.snap";
+    const char *path = "ids.log";
+    remove(snap);
+    remove(path);
+    int N = 10000;
+    struct rect *rects;
+    bool *live;
+    while (!(rects = xmalloc(sizeof(struct rect)*N))) {}
+    while (!(live = xmalloc(sizeof(bool)*N))) {}
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    assert(!rtree_delete_id(tr, 0));
+    while (!rtree_journal_open(tr, snap, path, 64)){}
+    // the index is built from the items that are already in the rtree
+    for (int i = 0; i < N; i++) {
+        rects[i] = rand_rect();
+        live[i] = true;
+        if (i == N/2) {
+            while (!rtree_set_item_id(tr, ids_item_id)){}
+        }
+        while (!rtree_insert(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    ids_check(tr, rects, live, N);
+
+    // update every item, with a clone that must not see the updates
+    struct rtree *tr2;
+    while (!(tr2 = rtree_clone(tr))) {}
+    struct rect *rects2;
+    while (!(rects2 = xmalloc(sizeof(struct rect)*N))) {}
+    memcpy(rects2, rects, sizeof(struct rect)*N);
+    for (int i = 0; i < N; i++) {
+        rects[i] = ids_move(rects[i]);
+        while (!rtree_update_id(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    ids_check(tr, rects, live, N);
+    ids_check(tr2, rects2, live, N);
+    rtree_free(tr2);
+    xfree(rects2);
+
+    // delete a third by ID, and some by rect, which also drops their IDs
+    for (int i = 0; i < N; i += 3) {
+        while (!rtree_delete_id(tr, (uint64_t)i)){}
+        while (!rtree_delete_id(tr, (uint64_t)i)){}
+        live[i] = false;
+        if (i+1 < N && i%2) {
+            while (!rtree_delete(tr, rects[i+1].min, rects[i+1].max, 
+                (void *)(uintptr_t)(i+1))){}
+            while (!rtree_delete_id(tr, (uint64_t)(i+1))){}
+            live[i+1] = false;
+        }
+    }
+    ids_check(tr, rects, live, N);
+    assert(rtree_journal_sync(tr));
+    struct rtree *tr3 = journal_recover(snap, path);
+    ids_check(tr3, rects, live, N);
+    rtree_free(tr3);
+
+    // updating an item that is gone inserts it
+    for (int i = 0; i < N; i += 3) {
+        while (!rtree_update_id(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+        live[i] = true;
+    }
+    ids_check(tr, rects, live, N);
+
+    // without the index
+    assert(rtree_set_item_id(tr, NULL));
+    assert(!rtree_delete_id(tr, 0));
+    assert(!rtree_update_id(tr, rects[0].min, rects[0].max, NULL));
+    rtree_free(tr);
+    remove(snap);
+    remove(path);
+    xfree(live);
+    xfree(rects);
+}
+
+bool join_iter(const double *amin, const double *amax, const void *adata,
+    const double *bmin, const double *bmax, const void *bdata, void *udata)
+{
+    struct join_ctx *ctx = udata;
+    for (int i = 0; i < 2; i++) {
+        assert(!(amin[i] > bmax[i] || amax[i] < bmin[i]));
+    }
+    uintptr_t x = (uintptr_t)adata;
+    uintptr_t y = (uintptr_t)bdata;
+    if (ctx->self) {
+        assert(x != y);
+        if (x > y) {
+            uintptr_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+    ctx->count++;
+    ctx->sum += x*100003+y;
+    return ctx->limit == 0 || ctx->count < ctx->limit;
+}
+
+struct join_search_ctx {
+    uintptr_t a;
+    struct join_ctx *ctx;
+};
+
+bool join_search_iter(const double *min, const double *max, const void *data,
+    void *udata)
+{
+    (void)min; (void)max;
+    struct join_search_ctx *jctx = udata;
+    if (jctx->ctx->self && (uintptr_t)data <= jctx->a) {
+        return true;
+    }
+    jctx->ctx->count++;
+    jctx->ctx->sum += jctx->a*100003+(uintptr_t)data;
+    return true;
+}
+
+// ref_check checks that the searches of an rtree find the same items as a
+// plain reference rtree.
+void ref_check(struct rtree *tr, struct rtree *ref) {
+    assert(rtree_check(tr));
+    assert(rtree_count(tr) == rtree_count(ref));
+    double queries[8*4];
+    size_t counts[8], expect[8];
+    for (int q = 0; q < 8; q++) {
+        fill_rand_rect(&queries[q*4]);
+        queries[q*4+2] += rand_double()*40;
+        queries[q*4+3] += rand_double()*40;
+        double *min = &queries[q*4];
+        double *max = &queries[q*4+2];
+        struct search_sum_ctx a = { 0 }, b = { 0 };
+        rtree_search(tr, min, max, search_sum_iter, &a);
+        rtree_search(ref, min, max, search_sum_iter, &b);
+        assert(a.count == b.count && a.sum == b.sum);
+        expect[q] = b.count;
+        uint64_t sum = b.sum;
+        memset(&a, 0, sizeof(a));
+        memset(&b, 0, sizeof(b));
+        rtree_search_contained(tr, min, max, search_sum_iter, &a);
+        rtree_search_contained(ref, min, max, search_sum_iter, &b);
+        assert(a.count == b.count && a.sum == b.sum);
+        memset(&a, 0, sizeof(a));
+        void *items[7];
+        struct rtree_cursor cursor = { 0 };
+        while (!cursor.done) {
+            size_t n = rtree_search_collect(tr, min, max, items, NULL, 7, 
+                &cursor);
+            for (size_t i = 0; i < n; i++) {
+                a.count++;
+                a.sum += (uintptr_t)items[i];
+            }
+        }
+        assert(a.count == expect[q] && a.sum == sum);
+    }
+    struct search_many_ctx mctx = { .counts = counts };
+    memset(counts, 0, sizeof(counts));
+    while (!rtree_search_many(tr, queries, 8, search_many_iter, &mctx)) {}
+    assert(memcmp(counts, expect, sizeof(counts)) == 0);
+    memset(counts, 0, sizeof(counts));
+    rtree_search_pipelined(tr, queries, 8, search_many_iter, &mctx);
+    assert(memcmp(counts, expect, sizeof(counts)) == 0);
+    struct search_sum_ctx ctxs[2];
+    void *udatas[2] = { &ctxs[0], &ctxs[1] };
+    do {
+        memset(ctxs, 0, sizeof(ctxs));
+    } while (!rtree_search_parallel(tr, &queries[0], &queries[2], 2, 
+        search_sum_iter, udatas));
+    assert(ctxs[0].count+ctxs[1].count == expect[0]);
+
+    // the nearest items come in the same order
+    struct rtree_nearest *it, *it2;
+    while (!(it = rtree_nearest_new(tr, queries, INFINITY))) {}
+    while (!(it2 = rtree_nearest_new(ref, queries, INFINITY))) {}
+    for (size_t k = 0; k < 50 && k < rtree_count(ref); k++) {
+        double d1, d2;
+        while (!rtree_nearest_next(it, NULL, NULL, NULL, &d1)) {
+            assert(!rtree_nearest_done(it));
+        }
+        while (!rtree_nearest_next(it2, NULL, NULL, NULL, &d2)) {
+            assert(!rtree_nearest_done(it2));
+        }
+        assert(d1 == d2);
+    }
+    rtree_nearest_free(it);
+    rtree_nearest_free(it2);
+
+    // the self join sees every pair once
+    struct join_ctx ja = { .self = true }, jb = { .self = true };
+    rtree_self_join(tr, join_iter, &ja);
+    rtree_self_join(ref, join_iter, &jb);
+    assert(ja.count == jb.count && ja.sum == jb.sum);
+}
+
+void test_rtree_buffer(void) {
+    int N = 5000;
+    struct rect *rects;
+    while (!(rects = xmalloc(sizeof(struct rect)*N))) {}
+    struct rtree *tr, *ref;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!(ref = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_set_write_buffer(tr, 300)) {}
+    ref_check(tr, ref);
+    for (int i = 0; i < N; i++) {
+        rects[i] = rand_rect();
+        rects[i].max[0] = rects[i].min[0] + rand_double()*5;
+        rects[i].max[1] = rects[i].min[1] + rand_double()*5;
+        while (!rtree_insert(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+        while (!rtree_insert(ref, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+        if (i%1000 == 150) {
+            ref_check(tr, ref);
+        }
+    }
+    ref_check(tr, ref);
+
+    // a clone keeps its items while the buffered ones are deleted
+    struct rtree *tr2;
+    while (!(tr2 = rtree_clone(tr))) {}
+    for (int i = N-1; i >= 0; i -= 2) {
+        while (!rtree_delete(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+        while (!rtree_delete(ref, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+        if (i == N/2) {
+            rtree_set_lazy_delete(tr, true);
+        }
+    }
+    ref_check(tr, ref);
+    assert(rtree_count(tr2) == (size_t)N);
+    assert(rtree_check(tr2));
+    rtree_free(tr2);
+    while (!rtree_compact(tr, 0)) {}
+    ref_check(tr, ref);
+
+    // the index finds the items in the buffer and in the main tree, and 
+    // updates leave a clone that shares the buffer as it was
+    rtree_set_lazy_delete(tr, false);
+    while (!rtree_set_item_id(tr, ids_item_id)) {}
+    struct rtree *ref2;
+    while (!(tr2 = rtree_clone(tr))) {}
+    while (!(ref2 = rtree_clone(ref))) {}
+    for (int i = 0; i < N; i += 2) {
+        struct rect rect = ids_move(rects[i]);
+        if (i%8 == 2) {
+            while (!rtree_delete_id(tr, (uint64_t)i)){}
+        } else {
+            while (!rtree_update_id(tr, rect.min, rect.max, 
+                (void *)(uintptr_t)i)){}
+        }
+        while (!rtree_delete(ref, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+        if (i%8 != 2) {
+            while (!rtree_insert(ref, rect.min, rect.max, 
+                (void *)(uintptr_t)i)){}
+        }
+        rects[i] = rect;
+    }
+    ref_check(tr, ref);
+    ref_check(tr2, ref2);
+    rtree_free(tr2);
+    rtree_free(ref2);
+    assert(rtree_set_item_id(tr, NULL));
+
+    // flushing moves the items into the main tree
+    while (!rtree_flush(tr)) {}
+    ref_check(tr, ref);
+    for (int i = 0; i < 100; i++) {
+        while (!rtree_insert(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)(N+i))){}
+        while (!rtree_insert(ref, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)(N+i))){}
+    }
+    while (!rtree_set_write_buffer(tr, 0)) {}
+    ref_check(tr, ref);
+    rtree_free(tr);
+    rtree_free(ref);
+    xfree(rects);
+}
+
+// insert_many inserts a batch, which copies too many nodes to get through
+// the random allocation failures, so it is let through after a few tries.
+// Each failed try must leave the rtree as it was.
+void insert_many(struct rtree *tr, double *mins, double *maxs, void **datas,
+    int n)
+{
+    bool fail = rand_alloc_fail;
+    size_t count = rtree_count(tr);
+    for (int i = 0; !rtree_insert_many(tr, mins, maxs, 
+        (const void *const *)datas, n); i++) 
+    {
+        assert(rtree_count(tr) == count);
+        assert(rtree_check(tr));
+        if (i == 3) {
+            rand_alloc_fail = false;
+        }
+    }
+    rand_alloc_fail = fail;
+}
+
+void test_rtree_insert_many(void) {
+    const char *snap = "many.snap";
+    const char *path = "many.log";
+    remove(snap);
+    remove(path);
+    int N = 20000;
+    double *mins, *maxs;
+    void **datas;
+    while (!(mins = xmalloc(sizeof(double)*2*N))) {}
+    while (!(maxs = xmalloc(sizeof(double)*2*N))) {}
+    while (!(datas = xmalloc(sizeof(void *)*N))) {}
+    for (int i = 0; i < N; i++) {
+        struct rect rect = rand_rect();
+        memcpy(&mins[i*2], rect.min, sizeof(double)*2);
+        memcpy(&maxs[i*2], rect.max, sizeof(double)*2);
+        datas[i] = (void *)(uintptr_t)i;
+    }
+    struct rtree *tr, *ref;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!(ref = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_journal_open(tr, snap, path, 64)){}
+    while (!rtree_set_item_id(tr, ids_item_id)){}
+    assert(rtree_insert_many(tr, mins, maxs, (const void *const *)datas, 0));
+
+    // batches of all sizes, smaller and larger than the journal group
+    int sizes[] = { 1, 7, 63, 64, 65, 500, 3000 };
+    int i = 0;
+    for (int k = 0; i < N/2; k++) {
+        int n = sizes[k%7] < N/2-i ? sizes[k%7] : N/2-i;
+        insert_many(tr, &mins[i*2], &maxs[i*2], &datas[i], n);
+        for (int j = i; j < i+n; j++) {
+            while (!rtree_insert(ref, &mins[j*2], &maxs[j*2], datas[j])){}
+        }
+        i += n;
+        if (k%5 == 0) {
+            ref_check(tr, ref);
+        }
+    }
+    ref_check(tr, ref);
+
+    // into a clone, which leaves the original as it was
+    struct rtree *tr2;
+    while (!(tr2 = rtree_clone(tr))) {}
+    insert_many(tr2, &mins[i*2], &maxs[i*2], &datas[i], N-i);
+    assert(rtree_count(tr2) == (size_t)N);
+    assert(rtree_check(tr2));
+    ref_check(tr, ref);
+    rtree_free(tr2);
+
+    // points, and the index and journal see every item
+    insert_many(tr, &mins[i*2], NULL, &datas[i], N-i);
+    for (int j = i; j < N; j++) {
+        while (!rtree_insert(ref, &mins[j*2], NULL, datas[j])){}
+    }
+    ref_check(tr, ref);
+    for (int j = 0; j < N; j += 3) {
+        while (!rtree_delete_id(tr, (uint64_t)j)){}
+        while (!rtree_delete(ref, &mins[j*2], j < i ? &maxs[j*2] : NULL, 
+            datas[j])){}
+    }
+    ref_check(tr, ref);
+    assert(rtree_journal_sync(tr));
+    struct rtree *tr3 = journal_recover(snap, path);
+    ref_check(tr3, ref);
+    rtree_free(tr3);
+    rtree_free(tr);
+    rtree_free(ref);
+    remove(snap);
+    remove(path);
+    xfree(mins);
+    xfree(maxs);
+    xfree(datas);
+}
+
+// merge merges src into the rtree, letting it through the random allocation
+// failures after a few tries, like insert_many. Each failed try must leave
+// both rtrees as they were.
+void merge(struct rtree *tr, struct rtree *src) {
+    bool fail = rand_alloc_fail;
+    size_t count = rtree_count(tr);
+    size_t src_count = rtree_count(src);
+    for (int i = 0; !rtree_merge(tr, src); i++) {
+        assert(rtree_count(tr) == count);
+        assert(rtree_check(tr));
+        if (i == 3) {
+            rand_alloc_fail = false;
+        }
+    }
+    rand_alloc_fail = fail;
+    assert(rtree_count(tr) == count+src_count);
+    assert(rtree_count(src) == src_count);
+    assert(rtree_check(src));
+}
+
+void test_rtree_merge(void) {
+    const char *snap = "merge.snap";
+    const char *path = "merge.log";
+    remove(snap);
+    remove(path);
+    int N = 20000;
+    struct rect *rects;
+    while (!(rects = xmalloc(sizeof(struct rect)*N))) {}
+    struct rtree *tr, *ref;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!(ref = rtree_new_with_allocator(xmalloc, xfree))){}
+
+    // regions of different sizes, each indexed on its own
+    int starts[] = { 0, N/2, N/2+N/4, N/2+N/4+N/16, N };
+    struct rtree *parts[4];
+    for (int r = 0; r < 4; r++) {
+        while (!(parts[r] = rtree_new_with_allocator(xmalloc, xfree))){}
+        for (int i = starts[r]; i < starts[r+1]; i++) {
+            rects[i].min[0] = -180 + r*90 + rand_double()*85;
+            rects[i].min[1] = -90 + rand_double()*175;
+            rects[i].max[0] = rects[i].min[0] + rand_double()*2;
+            rects[i].max[1] = rects[i].min[1] + rand_double()*2;
+            while (!rtree_insert(parts[r], rects[i].min, rects[i].max, 
+                (void *)(uintptr_t)i)){}
+            while (!rtree_insert(ref, rects[i].min, rects[i].max, 
+                (void *)(uintptr_t)i)){}
+        }
+    }
+    for (int r = 0; r < 4; r++) {
+        merge(tr, parts[r]);
+    }
+    ref_check(tr, ref);
+
+    // the merged rtree keeps its items when the regions are changed or freed
+    for (int i = starts[1]; i < starts[2]; i += 2) {
+        while (!rtree_delete(parts[1], rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    for (int r = 0; r < 4; r++) {
+        rtree_free(parts[r]);
+    }
+    ref_check(tr, ref);
+
+    // overlapping items, with tombstones and a write buffer
+    struct rtree *src;
+    while (!(src = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_set_write_buffer(src, 300)) {}
+    rtree_set_lazy_delete(src, true);
+    for (int i = 0; i < 3000; i++) {
+        struct rect rect = rand_rect();
+        while (!rtree_insert(src, rect.min, rect.max, 
+            (void *)(uintptr_t)(N+i))){}
+        if (i%3 == 0) {
+            while (!rtree_delete(src, rect.min, rect.max, 
+                (void *)(uintptr_t)(N+i))){}
+        } else {
+            while (!rtree_insert(ref, rect.min, rect.max, 
+                (void *)(uintptr_t)(N+i))){}
+        }
+    }
+    merge(tr, src);
+    ref_check(tr, ref);
+    rtree_free(src);
+
+    // a taller rtree into a small one, which the index and journal follow
+    struct rtree *small, *ref2;
+    while (!(small = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!(ref2 = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_journal_open(small, snap, path, 64)){}
+    while (!rtree_set_item_id(small, ids_item_id)){}
+    for (int i = 0; i < 50; i++) {
+        struct rect rect = rand_rect();
+        while (!rtree_insert(small, rect.min, rect.max, 
+            (void *)(uintptr_t)(2*N+i))){}
+        while (!rtree_insert(ref2, rect.min, rect.max, 
+            (void *)(uintptr_t)(2*N+i))){}
+    }
+    for (int i = 0; i < N; i++) {
+        while (!rtree_insert(ref2, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    struct rtree *big;
+    while (!(big = rtree_new_with_allocator(xmalloc, xfree))){}
+    for (int r = 0; r < 4; r++) {
+        while (!(parts[r] = rtree_new_with_allocator(xmalloc, xfree))){}
+        for (int i = starts[r]; i < starts[r+1]; i++) {
+            while (!rtree_insert(parts[r], rects[i].min, rects[i].max, 
+                (void *)(uintptr_t)i)){}
+        }
+        merge(big, parts[r]);
+        rtree_free(parts[r]);
+    }
+    merge(small, big);
+    rtree_free(big);
+    ref_check(small, ref2);
+    for (int i = 0; i < N; i += 3) {
+        while (!rtree_delete_id(small, (uint64_t)i)){}
+        while (!rtree_delete(ref2, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    ref_check(small, ref2);
+    assert(rtree_journal_sync(small));
+    struct rtree *tr2 = journal_recover(snap, path);
+    ref_check(tr2, ref2);
+    rtree_free(tr2);
+    rtree_free(small);
+    rtree_free(ref2);
+    rtree_free(tr);
+    rtree_free(ref);
+    remove(snap);
+    remove(path);
+    xfree(rects);
+}
+
+// partition splits the rtree into k parts, letting it through the random
+// allocation failures after a few tries, like insert_many.
+void partition(struct rtree *tr, int k, struct rtree **parts) {
+    bool fail = rand_alloc_fail;
+    for (int i = 0; !rtree_partition(tr, k, parts); i++) {
+        assert(rtree_check(tr));
+        if (i == 3) {
+            rand_alloc_fail = false;
+        }
+    }
+    rand_alloc_fail = fail;
+}
+
+void test_rtree_partition(void) {
+    int N = 20000;
+    struct rect *rects;
+    while (!(rects = xmalloc(sizeof(struct rect)*N))) {}
+    struct rtree *tr, *ref;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!(ref = rtree_new_with_allocator(xmalloc, xfree))){}
+    struct rtree *parts[8];
+    assert(!rtree_partition(tr, 0, parts));
+    assert(!rtree_partition(tr, -1, parts));
+    partition(tr, 3, parts);
+    for (int p = 0; p < 3; p++) {
+        assert(rtree_count(parts[p]) == 0);
+        rtree_free(parts[p]);
+    }
+    while (!rtree_set_write_buffer(tr, 300)) {}
+    while (!rtree_set_item_id(tr, ids_item_id)) {}
+    rtree_set_lazy_delete(tr, true);
+    for (int i = 0; i < N; i++) {
+        rects[i] = rand_rect();
+        while (!rtree_insert(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+        while (!rtree_insert(ref, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    for (int i = 0; i < N; i += 5) {
+        while (!rtree_delete(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+        while (!rtree_delete(ref, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    size_t count = rtree_count(ref);
+
+    // the parts hold every item once, in about equal numbers
+    int ks[] = { 1, 3, 8 };
+    for (int t = 0; t < 3; t++) {
+        int k = ks[t];
+        partition(tr, k, parts);
+        struct search_sum_ctx all = { 0 };
+        for (int p = 0; p < k; p++) {
+            assert(rtree_check(parts[p]));
+            size_t n = rtree_count(parts[p]);
+            assert(n > count/k/2 && n < count/k*3/2);
+            struct search_sum_ctx ctx = { 0 };
+            rtree_scan(parts[p], search_sum_iter, &ctx);
+            assert(ctx.count == n);
+            all.count += ctx.count;
+            all.sum += ctx.sum;
+        }
+        struct search_sum_ctx expect = { 0 };
+        rtree_scan(ref, search_sum_iter, &expect);
+        assert(all.count == expect.count && all.sum == expect.sum);
+        if (t < 2) {
+            for (int p = 0; p < k; p++) {
+                rtree_free(parts[p]);
+            }
+        }
+    }
+    ref_check(tr, ref);
+
+    // the parts and the rtree change on their own
+    for (int i = 1; i < N; i += 5) {
+        for (int p = 0; p < 8; p++) {
+            if (rtree_count(parts[p]) > 0) {
+                while (!rtree_delete_id(parts[p], (uint64_t)i)){}
+            }
+        }
+    }
+    size_t left = 0;
+    for (int p = 0; p < 8; p++) {
+        assert(rtree_check(parts[p]));
+        left += rtree_count(parts[p]);
+    }
+    assert(left == count-N/5);
+    ref_check(tr, ref);
+    rtree_free(tr);
+    for (int p = 0; p < 8; p++) {
+        assert(rtree_check(parts[p]));
+        rtree_free(parts[p]);
+    }
+    rtree_free(ref);
+    xfree(rects);
+}
+
+void test_rtree_join(void) {
+    int NA = 5000;
+    int NB = 2000;
+    struct rtree *a;
+    struct rtree *b;
+    while (!(a = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!(b = rtree_new_with_allocator(xmalloc, xfree))){}
+    struct rect *rects;
+    while (!(rects = xmalloc(sizeof(struct rect)*NA))) {}
+    for (int i = 0; i < NA; i++) {
+        rects[i] = rand_rect();
+        while (!rtree_insert(a, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    struct join_ctx ctx = { 0 };
+    rtree_join(a, b, join_iter, &ctx);
+    assert(ctx.count == 0);
+    for (int i = 0; i < NB; i++) {
+        // larger rects, in a tree of a different height
+        struct rect rect = rand_rect();
+        rect.max[0] += rand_double()*10;
+        rect.max[1] += rand_double()*10;
+        while (!rtree_insert(b, rect.min, rect.max, (void *)(uintptr_t)i)){}
+    }
+    struct join_ctx expect = { 0 };
+    for (int i = 0; i < NA; i++) {
+        struct join_search_ctx jctx = { .a = (uintptr_t)i, .ctx = &expect };
+        rtree_search(b, rects[i].min, rects[i].max, join_search_iter, &jctx);
+    }
+    assert(expect.count > 0);
+    rtree_join(a, b, join_iter, &ctx);
+    assert(ctx.count == expect.count && ctx.sum == expect.sum);
+
+    // stop early
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.limit = 10;
+    rtree_join(a, b, join_iter, &ctx);
+    assert(ctx.count == 10);
+
+    // parallel, with a context per thread
+    for (int nthreads = 1; nthreads <= 4; nthreads++) {
+        struct join_ctx ctxs[4];
+        void *udatas[4] = { &ctxs[0], &ctxs[1], &ctxs[2], &ctxs[3] };
+        do {
+            memset(ctxs, 0, sizeof(ctxs));
+        } while (!rtree_join_parallel(a, b, nthreads, join_iter, udatas));
+        memset(&ctx, 0, sizeof(ctx));
+        for (int i = 0; i < nthreads; i++) {
+            ctx.count += ctxs[i].count;
+            ctx.sum += ctxs[i].sum;
+        }
+        assert(ctx.count == expect.count && ctx.sum == expect.sum);
+    }
+
+    // self join
+    memset(&expect, 0, sizeof(expect));
+    expect.self = true;
+    for (int i = 0; i < NA; i++) {
+        struct join_search_ctx jctx = { .a = (uintptr_t)i, .ctx = &expect };
+        rtree_search(a, rects[i].min, rects[i].max, join_search_iter, &jctx);
+    }
+    assert(expect.count > 0);
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.self = true;
+    rtree_self_join(a, join_iter, &ctx);
+    assert(ctx.count == expect.count && ctx.sum == expect.sum);
+    struct join_ctx ctxs[3];
+    void *udatas[3] = { &ctxs[0], &ctxs[1], &ctxs[2] };
+    do {
+        memset(ctxs, 0, sizeof(ctxs));
+        for (int i = 0; i < 3; i++) {
+            ctxs[i].self = true;
+        }
+    } while (!rtree_join_parallel(a, NULL, 3, join_iter, udatas));
+    assert(ctxs[0].count+ctxs[1].count+ctxs[2].count == expect.count);
+    assert(ctxs[0].sum+ctxs[1].sum+ctxs[2].sum == expect.sum);
+
+    rtree_free(a);
+    rtree_free(b);
+    xfree(rects);
+}
+
+void test_rtree_stats(void) {
+    int N = 10000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    struct rtree_stats stats;
+    rtree_stats(tr, &stats);
+    assert(stats.count == 0 && stats.nodes == 0 && stats.height == 0);
+    for (int i = 0; i < N; i++) {
+        struct rect rect = rand_rect();
+        while (!rtree_insert(tr, rect.min, rect.max, (void *)(uintptr_t)i)){}
+    }
+    rtree_stats(tr, &stats);
+    assert(stats.count == (size_t)N);
+    assert(stats.height > 1);
+    assert(stats.levels[0].nodes == 1);
+    size_t nodes = 0;
+    size_t fill = 0;
+    for (size_t i = 0; i < stats.height; i++) {
+        assert(stats.levels[i].nodes > 0);
+        assert(stats.levels[i].overlap >= 0);
+        assert(stats.levels[i].dead_space >= 0);
+        nodes += stats.levels[i].nodes;
+        if (i > 0) {
+            assert(stats.levels[i].nodes == stats.levels[i-1].entries);
+        }
+    }
+    for (int i = 0; i < 10; i++) {
+        fill += stats.fill[i];
+    }
+    assert(stats.levels[stats.height-1].entries == (size_t)N);
+    assert(stats.levels[stats.height].nodes == 0);
+    assert(nodes == stats.nodes && fill == stats.nodes);
+    assert(stats.bytes > stats.nodes);
+    assert(stats.shared_bytes == 0);
+
+    // Everything is shared right after a clone, until the clone diverges.
+    struct rtree *tr2;
+    while (!(tr2 = rtree_clone(tr))){}
+    struct rtree_stats stats2;
+    rtree_stats(tr2, &stats2);
+    assert(stats2.bytes == stats.bytes);
+    size_t overhead = stats2.bytes - stats2.shared_bytes; // the rtree itself
+    assert(overhead > 0 && overhead < stats2.shared_bytes/stats2.nodes);
+    struct rect rect = rand_rect();
+    while (!rtree_insert(tr2, rect.min, rect.max, NULL)){}
+    struct rtree_stats stats3;
+    rtree_stats(tr2, &stats3);
+    assert(stats3.shared_bytes < stats2.shared_bytes);
+    assert(stats3.shared_bytes > 0);
+    rtree_free(tr2);
+    rtree_free(tr);
+}
+
+void test_rtree_query_stats(void) {
+    struct rtree_query_stats qs;
+#ifndef RTREE_INSTRUMENT
+    assert(!rtree_query_stats(&qs));
+    return;
+#endif
+    int N = 10000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    struct rect *rects;
+    while (!(rects = xmalloc(sizeof(struct rect)*N))) {}
+    for (int i = 0; i < N; i++) {
+        rects[i] = rand_rect();
+        while (!rtree_insert(tr, rects[i].min, rects[i].max, 
+            (void *)(uintptr_t)i)){}
+    }
+    struct iter_scan_all_ctx ctx = { 0 };
+    rtree_search(tr, (double[2]){ -10, -10 }, (double[2]){ 10, 10 }, 
+        iter_scan_all, &ctx);
+    assert(rtree_query_stats(&qs));
+    assert(qs.nodes[0] == 1);
+    assert(qs.items_returned == ctx.count);
+    assert(qs.rect_hits >= qs.items_returned);
+    assert(qs.rect_tests >= qs.rect_hits);
+    assert(qs.items_examined >= qs.items_returned);
+
+    memset(&ctx, 0, sizeof(ctx));
+    rtree_scan(tr, iter_scan_all, &ctx);
+    assert(rtree_query_stats(&qs));
+    assert(qs.items_returned == (size_t)N && qs.items_examined == (size_t)N);
+    assert(qs.rect_tests == 0);
+
+    while (!rtree_delete(tr, rects[0].min, rects[0].max, (void *)0)){}
+    assert(rtree_query_stats(&qs));
+    assert(qs.items_returned == 1);
+    assert(qs.nodes[0] == 1);
+
+    // the raycast takes its nodes off a queue, and counts each at its level
+    double origin[2] = { -180, 0 };
+    double dir[2] = { 360, 0 };
+    struct raycast_ctx rctx;
+    do {
+        rctx = (struct raycast_ctx){ .origin = origin, .dir = dir };
+    } while (!rtree_raycast(tr, origin, dir, 1, raycast_iter, &rctx));
+    assert(rtree_query_stats(&qs));
+    assert(qs.nodes[0] == 1);
+    assert(qs.nodes[1] > 0);
+    assert(qs.items_returned == rctx.count);
+
+    rtree_free(tr);
+    xfree(rects);
+}
+
 void test_rtree_various(void) {
     struct rtree *tr = rtree_new();
     assert(tr);
@@ -259,6 +1864,24 @@ int main(int argc, char **argv) {
     do_chaos_test(test_rtree_ops);
     do_chaos_test(test_rtree_cities_svg);
     do_chaos_test(test_rtree_predef_svg);
+    do_chaos_test(test_rtree_journal);
+    do_chaos_test(test_rtree_trace);
+    do_chaos_test(test_rtree_search_many);
+    do_chaos_test(test_rtree_search_parallel);
+    do_chaos_test(test_rtree_search_collect);
+    do_chaos_test(test_rtree_search_contain);
+    do_chaos_test(test_rtree_search_custom);
+    do_chaos_test(test_rtree_raycast);
+    do_chaos_test(test_rtree_nearest);
+    do_chaos_test(test_rtree_inline);
+    do_chaos_test(test_rtree_ids);
+    do_chaos_test(test_rtree_buffer);
+    do_chaos_test(test_rtree_insert_many);
+    do_chaos_test(test_rtree_merge);
+    do_chaos_test(test_rtree_partition);
+    do_chaos_test(test_rtree_join);
+    do_chaos_test(test_rtree_stats);
+    do_chaos_test(test_rtree_query_stats);
     do_test(test_rtree_various);
 
     return 0;
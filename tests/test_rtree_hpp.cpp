@@ -0,0 +1,220 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <new>
+#include <vector>
+#include "../rtree.hpp"
+
+// When chaos is on, one out of three allocations fails.
+static bool chaos = false;
+static long allocs = 0;
+
+void *operator new(size_t size) {
+    if (chaos && rand()%3 == 0) {
+        throw std::bad_alloc();
+    }
+    void *ptr = malloc(size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    allocs++;
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    if (ptr) {
+        allocs--;
+        free(ptr);
+    }
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+#define do_chaos_test(name) { \
+    if (argc < 2 || strstr(#name, argv[1])) { \
+        printf("%s\n", #name); \
+        long start = allocs; \
+        chaos = true; \
+        name(); \
+        chaos = false; \
+        assert(allocs == start); \
+    } \
+}
+
+// retry runs the code until it does not throw std::bad_alloc.
+#define retry(code) { \
+    while (1) { \
+        try { code; break; } catch (const std::bad_alloc &) {} \
+    } \
+}
+
+static double rand_double() {
+    return (double)rand() / RAND_MAX;
+}
+
+template <int Dims>
+struct box {
+    double min[Dims];
+    double max[Dims];
+};
+
+template <int Dims>
+static box<Dims> rand_box(double size) {
+    box<Dims> b;
+    for (int i = 0; i < Dims; i++) {
+        b.min[i] = rand_double() * 100;
+        b.max[i] = b.min[i] + rand_double() * size;
+    }
+    return b;
+}
+
+template <int Dims>
+static bool box_intersects(const box<Dims> &a, const box<Dims> &b) {
+    for (int i = 0; i < Dims; i++) {
+        if (a.min[i] > b.max[i] || a.max[i] < b.min[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// check_search compares a search of every window against a brute force scan
+// of the live boxes.
+template <class Tree, int Dims>
+static void check_search(const Tree &tr, const std::vector<box<Dims>> &boxes,
+    const std::vector<bool> &live)
+{
+    for (int j = 0; j < 20; j++) {
+        box<Dims> w = rand_box<Dims>(20);
+        size_t expect = 0;
+        for (size_t i = 0; i < boxes.size(); i++) {
+            if (live[i] && box_intersects(boxes[i], w)) {
+                expect++;
+            }
+        }
+        size_t count = 0;
+        tr.search(w.min, w.max, [&](const double *min, const double *max,
+            const int &value)
+        {
+            assert(live[value]);
+            assert(memcmp(min, boxes[value].min, sizeof(double)*Dims) == 0);
+            assert(memcmp(max, boxes[value].max, sizeof(double)*Dims) == 0);
+            assert(box_intersects(boxes[value], w));
+            count++;
+            return true;
+        });
+        assert(count == expect);
+    }
+}
+
+template <int Dims>
+static void ops(void) {
+    int N = 5000;
+    rtree_cpp::rtree<int, Dims, double, 16> tr;
+    std::vector<box<Dims>> boxes;
+    std::vector<bool> live;
+    chaos = false;
+    boxes.reserve(N);
+    live.resize(N);
+    chaos = true;
+    for (int i = 0; i < N; i++) {
+        boxes.push_back(rand_box<Dims>(i%2 ? 0 : 5));
+        retry(tr.insert(boxes[i].min, boxes[i].max, i));
+        live[i] = true;
+    }
+    assert((int)tr.size() == N);
+    assert(tr.height() > 1);
+    double min[Dims], max[Dims];
+    assert(tr.bounds(min, max));
+    for (int i = 0; i < N; i++) {
+        for (int k = 0; k < Dims; k++) {
+            assert(!(boxes[i].min[k] < min[k] || boxes[i].max[k] > max[k]));
+        }
+    }
+    check_search<decltype(tr), Dims>(tr, boxes, live);
+
+    // stop early
+    int count = 0;
+    assert(!tr.scan([&](const double *, const double *, const int &) {
+        return ++count < 10;
+    }));
+    assert(count == 10);
+
+    // delete half of the items, including ones that do not exist
+    for (int i = 0; i < N; i += 2) {
+        assert(!tr.remove(boxes[i].min, boxes[i].max, -1));
+        assert(tr.remove(boxes[i].min, boxes[i].max, i));
+        assert(!tr.remove(boxes[i].min, boxes[i].max, i));
+        live[i] = false;
+    }
+    assert((int)tr.size() == N/2);
+    check_search<decltype(tr), Dims>(tr, boxes, live);
+    count = 0;
+    tr.scan([&](const double *, const double *, const int &value) {
+        assert(live[value]);
+        count++;
+        return true;
+    });
+    assert(count == N/2);
+
+    // move the tree and delete the rest
+    decltype(tr) tr2(std::move(tr));
+    assert(tr.size() == 0 && tr.empty());
+    assert(!tr.bounds(min, max));
+    for (int i = 1; i < N; i += 2) {
+        assert(tr2.remove(boxes[i].min, boxes[i].max, i));
+    }
+    assert(tr2.empty() && tr2.height() == 0);
+    chaos = false;
+    std::vector<box<Dims>>().swap(boxes);
+    std::vector<bool>().swap(live);
+    chaos = true;
+}
+
+void test_rtree_hpp_ops(void) {
+    ops<2>();
+    ops<3>();
+}
+
+void test_rtree_hpp_move_only(void) {
+    int N = 2000;
+    rtree_cpp::rtree<std::unique_ptr<int>, 2, float, 8> tr;
+    for (int i = 0; i < N; i++) {
+        float point[2] = { (float)(i%50), (float)(i/50) };
+        std::unique_ptr<int> value;
+        retry(value.reset(new int(i)));
+        retry(tr.insert(point, nullptr, std::move(value)));
+    }
+    assert((int)tr.size() == N);
+    float min[2] = { 10, 10 };
+    float max[2] = { 19, 19 };
+    int count = 0;
+    tr.search(min, max, [&](const float *min, const float *,
+        const std::unique_ptr<int> &value)
+    {
+        assert(*value == (int)min[1]*50 + (int)min[0]);
+        count++;
+        return true;
+    });
+    assert(count == 100);
+    for (int i = 0; i < N; i += 3) {
+        float point[2] = { (float)(i%50), (float)(i/50) };
+        assert(tr.remove_if(point, nullptr,
+            [i](const std::unique_ptr<int> &value) { return *value == i; }));
+    }
+    assert(tr.size() == (size_t)(N - (N+2)/3));
+    tr.clear();
+    assert(tr.empty());
+}
+
+int main(int argc, char **argv) {
+    srand(getenv("SEED") ? atoi(getenv("SEED")) : time(NULL));
+    do_chaos_test(test_rtree_hpp_ops);
+    do_chaos_test(test_rtree_hpp_move_only);
+    return 0;
+}
@@ -0,0 +1,4 @@
+// The tests of test_int.c with unsigned coordinates.
+
+#define RTREE_UINT32
+#include "test_int.c"